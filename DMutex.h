@@ -0,0 +1,250 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DMutex_H
+#define _DMutex_H
+
+#include <stdint.h>
+#include <atomic>
+
+#if defined(__linux__)
+#define DMUTEX_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#elif defined(__APPLE__)
+#define DMUTEX_UNFAIR_LOCK
+#include <os/lock.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// the counters are only written by the thread holding the mutex, so a
+// relaxed load and store is enough
+#ifdef DMUTEX_STATS
+#define DMUTEX_ADD( counter, n ) counter.store( counter.load( std::memory_order_relaxed )+(n), std::memory_order_relaxed )
+#else
+#define DMUTEX_ADD( counter, n ) (void)(n)
+#endif
+#define DMUTEX_COUNT( counter ) DMUTEX_ADD( counter, 1 )
+
+/// size the mutex is padded to, so that a contended mutex doesn't share a
+/// cache line with the data it guards (or with another mutex)
+#if defined(__APPLE__) && defined(__aarch64__)
+#define DMUTEX_CACHE_LINE 128
+#else
+#define DMUTEX_CACHE_LINE 64
+#endif
+
+/** DMutex
+
+ lightweight mutual exclusion lock for short critical sections. unlike
+ DSemaphore it needs no kernel object: an uncontended Lock()/Unlock() is a
+ single atomic compare-exchange and exchange. if the lock is held, Lock()
+ spins for a while (spin_count pause instructions), in case the holder is
+ about to release it, and then parks the thread in the kernel -- on a futex
+ on Linux, in os_unfair_lock on OSX, in a pthread mutex elsewhere.
+
+ DMutex has a constexpr constructor, so static instances are usable before
+ main() and from any static constructor. keep using DSemaphore where a real
+ counting semaphore is wanted (one thread signalling another).
+
+ each instance is padded out to DMUTEX_CACHE_LINE bytes. allocate them
+ statically or as members -- plain new doesn't honour the alignment before
+ C++17.
+
+ compile with -DDMUTEX_STATS to count acquisitions, contended acquisitions
+ and parks per mutex (see GetStats()). the counters are only written while
+ the mutex is held, so they cost a plain increment each.
+
+*/
+
+class DMutexStats
+{
+public:
+	DMutexStats() : acquisitions( 0 ), contended( 0 ), parks( 0 ) {}
+	/// successful Lock()s and TryLock()s
+	uint64_t acquisitions;
+	/// Lock()s which found the mutex held
+	uint64_t contended;
+	/// times a thread went to sleep waiting for the mutex
+	uint64_t parks;
+};
+
+class alignas(DMUTEX_CACHE_LINE) DMutex
+{
+public:
+	constexpr DMutex( int _spin_count = 100 )
+		: spin_count( _spin_count )
+#if defined(DMUTEX_FUTEX)
+		, state( UNLOCKED )
+#elif defined(DMUTEX_UNFAIR_LOCK)
+		, unfair_lock( OS_UNFAIR_LOCK_INIT )
+#else
+		, mutex( PTHREAD_MUTEX_INITIALIZER )
+#endif
+#ifdef DMUTEX_STATS
+		, acquisitions( 0 ), contended( 0 ), parks( 0 )
+#endif
+		{}
+
+	/// wait for the mutex to become free and then grab it
+	void Lock()
+	{
+		if ( !TryAcquire() )
+			LockSlow();
+		DMUTEX_COUNT( acquisitions );
+	}
+
+	/// try once; if free, grab and return true, else return false
+	bool TryLock()
+	{
+		if ( !TryAcquire() )
+			return false;
+		DMUTEX_COUNT( acquisitions );
+		return true;
+	}
+
+	/// release. must be called by the thread that locked.
+	void Unlock()
+	{
+#if defined(DMUTEX_FUTEX)
+		// only make the syscall if somebody might be asleep
+		if ( state.exchange( UNLOCKED, std::memory_order_release ) == CONTENDED )
+			syscall( SYS_futex, (uint32_t*)&state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+#elif defined(DMUTEX_UNFAIR_LOCK)
+		os_unfair_lock_unlock( &unfair_lock );
+#else
+		pthread_mutex_unlock( &mutex );
+#endif
+	}
+
+	/// contention counters (all 0 unless compiled with DMUTEX_STATS).
+	/// approximate if read while other threads are using the mutex.
+	DMutexStats GetStats() const
+	{
+		DMutexStats out;
+#ifdef DMUTEX_STATS
+		out.acquisitions = acquisitions.load( std::memory_order_relaxed );
+		out.contended = contended.load( std::memory_order_relaxed );
+		out.parks = parks.load( std::memory_order_relaxed );
+#endif
+		return out;
+	}
+	/// zero the contention counters
+	void ResetStats()
+	{
+#ifdef DMUTEX_STATS
+		acquisitions.store( 0, std::memory_order_relaxed );
+		contended.store( 0, std::memory_order_relaxed );
+		parks.store( 0, std::memory_order_relaxed );
+#endif
+	}
+
+private:
+	DMutex( const DMutex& );
+	DMutex& operator=( const DMutex& );
+
+	static void Pause()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		_mm_pause();
+#elif defined(__aarch64__)
+		__asm__ __volatile__( "yield" );
+#endif
+	}
+
+	bool TryAcquire()
+	{
+#if defined(DMUTEX_FUTEX)
+		uint32_t expected = UNLOCKED;
+		return state.compare_exchange_strong( expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed );
+#elif defined(DMUTEX_UNFAIR_LOCK)
+		return os_unfair_lock_trylock( &unfair_lock );
+#else
+		return 0 == pthread_mutex_trylock( &mutex );
+#endif
+	}
+
+	void LockSlow()
+	{
+		uint64_t parked = 0;
+#if defined(DMUTEX_FUTEX)
+		// spin reading only, so the holder's cache line isn't stolen from it
+		for ( int i=0; i<spin_count; i++ )
+		{
+			Pause();
+			if ( state.load( std::memory_order_relaxed ) == UNLOCKED && TryAcquire() )
+			{
+				DMUTEX_COUNT( contended );
+				return;
+			}
+		}
+		// mark the mutex contended, so that Unlock() wakes us, and sleep
+		// until it's released. whoever wins keeps it marked contended, since
+		// there may be other sleepers.
+		while ( state.exchange( CONTENDED, std::memory_order_acquire ) != UNLOCKED )
+		{
+			syscall( SYS_futex, (uint32_t*)&state, FUTEX_WAIT_PRIVATE, CONTENDED, NULL, NULL, 0 );
+			parked++;
+		}
+#else
+		for ( int i=0; i<spin_count; i++ )
+		{
+			Pause();
+			if ( TryAcquire() )
+			{
+				DMUTEX_COUNT( contended );
+				return;
+			}
+		}
+		parked++;
+#if defined(DMUTEX_UNFAIR_LOCK)
+		os_unfair_lock_lock( &unfair_lock );
+#else
+		pthread_mutex_lock( &mutex );
+#endif
+#endif
+		// now we hold it
+		DMUTEX_COUNT( contended );
+		DMUTEX_ADD( parks, parked );
+	}
+
+	int spin_count;
+#if defined(DMUTEX_FUTEX)
+	enum { UNLOCKED = 0, LOCKED = 1, CONTENDED = 2 };
+	std::atomic<uint32_t> state;
+#elif defined(DMUTEX_UNFAIR_LOCK)
+	os_unfair_lock unfair_lock;
+#else
+	pthread_mutex_t mutex;
+#endif
+#ifdef DMUTEX_STATS
+	std::atomic<uint64_t> acquisitions;
+	std::atomic<uint64_t> contended;
+	std::atomic<uint64_t> parks;
+#endif
+};
+
+#endif
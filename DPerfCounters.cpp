@@ -0,0 +1,170 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DPerfCounters.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+DPerfCounters::DPerfCounters()
+{
+	for ( int i=0; i<COUNT; i++ )
+	{
+		fds[i] = -1;
+		pages[i] = NULL;
+	}
+	page_size = sysconf( _SC_PAGESIZE );
+}
+
+const char* DPerfCounters::GetName( int counter )
+{
+	static const char* names[COUNT] = { "cycles", "instructions", "cache misses", "branch misses" };
+	return ( counter >= 0 && counter < COUNT ) ? names[counter] : "";
+}
+
+#ifdef __linux__
+
+bool DPerfCounters::Open()
+{
+	Close();
+	static const uint64_t configs[COUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+	for ( int i=0; i<COUNT; i++ )
+	{
+		struct perf_event_attr attr;
+		memset( &attr, 0, sizeof(attr) );
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		// user space only, which perf_event_paranoid 2 still allows
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		// this thread, on any CPU, in a group led by the cycles counter
+		int fd = syscall( __NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0 );
+		if ( fd < 0 )
+		{
+			Close();
+			return false;
+		}
+		fds[i] = fd;
+		// without the page, Read() uses read()
+		void* page = mmap( NULL, page_size, PROT_READ, MAP_SHARED, fd, 0 );
+		pages[i] = ( page == MAP_FAILED ) ? NULL : page;
+	}
+	uint64_t values[COUNT];
+	if ( !Read( values ) )
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void DPerfCounters::Close()
+{
+	for ( int i=COUNT-1; i>=0; i-- )
+	{
+		if ( pages[i] )
+			munmap( pages[i], page_size );
+		pages[i] = NULL;
+		if ( fds[i] >= 0 )
+			close( fds[i] );
+		fds[i] = -1;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t rdpmc( uint32_t counter )
+{
+	uint32_t low, high;
+	__asm__ __volatile__( "rdpmc" : "=a" (low), "=d" (high) : "c" (counter) );
+	return (uint64_t)low | ( (uint64_t)high << 32 );
+}
+#endif
+
+bool DPerfCounters::ReadUser( uint64_t* values )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	for ( int i=0; i<COUNT; i++ )
+	{
+		volatile struct perf_event_mmap_page* pc = (volatile struct perf_event_mmap_page*)pages[i];
+		if ( !pc )
+			return false;
+		// the kernel bumps lock around changes to the page (see linux/perf_event.h)
+		uint32_t seq;
+		uint64_t count;
+		do
+		{
+			seq = pc->lock;
+			__asm__ __volatile__( "" ::: "memory" );
+			uint32_t index = pc->index;
+			// index 0: not on the PMU right now
+			if ( !pc->cap_user_rdpmc || index == 0 )
+				return false;
+			count = pc->offset;
+			// sign-extend the pmc_width bit hardware counter
+			int shift = 64 - pc->pmc_width;
+			int64_t pmc = (int64_t)( rdpmc( index-1 ) << shift ) >> shift;
+			count += pmc;
+			__asm__ __volatile__( "" ::: "memory" );
+		} while ( pc->lock != seq );
+		values[i] = count;
+	}
+	return true;
+#else
+	// other architectures need extra setup for user space reads; use read()
+	return false;
+#endif
+}
+
+bool DPerfCounters::Read( uint64_t* values )
+{
+	if ( !IsOpen() )
+		return false;
+	if ( ReadUser( values ) )
+		return true;
+	// PERF_FORMAT_GROUP: the number of counters, then their values in the
+	// order they were added to the group
+	uint64_t group[1+COUNT];
+	if ( read( fds[0], group, sizeof(group) ) != (ssize_t)sizeof(group) || group[0] != COUNT )
+		return false;
+	for ( int i=0; i<COUNT; i++ )
+		values[i] = group[1+i];
+	return true;
+}
+
+#else
+
+// no perf_event: kperf on OSX is private API and needs root
+bool DPerfCounters::Open() { return false; }
+void DPerfCounters::Close() {}
+bool DPerfCounters::ReadUser( uint64_t* ) { return false; }
+bool DPerfCounters::Read( uint64_t* ) { return false; }
+
+#endif
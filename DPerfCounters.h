@@ -0,0 +1,103 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DPerfCounters_H
+#define _DPerfCounters_H
+
+#include <stdint.h>
+#include <string.h>
+
+/** DPerfCounters
+
+ hardware performance counters for the calling thread: cycles,
+ instructions, last level cache misses and branch misses, counted in user
+ space only. on Linux they are opened as one perf_event group, so all four
+ always cover the same stretch of execution, and each counter's page is
+ mapped so that Read() can use rdpmc with no system call. where rdpmc isn't
+ allowed (or the group is momentarily off the PMU) Read() falls back to a
+ single read() of the group. not available on other platforms.
+
+ the counters count the thread that called Open(), wherever it's read
+ from, so only the owning thread should use them. DProfiler keeps one per
+ context; see DProfiler::EnableCounters().
+
+ counts are not scaled for multiplexing: if the PMU is shared with other
+ perf users the counts are lower bounds.
+
+*/
+
+class DPerfCounters
+{
+public:
+	typedef enum _COUNTER { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, COUNT } COUNTER;
+
+	DPerfCounters();
+	~DPerfCounters() { Close(); }
+
+	/// open the counters for the calling thread. returns false (leaving them
+	/// closed) if the kernel or the hardware doesn't provide them.
+	bool Open();
+	void Close();
+	bool IsOpen() const { return fds[0] >= 0; }
+
+	/// read every counter's current value into values[COUNT]. returns false
+	/// if they're not open or couldn't be read.
+	bool Read( uint64_t* values );
+
+	/// short name for a counter, eg "cycles"
+	static const char* GetName( int counter );
+
+private:
+	/// read values with rdpmc. false if any counter isn't readable that way right now.
+	bool ReadUser( uint64_t* values );
+
+	int fds[COUNT];
+	void* pages[COUNT];
+	size_t page_size;
+};
+
+/// counter totals over a section's timed calls
+class DProfileCounterTotals
+{
+public:
+	uint64_t values[DPerfCounters::COUNT];
+
+	void Clear() { memset( values, 0, sizeof(values) ); }
+	/// instructions per cycle
+	double GetIPC() const { return values[DPerfCounters::CYCLES] ? (double)values[DPerfCounters::INSTRUCTIONS]/(double)values[DPerfCounters::CYCLES] : 0.0; }
+	/// counter per call, over calls calls
+	double GetPerCall( int counter, uint64_t calls ) const { return calls ? (double)values[counter]/(double)calls : 0.0; }
+};
+
+/// one section's counters in a DProfileContext
+class DProfileSectionCounters
+{
+public:
+	void Clear() { start_ticks = 0; totals.Clear(); }
+
+	/// values at the most recent push, and that push's
+	/// DProfileSection::start_ticks (so that a pop can tell whether they
+	/// belong to the call it's ending)
+	uint64_t start[DPerfCounters::COUNT];
+	uint64_t start_ticks;
+	DProfileCounterTotals totals;
+};
+
+#endif
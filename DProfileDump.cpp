@@ -0,0 +1,420 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DProfileDump.h"
+#include "DProfiler.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const uint8_t padding[8] = { 0 };
+
+static uint64_t Padding( uint64_t size )
+{
+	return ( 8 - ( size & 7 ) ) & 7;
+}
+
+DProfileDumpWriter::DProfileDumpWriter()
+{
+	file = NULL;
+	offset = 0;
+	failed = false;
+}
+
+void DProfileDumpWriter::Write( const void* data, uint64_t size )
+{
+	if ( size == 0 || failed )
+		return;
+	if ( fwrite( data, 1, size, file ) != size )
+	{
+		fprintf(stderr, "DProfileDumpWriter: write failed\n" );
+		failed = true;
+	}
+}
+
+bool DProfileDumpWriter::Open( const char* path )
+{
+	Close();
+	file = fopen( path, "wb" );
+	if ( !file )
+	{
+		fprintf(stderr, "DProfileDumpWriter: couldn't open %s for writing\n", path );
+		return false;
+	}
+	// large sequential writes
+	setvbuf( file, NULL, _IOFBF, 1<<20 );
+
+	DProfileDumpHeader header;
+	memset( &header, 0, sizeof(header) );
+	header.magic = DProfileDumpHeader::MAGIC;
+	header.version = DProfileDumpHeader::VERSION;
+	header.millis_per_tick = DTime::TicksToMillis( 1000000 ) * 1e-6;
+	header.start_ticks = DTime::GetTicks();
+	failed = false;
+	Write( &header, sizeof(header) );
+	offset = sizeof(header);
+	index.clear();
+	return !failed;
+}
+
+void DProfileDumpWriter::WriteBlock( uint32_t type, uint32_t thread, const void* data, uint64_t size )
+{
+	DProfileDumpBlock block;
+	block.type = type;
+	block.thread = thread;
+	block.size = size;
+	Write( &block, sizeof(block) );
+	offset += sizeof(block);
+
+	DProfileDumpBlockIndex entry;
+	entry.type = type;
+	entry.thread = thread;
+	entry.offset = offset;
+	entry.size = size;
+	index.push_back( entry );
+
+	Write( data, size );
+	uint64_t pad = Padding( size );
+	Write( padding, pad );
+	offset += size + pad;
+}
+
+void DProfileDumpWriter::WriteBlocks( const std::string& blocks )
+{
+	// index the blocks by walking their headers
+	uint64_t position = 0;
+	while ( position + sizeof(DProfileDumpBlock) <= blocks.size() )
+	{
+		const DProfileDumpBlock* block = (const DProfileDumpBlock*)( blocks.data() + position );
+		DProfileDumpBlockIndex entry;
+		entry.type = block->type;
+		entry.thread = block->thread;
+		entry.offset = offset + position + sizeof(DProfileDumpBlock);
+		entry.size = block->size;
+		index.push_back( entry );
+		position += sizeof(DProfileDumpBlock) + block->size + Padding( block->size );
+	}
+	Write( blocks.data(), blocks.size() );
+	offset += blocks.size();
+}
+
+void DProfileDumpWriter::AppendBlock( std::string& out, uint32_t type, uint32_t thread, const void* data, uint64_t size )
+{
+	DProfileDumpBlock block;
+	block.type = type;
+	block.thread = thread;
+	block.size = size;
+	out.append( (const char*)&block, sizeof(block) );
+	out.append( (const char*)data, size );
+	out.append( (const char*)padding, Padding( size ) );
+}
+
+int DProfileDumpWriter::AppendThread( std::string& out, const DProfileThreadSnapshot& source )
+{
+	uint32_t count = source.sections.size();
+	std::string payload;
+	payload.resize( sizeof(DProfileDumpThread) + count*sizeof(DProfileDumpSection) );
+	DProfileDumpThread* thread = (DProfileDumpThread*)&payload[0];
+	memset( thread, 0, sizeof(DProfileDumpThread) );
+	thread->thread_index = source.thread_index;
+	thread->section_count = count;
+	DProfileDumpSection* sections = (DProfileDumpSection*)( thread+1 );
+	for ( uint32_t j=0; j<count; j++ )
+	{
+		const DProfileSectionSnapshot& s = source.sections[j];
+		DProfileDumpSection& d = sections[j];
+		d.call_count = s.call_count;
+		d.total_ticks = s.total_ticks;
+		d.timed_count = s.timed_count;
+		d.parent = s.parent;
+		d.first_child = s.first_child;
+		d.next_sibling = s.next_sibling;
+		d.name = s.name_id;
+	}
+	AppendBlock( out, DProfileDumpBlock::BLOCK_THREAD, source.thread_index, payload.data(), payload.size() );
+
+	if ( source.stats.size() != count )
+		return 1;
+	std::vector<DProfileDumpSectionStats> stats( count );
+	for ( uint32_t j=0; j<count; j++ )
+	{
+		const DProfileStats& s = source.stats[j];
+		DProfileDumpSectionStats& d = stats[j];
+		d.count = s.count;
+		d.min_ticks = s.count ? s.min_ticks : 0;
+		d.max_ticks = s.max_ticks;
+		d.p50_ticks = s.GetPercentile( 0.5 );
+		d.p90_ticks = s.GetPercentile( 0.9 );
+		d.p99_ticks = s.GetPercentile( 0.99 );
+		d.p999_ticks = s.GetPercentile( 0.999 );
+		d.stddev_ticks = s.GetStdDev();
+	}
+	AppendBlock( out, DProfileDumpBlock::BLOCK_STATS, source.thread_index, stats.data(), count*sizeof(DProfileDumpSectionStats) );
+	return 2;
+}
+
+void DProfileDumpWriter::AppendStrings( std::string& out )
+{
+	uint32_t count = DProfiler::GetNameCount()+1;
+	std::vector<uint32_t> offsets( count );
+	std::string chars;
+	for ( uint32_t i=0; i<count; i++ )
+	{
+		offsets[i] = chars.size();
+		if ( i > 0 )
+			chars += DProfiler::GetName( i );
+		chars += '\0';
+	}
+	std::string payload;
+	payload.append( (const char*)&count, sizeof(count) );
+	payload.append( (const char*)offsets.data(), count*sizeof(uint32_t) );
+	payload += chars;
+	AppendBlock( out, DProfileDumpBlock::BLOCK_STRINGS, 0, payload.data(), payload.size() );
+}
+
+bool DProfileDumpWriter::WriteSnapshot()
+{
+	if ( !file )
+		return false;
+
+	DProfileSnapshot snapshot;
+	DProfiler::TakeSnapshot( snapshot );
+	std::string blocks;
+	for ( size_t i=0; i<snapshot.threads.size(); i++ )
+	{
+		blocks.clear();
+		AppendThread( blocks, snapshot.threads[i] );
+		WriteBlocks( blocks );
+	}
+	return !failed;
+}
+
+void DProfileDumpWriter::OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count )
+{
+	if ( file )
+		WriteBlock( DProfileDumpBlock::BLOCK_EVENTS, thread.thread_index, events, count*sizeof(DTraceEvent) );
+}
+
+bool DProfileDumpWriter::Close()
+{
+	if ( !file )
+		return false;
+
+	// string table last, so it includes every name used by the events
+	std::string strings;
+	AppendStrings( strings );
+	WriteBlocks( strings );
+
+	DProfileDumpFooter footer;
+	footer.index_offset = offset;
+	footer.block_count = index.size();
+	footer.magic = DProfileDumpFooter::MAGIC;
+	Write( index.data(), index.size()*sizeof(DProfileDumpBlockIndex) );
+	Write( &footer, sizeof(footer) );
+
+	// fclose flushes the buffer, so it can fail too
+	if ( fclose( file ) != 0 && !failed )
+	{
+		fprintf(stderr, "DProfileDumpWriter: write failed\n" );
+		failed = true;
+	}
+	file = NULL;
+	return !failed;
+}
+
+
+
+DProfileDumpReader::DProfileDumpReader()
+{
+	base = NULL;
+	length = 0;
+	header = NULL;
+	string_offsets = NULL;
+	strings = NULL;
+	string_count = 0;
+	strings_size = 0;
+}
+
+bool DProfileDumpReader::Open( const char* path )
+{
+	Close();
+	int fd = open( path, O_RDONLY );
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "DProfileDumpReader: couldn't open %s\n", path );
+		return false;
+	}
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size < (off_t)( sizeof(DProfileDumpHeader) + sizeof(DProfileDumpFooter) ) )
+	{
+		fprintf(stderr, "DProfileDumpReader: %s is too short to be a dump\n", path );
+		close( fd );
+		return false;
+	}
+	length = st.st_size;
+	void* mapped = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( mapped == MAP_FAILED )
+	{
+		fprintf(stderr, "DProfileDumpReader: couldn't map %s\n", path );
+		length = 0;
+		return false;
+	}
+	base = (const uint8_t*)mapped;
+
+	header = (const DProfileDumpHeader*)base;
+	const DProfileDumpFooter* footer = (const DProfileDumpFooter*)( base + length - sizeof(DProfileDumpFooter) );
+	if ( header->magic != DProfileDumpHeader::MAGIC || footer->magic != DProfileDumpFooter::MAGIC )
+	{
+		fprintf(stderr, "DProfileDumpReader: %s is not a complete dump\n", path );
+		Close();
+		return false;
+	}
+	if ( header->version != DProfileDumpHeader::VERSION )
+	{
+		fprintf(stderr, "DProfileDumpReader: %s is version %u, expected %u\n", path, header->version, DProfileDumpHeader::VERSION );
+		Close();
+		return false;
+	}
+	// everything in the file is checked against the file before it is used,
+	// written so that no sum or product can overflow
+	uint64_t index_space = length - sizeof(DProfileDumpFooter);
+	if ( footer->index_offset > index_space || ( footer->index_offset & 7 )
+		|| footer->block_count > ( index_space - footer->index_offset )/sizeof(DProfileDumpBlockIndex) )
+	{
+		fprintf(stderr, "DProfileDumpReader: %s has a bad index\n", path );
+		Close();
+		return false;
+	}
+
+	const DProfileDumpBlockIndex* blocks = (const DProfileDumpBlockIndex*)( base + footer->index_offset );
+	std::map<uint32_t, const DProfileDumpThread*> latest;
+	std::map<uint32_t, const DProfileDumpSectionStats*> latest_stats;
+	const DProfileDumpThread* previous = NULL;
+	for ( uint32_t i=0; i<footer->block_count; i++ )
+	{
+		const DProfileDumpBlockIndex& block = blocks[i];
+		if ( block.offset < sizeof(DProfileDumpHeader) || block.offset > footer->index_offset
+			|| block.size > footer->index_offset - block.offset || ( block.offset & 7 ) )
+		{
+			fprintf(stderr, "DProfileDumpReader: %s has a bad block %u\n", path, i );
+			Close();
+			return false;
+		}
+		const uint8_t* payload = base + block.offset;
+		if ( block.type == DProfileDumpBlock::BLOCK_STRINGS && block.size >= sizeof(uint32_t) )
+		{
+			// the offsets must fit, and the last string must end in the block
+			// so that none of them can run off its end
+			uint32_t count = *(const uint32_t*)payload;
+			uint64_t offsets_size = sizeof(uint32_t)*( (uint64_t)count+1 );
+			const char* chars = (const char*)payload + offsets_size;
+			if ( offsets_size > block.size || ( offsets_size < block.size && chars[block.size-offsets_size-1] != 0 ) )
+			{
+				fprintf(stderr, "DProfileDumpReader: %s has a bad string table\n", path );
+				Close();
+				return false;
+			}
+			string_count = count;
+			string_offsets = (const uint32_t*)payload + 1;
+			strings = chars;
+			strings_size = block.size - offsets_size;
+		}
+		else if ( block.type == DProfileDumpBlock::BLOCK_THREAD && block.size >= sizeof(DProfileDumpThread) )
+		{
+			// every section must be in the block, and come after its parent
+			// and before its children and later siblings, as written
+			const DProfileDumpThread* thread = (const DProfileDumpThread*)payload;
+			uint32_t count = thread->section_count;
+			bool valid = count > 0 && ( block.size - sizeof(DProfileDumpThread) )/sizeof(DProfileDumpSection) >= count;
+			const DProfileDumpSection* sections = (const DProfileDumpSection*)( thread+1 );
+			for ( uint32_t j=0; valid && j<count; j++ )
+			{
+				valid = ( j == 0 || sections[j].parent < j )
+					&& ( sections[j].first_child == 0 || ( sections[j].first_child > j && sections[j].first_child < count ) )
+					&& ( sections[j].next_sibling == 0 || ( sections[j].next_sibling > j && sections[j].next_sibling < count ) );
+			}
+			if ( !valid )
+			{
+				fprintf(stderr, "DProfileDumpReader: %s has a bad tree for thread %u\n", path, block.thread );
+				Close();
+				return false;
+			}
+			previous = thread;
+			latest[block.thread] = previous;
+			latest_stats.erase( block.thread );
+			continue;
+		}
+		else if ( block.type == DProfileDumpBlock::BLOCK_STATS && previous && previous->thread_index == block.thread
+			&& block.size == (uint64_t)previous->section_count*sizeof(DProfileDumpSectionStats) )
+			latest_stats[block.thread] = (const DProfileDumpSectionStats*)payload;
+		else if ( block.type == DProfileDumpBlock::BLOCK_EVENTS )
+			event_blocks.push_back( &block );
+		previous = NULL;
+	}
+	for ( std::map<uint32_t, const DProfileDumpThread*>::iterator it = latest.begin(); it != latest.end(); ++it )
+	{
+		threads.push_back( it->second );
+		std::map<uint32_t, const DProfileDumpSectionStats*>::iterator stats = latest_stats.find( it->first );
+		thread_stats.push_back( stats == latest_stats.end() ? NULL : stats->second );
+	}
+
+	return true;
+}
+
+void DProfileDumpReader::Close()
+{
+	if ( base )
+		munmap( (void*)base, length );
+	base = NULL;
+	length = 0;
+	header = NULL;
+	string_offsets = NULL;
+	strings = NULL;
+	string_count = 0;
+	strings_size = 0;
+	threads.clear();
+	thread_stats.clear();
+	event_blocks.clear();
+}
+
+const char* DProfileDumpReader::GetString( uint32_t id ) const
+{
+	if ( id >= string_count || string_offsets[id] >= strings_size )
+		return "";
+	return strings + string_offsets[id];
+}
+
+std::string DProfileDumpReader::GetPath( uint32_t thread, uint32_t section ) const
+{
+	const DProfileDumpSection* sections = GetSections( thread );
+	uint32_t count = threads[thread]->section_count;
+	std::string path;
+	// Open() checked that parents come first, so this ends
+	while ( section != 0 && section < count )
+	{
+		path = path.empty() ? std::string( GetString( sections[section].name ) ) : std::string( GetString( sections[section].name ) ) + "/" + path;
+		section = sections[section].parent;
+	}
+	return path;
+}
@@ -0,0 +1,263 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DProfileDump_H
+#define _DProfileDump_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "DTrace.h"
+
+class DProfileThreadSnapshot;
+
+/** DProfileDump
+
+ versioned binary dump of profiler data, for offline analysis and for
+ comparing runs (see tools/dprofdiff.cpp). all integers are little-endian
+ and every block starts 8-byte aligned, so a DProfileDumpReader can mmap
+ the file and use the tables in place without parsing.
+
+ layout:
+
+   DProfileDumpHeader
+   blocks, each a DProfileDumpBlock followed by size bytes of payload:
+     BLOCK_STRINGS:  uint32_t count, uint32_t offsets[count], then
+                     NUL-terminated strings. string i is section name id i.
+     BLOCK_THREAD:   DProfileDumpThread then DProfileDumpSection[section_count]
+                     (the aggregated tree for one thread; index 0 is the root)
+     BLOCK_EVENTS:   DTraceEvent[size/16] for thread block.thread, in order
+     BLOCK_STATS:    DProfileDumpSectionStats[], parallel to the sections of
+                     the BLOCK_THREAD just before it (only if statistics
+                     were enabled)
+     BLOCK_INTERVAL: DProfileDumpInterval (streams only, see below)
+     BLOCK_MESSAGE:  text, not NUL-terminated (streams only)
+   index: DProfileDumpBlockIndex[block_count]
+   DProfileDumpFooter
+
+ the index and footer are written last, so events can be streamed into the
+ file while profiling runs. readers skip block types they don't know.
+
+ a DProfileReporter (see DProfileReporter.h) sends the same blocks over a
+ socket: a DProfileDumpHeader, then for every interval a BLOCK_STRINGS if
+ there are new names, a BLOCK_INTERVAL, and that interval's BLOCK_THREAD
+ and BLOCK_STATS blocks, whose counters cover only the interval. there is
+ no index or footer.
+
+*/
+
+struct DProfileDumpHeader
+{
+	static const uint32_t MAGIC = 0x46525044; // "DPRF"
+	static const uint32_t VERSION = 1;
+
+	uint32_t magic;
+	uint32_t version;
+	/// to convert ticks in the file to milliseconds
+	double millis_per_tick;
+	/// DTime::GetTicks() when the dump was started
+	uint64_t start_ticks;
+	uint64_t reserved;
+};
+
+struct DProfileDumpBlock
+{
+	typedef enum _TYPE { BLOCK_STRINGS = 1, BLOCK_THREAD = 2, BLOCK_EVENTS = 3, BLOCK_STATS = 4, BLOCK_INTERVAL = 5, BLOCK_MESSAGE = 6 } TYPE;
+	uint32_t type;
+	/// thread index for BLOCK_THREAD and BLOCK_EVENTS
+	uint32_t thread;
+	/// payload size in bytes, not including padding
+	uint64_t size;
+};
+
+struct DProfileDumpBlockIndex
+{
+	uint32_t type;
+	uint32_t thread;
+	/// file offset of the payload
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct DProfileDumpFooter
+{
+	static const uint32_t MAGIC = 0x44505246; // "FRPD"
+	uint64_t index_offset;
+	uint32_t block_count;
+	uint32_t magic;
+};
+
+struct DProfileDumpThread
+{
+	uint32_t thread_index;
+	uint32_t section_count;
+	uint64_t reserved;
+};
+
+struct DProfileDumpSection
+{
+	uint64_t call_count;
+	/// ticks of timed calls; see timed_count
+	uint64_t total_ticks;
+	/// == call_count unless the section was sampled
+	uint64_t timed_count;
+	uint32_t parent;
+	uint32_t first_child;
+	uint32_t next_sibling;
+	/// index into the string table
+	uint32_t name;
+
+	/// total ticks, extrapolated if sampled
+	double GetTotalTicks() const { return timed_count ? (double)total_ticks * (double)call_count / (double)timed_count : 0.0; }
+};
+
+/// distribution of one section's timed calls, in ticks
+struct DProfileDumpSectionStats
+{
+	uint64_t count;
+	uint64_t min_ticks;
+	uint64_t max_ticks;
+	uint64_t p50_ticks;
+	uint64_t p90_ticks;
+	uint64_t p99_ticks;
+	uint64_t p999_ticks;
+	/// standard deviation
+	double stddev_ticks;
+};
+
+/// the span of time the blocks after it in a stream cover
+struct DProfileDumpInterval
+{
+	/// DTime::GetTicks() at the previous and at this snapshot. equal for the
+	/// first interval, whose counters are totals so far.
+	uint64_t start_ticks;
+	uint64_t end_ticks;
+	/// counts from 0 for each connection
+	uint32_t sequence;
+	/// number of BLOCK_THREAD and BLOCK_STATS blocks that follow
+	uint32_t block_count;
+};
+
+/** DProfileDumpWriter
+
+ writes a dump. WriteSnapshot() adds every thread's aggregated tree; as a
+ DTraceSink it also appends trace events drained by a DTraceDrainer.
+
+*/
+
+class DProfileDumpWriter : public DTraceSink
+{
+public:
+	DProfileDumpWriter();
+	~DProfileDumpWriter() { Close(); }
+
+	/// returns false if the file couldn't be opened or the header written
+	bool Open( const char* path );
+	/// write the string table, index and footer, and close the file. returns
+	/// false if this or any earlier write failed, leaving the dump truncated.
+	bool Close();
+	bool IsOpen() const { return file != NULL; }
+
+	/// write each thread's section tree as it stands now. returns false if a
+	/// write has failed since Open().
+	bool WriteSnapshot();
+
+	/// append a block (header, payload and padding) to out
+	static void AppendBlock( std::string& out, uint32_t type, uint32_t thread, const void* data, uint64_t size );
+	/// append BLOCK_THREAD, and BLOCK_STATS if it has statistics, for thread
+	/// to out. returns the number of blocks appended.
+	static int AppendThread( std::string& out, const DProfileThreadSnapshot& thread );
+	/// append the current BLOCK_STRINGS to out
+	static void AppendStrings( std::string& out );
+
+	void OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count );
+	void OnDrained() { if ( file ) fflush( file ); }
+
+private:
+	/// write blocks made with Append*() to the file, adding them to the index
+	void WriteBlocks( const std::string& blocks );
+	void WriteBlock( uint32_t type, uint32_t thread, const void* data, uint64_t size );
+	/// fwrite, setting failed (and reporting it once) on a short write
+	void Write( const void* data, uint64_t size );
+
+	FILE* file;
+	uint64_t offset;
+	/// set by the first failed write; later writes are skipped
+	bool failed;
+	std::vector<DProfileDumpBlockIndex> index;
+};
+
+/** DProfileDumpReader
+
+ memory-maps a dump written by DProfileDumpWriter.
+
+*/
+
+class DProfileDumpReader
+{
+public:
+	DProfileDumpReader();
+	~DProfileDumpReader() { Close(); }
+
+	/// returns false (with a message on stderr) if the file can't be mapped or isn't a valid dump
+	bool Open( const char* path );
+	void Close();
+
+	double GetMillisPerTick() const { return header->millis_per_tick; }
+	uint64_t GetStartTicks() const { return header->start_ticks; }
+
+	/// string table: section name for a name id
+	uint32_t GetStringCount() const { return string_count; }
+	const char* GetString( uint32_t id ) const;
+
+	/// aggregated trees. if the dump contains more than one snapshot of a
+	/// thread, the last one is used.
+	uint32_t GetThreadCount() const { return threads.size(); }
+	const DProfileDumpThread* GetThread( uint32_t i ) const { return threads[i]; }
+	const DProfileDumpSection* GetSections( uint32_t i ) const { return (const DProfileDumpSection*)( threads[i]+1 ); }
+	/// statistics parallel to GetSections( i ), or NULL if there are none
+	const DProfileDumpSectionStats* GetSectionStats( uint32_t i ) const { return thread_stats[i]; }
+
+	/// raw event blocks, in file order
+	uint32_t GetEventBlockCount() const { return event_blocks.size(); }
+	uint32_t GetEventBlockThread( uint32_t i ) const { return event_blocks[i]->thread; }
+	const DTraceEvent* GetEvents( uint32_t i ) const { return (const DTraceEvent*)( base + event_blocks[i]->offset ); }
+	uint64_t GetEventCount( uint32_t i ) const { return event_blocks[i]->size / sizeof(DTraceEvent); }
+
+	/// return the path ("frame/render/shadow") of a section
+	std::string GetPath( uint32_t thread, uint32_t section ) const;
+
+private:
+	const uint8_t* base;
+	size_t length;
+	const DProfileDumpHeader* header;
+	const uint32_t* string_offsets;
+	const char* strings;
+	uint32_t string_count;
+	uint64_t strings_size;
+	std::vector<const DProfileDumpThread*> threads;
+	std::vector<const DProfileDumpSectionStats*> thread_stats;
+	std::vector<const DProfileDumpBlockIndex*> event_blocks;
+};
+
+#endif
@@ -0,0 +1,503 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DProfileReporter.h"
+#include "DProfileDump.h"
+#include "DProfiler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef MSG_NOSIGNAL
+#define DPROFILE_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define DPROFILE_SEND_FLAGS 0
+#endif
+
+static const uint32_t NO_SECTION = 0xffffffffu;
+
+DProfileReporter::DProfileReporter( int _interval_ms )
+{
+	interval_ms = _interval_ms > 0 ? _interval_ms : 1;
+	last_report_ticks = 0;
+	have_previous = false;
+	SetThreadName( "DProfileReporter" );
+}
+
+DProfileReporter::~DProfileReporter()
+{
+	if ( thread_running )
+		StopThread();
+	CloseAll();
+	for ( size_t i=0; i<listen_fds.size(); i++ )
+		close( listen_fds[i] );
+	if ( !unix_path.empty() )
+		unlink( unix_path.c_str() );
+}
+
+static bool SetNonBlocking( int fd )
+{
+	int flags = fcntl( fd, F_GETFL, 0 );
+	return flags >= 0 && fcntl( fd, F_SETFL, flags | O_NONBLOCK ) == 0;
+}
+
+bool DProfileReporter::ListenUnix( const char* path )
+{
+	struct sockaddr_un address;
+	memset( &address, 0, sizeof(address) );
+	address.sun_family = AF_UNIX;
+	if ( strlen( path ) >= sizeof(address.sun_path) )
+	{
+		fprintf(stderr, "DProfileReporter: socket path %s is too long\n", path );
+		return false;
+	}
+	strcpy( address.sun_path, path );
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "DProfileReporter: couldn't create a socket: %s\n", strerror( errno ) );
+		return false;
+	}
+	// a socket left by an earlier run
+	unlink( path );
+	if ( bind( fd, (struct sockaddr*)&address, sizeof(address) ) != 0 || listen( fd, 8 ) != 0 || !SetNonBlocking( fd ) )
+	{
+		fprintf(stderr, "DProfileReporter: couldn't listen on %s: %s\n", path, strerror( errno ) );
+		close( fd );
+		return false;
+	}
+	listen_fds.push_back( fd );
+	unix_path = path;
+	return true;
+}
+
+bool DProfileReporter::ListenTCP( int port, bool loopback_only )
+{
+	struct sockaddr_in address;
+	memset( &address, 0, sizeof(address) );
+	address.sin_family = AF_INET;
+	address.sin_port = htons( port );
+	address.sin_addr.s_addr = htonl( loopback_only ? INADDR_LOOPBACK : INADDR_ANY );
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "DProfileReporter: couldn't create a socket: %s\n", strerror( errno ) );
+		return false;
+	}
+	int on = 1;
+	setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+	if ( bind( fd, (struct sockaddr*)&address, sizeof(address) ) != 0 || listen( fd, 8 ) != 0 || !SetNonBlocking( fd ) )
+	{
+		fprintf(stderr, "DProfileReporter: couldn't listen on port %i: %s\n", port, strerror( errno ) );
+		close( fd );
+		return false;
+	}
+	listen_fds.push_back( fd );
+	return true;
+}
+
+void DProfileReporter::StopThread()
+{
+	if ( !thread_running )
+		return;
+	DThread::StopThread();
+	CloseAll();
+}
+
+void DProfileReporter::CloseAll()
+{
+	for ( size_t i=0; i<clients.size(); i++ )
+		close( clients[i].fd );
+	clients.clear();
+	have_previous = false;
+	departed.clear();
+}
+
+void DProfileReporter::ThreadedFunction()
+{
+	// wake at least every 100ms, so StopThread() doesn't wait for long
+	int timeout = 100;
+	if ( !clients.empty() )
+	{
+		double since = DTime::TicksToMillis( DTime::GetTicks() - last_report_ticks );
+		if ( since >= interval_ms )
+		{
+			Report();
+			since = 0;
+		}
+		if ( interval_ms - since < timeout )
+			timeout = (int)( interval_ms - since ) + 1;
+	}
+
+	std::vector<struct pollfd> fds( listen_fds.size() + clients.size() );
+	for ( size_t i=0; i<listen_fds.size(); i++ )
+	{
+		fds[i].fd = listen_fds[i];
+		fds[i].events = POLLIN;
+	}
+	for ( size_t i=0; i<clients.size(); i++ )
+	{
+		struct pollfd& p = fds[listen_fds.size()+i];
+		p.fd = clients[i].fd;
+		p.events = POLLIN | ( clients[i].output.empty() ? 0 : POLLOUT );
+	}
+	if ( poll( fds.data(), fds.size(), timeout ) <= 0 )
+		return;
+
+	// clients first, as Accept() adds to them
+	for ( size_t i=clients.size(); i > 0; i-- )
+	{
+		Client& client = clients[i-1];
+		short revents = fds[listen_fds.size()+i-1].revents;
+		bool ok = true;
+		if ( revents & ( POLLIN | POLLHUP | POLLERR ) )
+			ok = Receive( client );
+		if ( ok && ( revents & POLLOUT ) )
+			ok = Send( client );
+		if ( !ok )
+		{
+			close( client.fd );
+			clients.erase( clients.begin()+(i-1) );
+		}
+	}
+	for ( size_t i=0; i<listen_fds.size(); i++ )
+	{
+		if ( fds[i].revents & POLLIN )
+			Accept( listen_fds[i] );
+	}
+}
+
+void DProfileReporter::Accept( int listen_fd )
+{
+	int fd = accept( listen_fd, NULL, NULL );
+	if ( fd < 0 )
+		return;
+	if ( !SetNonBlocking( fd ) )
+	{
+		close( fd );
+		return;
+	}
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on) );
+#endif
+	// deltas are relative to the last report, which this client didn't get
+	if ( clients.empty() )
+		have_previous = false;
+
+	clients.push_back( Client() );
+	Client& client = clients.back();
+	client.fd = fd;
+	client.names_sent = 0;
+	client.sequence = 0;
+
+	DProfileDumpHeader header;
+	memset( &header, 0, sizeof(header) );
+	header.magic = DProfileDumpHeader::MAGIC;
+	header.version = DProfileDumpHeader::VERSION;
+	header.millis_per_tick = DTime::TicksToMillis( 1000000 ) * 1e-6;
+	header.start_ticks = DTime::GetTicks();
+	client.output.append( (const char*)&header, sizeof(header) );
+	// report to it straight away
+	last_report_ticks = 0;
+}
+
+bool DProfileReporter::Receive( Client& client )
+{
+	char buffer[1024];
+	ssize_t got = recv( client.fd, buffer, sizeof(buffer), 0 );
+	if ( got == 0 || ( got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+		return false;
+	if ( got < 0 )
+		return true;
+	client.input.append( buffer, got );
+	size_t end;
+	while ( ( end = client.input.find( '\n' ) ) != std::string::npos )
+	{
+		std::string line = client.input.substr( 0, end );
+		client.input.erase( 0, end+1 );
+		if ( !line.empty() && line[line.size()-1] == '\r' )
+			line.erase( line.size()-1 );
+		if ( !line.empty() )
+			RunCommand( client, line );
+	}
+	// nobody types commands this long
+	if ( client.input.size() > sizeof(buffer) )
+		return false;
+	return Send( client );
+}
+
+bool DProfileReporter::Send( Client& client )
+{
+	while ( !client.output.empty() )
+	{
+		ssize_t sent = send( client.fd, client.output.data(), client.output.size(), DPROFILE_SEND_FLAGS );
+		if ( sent < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+				return false;
+			break;
+		}
+		client.output.erase( 0, sent );
+	}
+	if ( client.output.size() > MAX_PENDING )
+	{
+		fprintf(stderr, "DProfileReporter: client is %lu bytes behind, disconnecting it\n", (unsigned long)client.output.size() );
+		return false;
+	}
+	return true;
+}
+
+void DProfileReporter::SendMessage( Client& client, const std::string& message )
+{
+	DProfileDumpWriter::AppendBlock( client.output, DProfileDumpBlock::BLOCK_MESSAGE, 0, message.data(), message.size() );
+}
+
+void DProfileReporter::RunCommand( Client& client, const std::string& line )
+{
+	char command[32] = { 0 }, argument[32] = { 0 }, argument2[32] = { 0 };
+	int n = sscanf( line.c_str(), "%31s %31s %31s", command, argument, argument2 );
+	char reply[128];
+	if ( strcmp( command, "categories" ) == 0 && n == 2 )
+	{
+		uint32_t mask = strtoul( argument, NULL, 0 );
+		DProfiler::SetCategoryMask( mask );
+		snprintf( reply, 128, "ok: category mask 0x%08x", mask );
+	}
+	else if ( strcmp( command, "sample" ) == 0 && n == 3 )
+	{
+		uint32_t categories = strtoul( argument, NULL, 0 );
+		uint32_t rate = strtoul( argument2, NULL, 0 );
+		DProfiler::SetCategorySampleRate( categories, rate );
+		snprintf( reply, 128, "ok: categories 0x%08x sampled 1 in %u", categories, rate ? rate : 1 );
+	}
+	else if ( strcmp( command, "statistics" ) == 0 && n == 2 && ( strcmp( argument, "on" ) == 0 || strcmp( argument, "off" ) == 0 ) )
+	{
+		bool enable = strcmp( argument, "on" ) == 0;
+		DProfiler::EnableStatistics( enable );
+		snprintf( reply, 128, "ok: statistics %s", enable ? "on" : "off" );
+	}
+	else if ( strcmp( command, "interval" ) == 0 && n == 2 && atoi( argument ) > 0 )
+	{
+		interval_ms = atoi( argument );
+		snprintf( reply, 128, "ok: interval %i ms", interval_ms );
+	}
+	else if ( strcmp( command, "clear" ) == 0 && n == 1 )
+	{
+		DProfiler::Clear();
+		snprintf( reply, 128, "ok: cleared" );
+	}
+	else
+		snprintf( reply, 128, "error: unknown command '%.64s'", line.c_str() );
+	SendMessage( client, reply );
+}
+
+/// out = now less base, matching sections by path. returns false, leaving
+/// out a copy of now, if now has less of anything than base (a Clear() in
+/// between).
+static bool SubtractTree( const DProfileThreadSnapshot& now, const DProfileThreadSnapshot& base, DProfileThreadSnapshot& out )
+{
+	out = now;
+	out.frames.clear();
+	out.counters.clear();
+	out.allocs.clear();
+
+	if ( base.sections.empty() )
+		return true;
+
+	std::unordered_map<uint64_t, uint32_t> base_children;
+	for ( uint32_t i=1; i<base.sections.size(); i++ )
+		base_children[( (uint64_t)base.sections[i].parent << 32 ) | (uint32_t)base.sections[i].name_id] = i;
+	// if statistics were only just enabled, now's are all new anyway
+	bool with_stats = out.stats.size() == now.sections.size() && base.stats.size() == base.sections.size();
+
+	// parents come before their children
+	std::vector<uint32_t> mapping( now.sections.size(), NO_SECTION );
+	for ( uint32_t i=0; i<now.sections.size(); i++ )
+	{
+		uint32_t m = 0;
+		if ( i != 0 )
+		{
+			uint32_t parent = mapping[now.sections[i].parent];
+			if ( parent == NO_SECTION )
+				continue;
+			std::unordered_map<uint64_t, uint32_t>::iterator it = base_children.find( ( (uint64_t)parent << 32 ) | (uint32_t)now.sections[i].name_id );
+			if ( it == base_children.end() )
+				continue;
+			m = it->second;
+		}
+		mapping[i] = m;
+		const DProfileSectionSnapshot& b = base.sections[m];
+		DProfileSectionSnapshot& d = out.sections[i];
+		if ( d.call_count < b.call_count || d.timed_count < b.timed_count || d.total_ticks < b.total_ticks )
+		{
+			out = now;
+			out.frames.clear();
+			out.counters.clear();
+			out.allocs.clear();
+			return false;
+		}
+		d.call_count -= b.call_count;
+		d.timed_count -= b.timed_count;
+		d.total_ticks -= b.total_ticks;
+		if ( with_stats )
+			out.stats[i].Subtract( base.stats[m] );
+	}
+	return true;
+}
+
+void DProfileReporter::ComputeDelta( DProfileSnapshot& out )
+{
+	out.ticks = current.ticks;
+	out.semaphores = current.semaphores;
+	out.threads.clear();
+
+	std::unordered_map<int, const DProfileThreadSnapshot*> before;
+	const DProfileThreadSnapshot* retired_before = NULL;
+	for ( size_t i=0; i<previous.threads.size(); i++ )
+	{
+		if ( previous.threads[i].thread_index == -1 )
+			retired_before = &previous.threads[i];
+		else
+			before[previous.threads[i].thread_index] = &previous.threads[i];
+	}
+
+	const DProfileThreadSnapshot* retired_now = NULL;
+	for ( size_t i=0; i<current.threads.size(); i++ )
+	{
+		const DProfileThreadSnapshot& thread = current.threads[i];
+		if ( thread.thread_index == -1 )
+		{
+			retired_now = &thread;
+			continue;
+		}
+		out.threads.push_back( DProfileThreadSnapshot() );
+		std::unordered_map<int, const DProfileThreadSnapshot*>::iterator it = before.find( thread.thread_index );
+		if ( it != before.end() )
+		{
+			SubtractTree( thread, *it->second, out.threads.back() );
+			before.erase( it );
+		}
+		else
+			SubtractTree( thread, DProfileThreadSnapshot(), out.threads.back() );
+	}
+	// threads left in before have exited. their totals turn up in the
+	// retired tree, maybe not until a later snapshot
+	for ( size_t i=0; i<previous.threads.size(); i++ )
+	{
+		if ( before.count( previous.threads[i].thread_index ) )
+			departed.push_back( previous.threads[i] );
+	}
+
+	if ( !retired_now )
+	{
+		// cleared
+		departed.clear();
+		return;
+	}
+	int retired_count = retired_before ? retired_before->merged_count : 0;
+	if ( retired_now->merged_count < retired_count )
+	{
+		retired_before = NULL;
+		retired_count = 0;
+		departed.clear();
+	}
+	// the newly retired, as far as we can tell: in the order they left
+	size_t arrived = retired_now->merged_count - retired_count;
+	if ( arrived > departed.size() )
+		arrived = departed.size();
+	DProfileThreadSnapshot base;
+	DProfileTreeMerger merger( base );
+	if ( retired_before )
+		merger.Add( *retired_before );
+	for ( size_t i=0; i<arrived; i++ )
+		merger.Add( departed[i] );
+	departed.erase( departed.begin(), departed.begin()+arrived );
+	out.threads.push_back( DProfileThreadSnapshot() );
+	SubtractTree( *retired_now, base, out.threads.back() );
+}
+
+void DProfileReporter::Report()
+{
+	last_report_ticks = DTime::GetTicks();
+	DProfiler::TakeSnapshot( current );
+
+	DProfileSnapshot delta;
+	if ( have_previous )
+		ComputeDelta( delta );
+	// threads, encoded once for all clients. new clients start with the totals so far.
+	bool any_first = !have_previous;
+	for ( size_t i=0; i<clients.size(); i++ )
+		any_first = any_first || clients[i].sequence == 0;
+	std::string totals_blocks, delta_blocks;
+	uint32_t totals_count = 0, delta_count = 0;
+	if ( any_first )
+	{
+		for ( size_t i=0; i<current.threads.size(); i++ )
+			totals_count += DProfileDumpWriter::AppendThread( totals_blocks, current.threads[i] );
+	}
+	for ( size_t i=0; i<delta.threads.size(); i++ )
+		delta_count += DProfileDumpWriter::AppendThread( delta_blocks, delta.threads[i] );
+
+	// after the snapshot, so every name it uses is in the table
+	uint32_t name_count = DProfiler::GetNameCount();
+	std::string strings;
+	for ( size_t i=0; i<clients.size(); i++ )
+	{
+		Client& client = clients[i];
+		if ( client.names_sent < name_count )
+		{
+			if ( strings.empty() )
+				DProfileDumpWriter::AppendStrings( strings );
+			client.output += strings;
+			client.names_sent = name_count;
+		}
+		bool first = client.sequence == 0 || !have_previous;
+		DProfileDumpInterval interval;
+		interval.start_ticks = first ? current.ticks : previous.ticks;
+		interval.end_ticks = current.ticks;
+		interval.sequence = client.sequence++;
+		interval.block_count = first ? totals_count : delta_count;
+		DProfileDumpWriter::AppendBlock( client.output, DProfileDumpBlock::BLOCK_INTERVAL, 0, &interval, sizeof(interval) );
+		client.output += first ? totals_blocks : delta_blocks;
+	}
+	for ( size_t i=clients.size(); i > 0; i-- )
+	{
+		if ( !Send( clients[i-1] ) )
+		{
+			close( clients[i-1].fd );
+			clients.erase( clients.begin()+(i-1) );
+		}
+	}
+
+	std::swap( previous, current );
+	have_previous = true;
+}
@@ -0,0 +1,126 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DProfileReporter_H
+#define _DProfileReporter_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "DProfileSnapshot.h"
+#include "DThread.h"
+
+/** DProfileReporter
+
+ serves profiler results from a running process. a background thread
+ takes a snapshot every interval_ms (with DProfiler::TakeSnapshot(), so the
+ profiled threads aren't held up) and sends every connected client what
+ changed since the last one: per-section call counts and ticks, and, if
+ statistics are enabled, percentiles of the calls made in the interval.
+ the stream uses the DProfileDump block format (see DProfileDump.h); all
+ the encoding happens on the reporter's thread.
+
+ listen on a Unix socket or a TCP port (loopback only unless asked), then
+ start the thread:
+
+    DProfileReporter reporter( 1000 );
+    reporter.ListenUnix( "/tmp/myservice.dprof" );
+    reporter.StartThread();
+
+ and watch with tools/dprofwatch. clients can send commands, one per line;
+ each is answered with a BLOCK_MESSAGE:
+
+    categories <mask>          DProfiler::SetCategoryMask()
+    sample <categories> <rate> DProfiler::SetCategorySampleRate()
+    statistics on|off          DProfiler::EnableStatistics()
+    interval <ms>              change the reporting interval
+    clear                      DProfiler::Clear()
+
+ numbers may be given in hex (0x..). a client that falls more than
+ MAX_PENDING bytes behind is disconnected.
+
+ when a thread exits, its totals move to the retired threads tree; the
+ deltas account for that, so nothing is counted twice.
+
+*/
+
+class DProfileReporter : public DThread
+{
+public:
+	static const size_t MAX_PENDING = 16<<20;
+
+	DProfileReporter( int _interval_ms = 1000 );
+	~DProfileReporter();
+
+	/// listen on a Unix domain socket at path, replacing any stale socket
+	/// there. returns false on failure. call before StartThread().
+	bool ListenUnix( const char* path );
+	/// listen on a TCP port, on the loopback interface only unless
+	/// loopback_only is false. returns false on failure. call before StartThread().
+	bool ListenTCP( int port, bool loopback_only = true );
+
+	/// stop the thread and disconnect all clients
+	void StopThread();
+
+protected:
+	void ThreadedFunction();
+
+private:
+	class Client
+	{
+	public:
+		int fd;
+		/// received but not yet a complete line
+		std::string input;
+		/// encoded but not yet sent
+		std::string output;
+		uint32_t names_sent;
+		uint32_t sequence;
+	};
+
+	void Accept( int listen_fd );
+	/// read and run the client's commands. returns false if it has gone.
+	bool Receive( Client& client );
+	/// send what we can. returns false if the client has gone or fallen too far behind.
+	bool Send( Client& client );
+	void RunCommand( Client& client, const std::string& line );
+	void SendMessage( Client& client, const std::string& message );
+	void Report();
+	/// fill out with what changed from previous to current. threads and
+	/// sections new since previous are copied whole, as is everything
+	/// after a DProfiler::Clear().
+	void ComputeDelta( DProfileSnapshot& out );
+	void CloseAll();
+
+	std::vector<int> listen_fds;
+	std::string unix_path;
+	std::vector<Client> clients;
+	int interval_ms;
+	uint64_t last_report_ticks;
+	bool have_previous;
+	DProfileSnapshot previous;
+	DProfileSnapshot current;
+	// threads gone from the live list whose totals haven't been seen in
+	// the retired tree yet, oldest first
+	std::vector<DProfileThreadSnapshot> departed;
+};
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DProfileScope.h"
+
+DProfileScope::DProfileScope( DProfileSectionDescriptor& _site )
+{
+	// leave room for site itself
+	depth = DProfiler::GetCurrentPath( path, MAX_DEPTH-1 );
+	Start( _site );
+}
+
+DProfileScope::DProfileScope( DProfileSectionDescriptor& _site, const DProfileScope& parent )
+{
+	depth = 0;
+	if ( parent.IsActive() )
+	{
+		depth = parent.depth < MAX_DEPTH ? parent.depth : MAX_DEPTH-1;
+		for ( int i=0; i<depth; i++ )
+			path[i] = parent.path[i];
+	}
+	Start( _site );
+}
+
+void DProfileScope::Start( DProfileSectionDescriptor& _site )
+{
+	site = &_site;
+	if ( depth == MAX_DEPTH )
+		depth--;
+	path[depth++] = site->GetId();
+	generation = DProfiler::GetGeneration();
+	start_ticks = DTime::GetTicks();
+}
+
+DProfileScope& DProfileScope::operator=( DProfileScope&& other )
+{
+	if ( this == &other )
+		return *this;
+	End();
+	site = other.site;
+	depth = other.depth;
+	for ( int i=0; i<depth; i++ )
+		path[i] = other.path[i];
+	start_ticks = other.start_ticks;
+	generation = other.generation;
+	other.site = NULL;
+	return *this;
+}
+
+void DProfileScope::End()
+{
+	if ( !site )
+		return;
+	uint64_t ticks = DTime::GetTicks() - start_ticks;
+	if ( generation == DProfiler::GetGeneration() )
+		DProfiler::SectionRecordPath( path, depth, site, ticks );
+	site = NULL;
+}
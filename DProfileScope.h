@@ -0,0 +1,184 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DProfileScope_H
+#define _DProfileScope_H
+
+#include <stdint.h>
+#include <utility>
+
+#include "DProfiler.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && __has_include(<coroutine>)
+#define DPROFILE_HAVE_COROUTINES
+#include <coroutine>
+#endif
+
+/** DProfileScope
+
+ a profiled section that belongs to a logical task rather than to a thread.
+ PROFILE_THIS_BLOCK pushes onto the calling thread's section stack, so if
+ the block suspends (a co_await, or a callback continuation) and resumes on
+ another thread, the pop lands on the wrong stack. a DProfileScope instead
+ carries its start time and its path (the section names from the toplevel
+ down) with it. it can be moved, across threads if need be, and when it
+ ends it records one call under that path in the tree of whichever thread
+ ends it. there's no lock: that thread only ever writes its own tree.
+
+ a scope started on a thread is a child of the thread's current section; a
+ scope started with a parent scope is a child of the parent, wherever that
+ is. either way the time is wall time from start to end, suspensions
+ included, and scopes are not traced or sampled. a scope isn't pushed onto
+ the thread's stack, so sections pushed while it is open are children of the
+ thread's current section, not of the scope: give them a scope of their own
+ (with PROFILE_CHILD_SCOPE) instead.
+
+    Task<void> Load( Request r )
+    {
+        PROFILE_SCOPE( load, "load" );
+        {
+            PROFILE_CHILD_SCOPE( read, "read", load );
+            co_await socket.Read( .. );   // may resume on another thread
+        }
+        ...
+    }                                     // load ends on the resuming thread
+
+ with C++20 coroutines, DProfileAwait() times a single co_await instead:
+
+    co_await DProfileAwait( socket.Read( .. ), read_site, load );
+
+ as with PROFILE_THIS_BLOCK, label must be a string literal: each macro site
+ interns it once, so anything else is a compile error. without PROFILE
+ defined, the macros declare inactive scopes which record nothing.
+
+*/
+
+class DProfileScope
+{
+public:
+	/// deepest path recorded. deeper scopes are recorded at this depth, under
+	/// their outermost ancestors.
+	static const int MAX_DEPTH = 32;
+
+	/// an inactive scope, which records nothing
+	DProfileScope() : site( NULL ), depth( 0 ), start_ticks( 0 ), generation( 0 ) {}
+	/// start site now, as a child of the calling thread's current section
+	explicit DProfileScope( DProfileSectionDescriptor& _site );
+	/// start site now, as a child of parent. if parent is inactive, as a
+	/// toplevel section.
+	DProfileScope( DProfileSectionDescriptor& _site, const DProfileScope& parent );
+
+	DProfileScope( DProfileScope&& other ) : site( NULL ) { *this = std::move( other ); }
+	/// ends this scope first, if it's active
+	DProfileScope& operator=( DProfileScope&& other );
+	~DProfileScope() { End(); }
+
+	/// record the call in the calling thread's tree, and deactivate. does
+	/// nothing if inactive, or if DProfiler::Clear() was called since the
+	/// scope started.
+	void End();
+	/// forget the scope without recording anything
+	void Cancel() { site = NULL; }
+	bool IsActive() const { return site != NULL; }
+
+	/// ticks since the scope started
+	uint64_t GetElapsedTicks() const { return IsActive() ? DTime::GetTicks() - start_ticks : 0; }
+
+private:
+	DProfileScope( const DProfileScope& );
+	DProfileScope& operator=( const DProfileScope& );
+
+	void Start( DProfileSectionDescriptor& _site );
+
+	DProfileSectionDescriptor* site;
+	// interned name ids from the toplevel down, ending with site's
+	int path[MAX_DEPTH];
+	int depth;
+	uint64_t start_ticks;
+	unsigned generation;
+};
+
+#ifdef PROFILE
+/// declare a DProfileScope called name, started now as a child of the
+/// thread's current section, or of the scope parent
+#define PROFILE_SCOPE( name, label ) static DProfileSectionDescriptor DPROFILE_CONCAT( __scope_profiler_site__, __LINE__ )( "" label, __FILE__, __LINE__ ); \
+    DProfileScope name( DPROFILE_CONCAT( __scope_profiler_site__, __LINE__ ) );
+#define PROFILE_CHILD_SCOPE( name, label, parent ) static DProfileSectionDescriptor DPROFILE_CONCAT( __scope_profiler_site__, __LINE__ )( "" label, __FILE__, __LINE__ ); \
+    DProfileScope name( DPROFILE_CONCAT( __scope_profiler_site__, __LINE__ ), parent );
+#else
+#define PROFILE_SCOPE( name, label ) DProfileScope name;
+#define PROFILE_CHILD_SCOPE( name, label, parent ) DProfileScope name;
+#endif
+
+#ifdef DPROFILE_HAVE_COROUTINES
+
+/** DProfileAwaiter
+
+ wraps an awaiter, timing from suspension to resumption as a DProfileScope
+ (so the time is recorded by the thread that resumes). if the awaiter
+ doesn't suspend, nothing is recorded. made by DProfileAwait().
+
+*/
+
+template <class AWAITER> class DProfileAwaiter
+{
+public:
+	DProfileAwaiter( AWAITER&& _inner, DProfileSectionDescriptor& _site, const DProfileScope* _parent )
+		: inner( std::forward<AWAITER>( _inner ) ), site( _site ), parent( _parent ) {}
+
+	bool await_ready() { return inner.await_ready(); }
+
+	template <class PROMISE> auto await_suspend( std::coroutine_handle<PROMISE> handle )
+	{
+		// before handing over: the coroutine may be resumed elsewhere before
+		// the inner await_suspend() returns
+		scope = parent ? DProfileScope( site, *parent ) : DProfileScope( site );
+		return inner.await_suspend( handle );
+	}
+
+	decltype(auto) await_resume()
+	{
+		scope.End();
+		return inner.await_resume();
+	}
+
+private:
+	AWAITER inner;
+	DProfileSectionDescriptor& site;
+	const DProfileScope* parent;
+	DProfileScope scope;
+};
+
+/// co_await DProfileAwait( awaiter, site ) to time the wait as site. awaiter
+/// must be an awaiter (with await_ready/await_suspend/await_resume), not
+/// just an awaitable.
+template <class AWAITER> DProfileAwaiter<AWAITER> DProfileAwait( AWAITER&& awaiter, DProfileSectionDescriptor& site )
+{
+	return DProfileAwaiter<AWAITER>( std::forward<AWAITER>( awaiter ), site, NULL );
+}
+/// as above, as a child of parent
+template <class AWAITER> DProfileAwaiter<AWAITER> DProfileAwait( AWAITER&& awaiter, DProfileSectionDescriptor& site, const DProfileScope& parent )
+{
+	return DProfileAwaiter<AWAITER>( std::forward<AWAITER>( awaiter ), site, &parent );
+}
+
+#endif
+
+#endif
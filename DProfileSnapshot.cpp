@@ -0,0 +1,433 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DProfileSnapshot.h"
+#include "DProfiler.h"
+
+#include <algorithm>
+#include <iterator>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static const uint32_t NO_RECORD = 0xffffffffu;
+
+void DProfileThreadSnapshot::ComputeSelfTicks( const DProfileOverhead& overhead, bool subtract )
+{
+	// children are always created after their parents, so one pass backwards
+	// sees every child before its parent
+	uint32_t count = sections.size();
+	// calls of everything below each section
+	std::vector<uint64_t> below_calls( count, 0 );
+	for ( uint32_t i=count; i-- > 1; )
+		below_calls[sections[i].parent] += below_calls[i] + sections[i].call_count;
+	std::vector<int64_t> self( count );
+	for ( uint32_t i=0; i<count; i++ )
+	{
+		DProfileSectionSnapshot& s = sections[i];
+		uint64_t total = s.GetTotalTicks();
+		double inclusive = s.call_count*overhead.inner_ticks + below_calls[i]*overhead.GetPairTicks();
+		s.overhead_ticks = (uint64_t)std::min( inclusive, (double)total );
+		s.reported_ticks = subtract ? total - s.overhead_ticks : total;
+		self[i] = s.reported_ticks;
+	}
+	for ( uint32_t i=count; i-- > 1; )
+		self[sections[i].parent] -= sections[i].reported_ticks;
+	// extrapolated children of sampled sections, and overhead estimates, can overshoot
+	for ( uint32_t i=0; i<count; i++ )
+		sections[i].self_ticks = self[i] > 0 ? self[i] : 0;
+}
+
+void DProfileSnapshot::BuildIndex()
+{
+	records.clear();
+	path_index.clear();
+	next_same_path.clear();
+
+	// resolve each name once, rather than taking the names lock per section
+	std::vector<std::string> names;
+	std::vector<bool> have_name;
+
+	std::vector<std::string> paths;
+	std::vector<int> depths;
+	for ( uint32_t t=0; t<threads.size(); t++ )
+	{
+		DProfileThreadSnapshot& thread = threads[t];
+		uint32_t count = thread.sections.size();
+		thread.ComputeSelfTicks( overhead, subtract_overhead );
+
+		// parents come before their children, so paths can be built forwards
+		paths.assign( count, std::string() );
+		depths.assign( count, 0 );
+		for ( uint32_t i=1; i<count; i++ )
+		{
+			const DProfileSectionSnapshot& s = thread.sections[i];
+			int id = s.name_id;
+			if ( id >= (int)names.size() )
+			{
+				names.resize( id+1 );
+				have_name.resize( id+1, false );
+			}
+			if ( !have_name[id] )
+			{
+				names[id] = DProfiler::GetName( id );
+				have_name[id] = true;
+			}
+			if ( s.parent == 0 )
+				paths[i] = names[id];
+			else
+				paths[i] = paths[s.parent] + "/" + names[id];
+			depths[i] = depths[s.parent]+1;
+		}
+
+		for ( uint32_t i=1; i<count; i++ )
+		{
+			const DProfileSectionSnapshot& s = thread.sections[i];
+			records.push_back( DProfileSectionRecord() );
+			DProfileSectionRecord& r = records.back();
+			r.path.swap( paths[i] );
+			r.thread_index = thread.thread_index;
+			r.thread = t;
+			r.index = i;
+			r.depth = depths[i];
+			r.call_count = s.call_count;
+			r.total_millis = s.GetReportedMillis();
+			r.self_millis = DTime::TicksToMillis( s.self_ticks );
+			r.average_millis = s.GetReportedAverageMillis();
+			r.overhead_millis = DTime::TicksToMillis( s.overhead_ticks );
+			const DProfileStats* stats = thread.GetStats( i );
+			r.min_millis = stats ? DTime::TicksToMillis( stats->min_ticks ) : 0;
+			r.max_millis = stats ? DTime::TicksToMillis( stats->max_ticks ) : 0;
+			r.p50_millis = stats ? DTime::TicksToMillis( stats->GetPercentile( 0.5 ) ) : 0;
+			r.p90_millis = stats ? DTime::TicksToMillis( stats->GetPercentile( 0.9 ) ) : 0;
+			r.p99_millis = stats ? DTime::TicksToMillis( stats->GetPercentile( 0.99 ) ) : 0;
+			r.p999_millis = stats ? DTime::TicksToMillis( stats->GetPercentile( 0.999 ) ) : 0;
+			if ( i < thread.counters.size() )
+			{
+				const DProfileCounterTotals& c = thread.counters[i];
+				r.ipc = c.GetIPC();
+				r.cache_misses_per_call = c.GetPerCall( DPerfCounters::CACHE_MISSES, s.timed_count );
+				r.branch_misses_per_call = c.GetPerCall( DPerfCounters::BRANCH_MISSES, s.timed_count );
+			}
+			else
+				r.ipc = r.cache_misses_per_call = r.branch_misses_per_call = 0;
+			if ( i < thread.allocs.size() && s.call_count )
+			{
+				const DProfileAllocTotals& a = thread.allocs[i];
+				r.allocs_per_call = (double)a.count / (double)s.call_count;
+				r.alloc_bytes_per_call = (double)a.bytes / (double)s.call_count;
+				r.alloc_millis = DTime::TicksToMillis( a.ticks );
+			}
+			else
+				r.allocs_per_call = r.alloc_bytes_per_call = r.alloc_millis = 0;
+			if ( i < thread.frames.size() )
+				r.frames = thread.frames[i];
+			else
+				memset( &r.frames, 0, sizeof(r.frames) );
+		}
+	}
+
+	// chain records with the same path in order, via the last one seen
+	next_same_path.assign( records.size(), NO_RECORD );
+	std::unordered_map<std::string, uint32_t> last;
+	path_index.reserve( records.size() );
+	for ( uint32_t i=0; i<records.size(); i++ )
+	{
+		std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> inserted = path_index.insert( std::make_pair( records[i].path, i ) );
+		if ( !inserted.second )
+			next_same_path[last[records[i].path]] = i;
+		last[records[i].path] = i;
+	}
+}
+
+const DProfileSectionRecord* DProfileSnapshot::Find( const std::string& path, int thread_index ) const
+{
+	std::unordered_map<std::string, uint32_t>::const_iterator it = path_index.find( path );
+	if ( it == path_index.end() )
+		return NULL;
+	for ( uint32_t i = it->second; i != NO_RECORD; i = next_same_path[i] )
+	{
+		if ( thread_index == -1 || records[i].thread_index == thread_index )
+			return &records[i];
+	}
+	return NULL;
+}
+
+void DProfileSnapshot::FindAll( const std::string& path, std::vector<const DProfileSectionRecord*>& out ) const
+{
+	std::unordered_map<std::string, uint32_t>::const_iterator it = path_index.find( path );
+	if ( it == path_index.end() )
+		return;
+	for ( uint32_t i = it->second; i != NO_RECORD; i = next_same_path[i] )
+		out.push_back( &records[i] );
+}
+
+class record_comparator
+{
+public:
+	record_comparator( DProfileSnapshot::TOP_BY _by ) : by( _by ) {}
+	bool operator() ( const DProfileSectionRecord* a, const DProfileSectionRecord* b )
+	{
+		if ( by == DProfileSnapshot::TOP_BY_SELF )
+			return a->self_millis > b->self_millis;
+		return a->total_millis > b->total_millis;
+	}
+private:
+	DProfileSnapshot::TOP_BY by;
+};
+
+void DProfileSnapshot::GetTopSections( size_t k, TOP_BY by, std::vector<const DProfileSectionRecord*>& out ) const
+{
+	out.clear();
+	out.reserve( records.size() );
+	for ( size_t i=0; i<records.size(); i++ )
+		out.push_back( &records[i] );
+	if ( k > out.size() )
+		k = out.size();
+	std::partial_sort( out.begin(), out.begin()+k, out.end(), record_comparator( by ) );
+	out.resize( k );
+}
+
+
+
+DProfileTreeMerger::DProfileTreeMerger( DProfileThreadSnapshot& _out ) : out( _out )
+{
+	out.context = NULL;
+	out.thread_index = -1;
+	out.merged_count = 0;
+	out.sections.clear();
+	out.stats.clear();
+	out.frames.clear();
+	out.counters.clear();
+	out.allocs.clear();
+	out.cpus.clear();
+	out.last_cpu = -1;
+	out.dropped_calls = 0;
+	AddSection( 0, 0 );
+}
+
+void DProfileTreeMerger::Add( const DProfileThreadSnapshot& source )
+{
+	out.merged_count += source.merged_count;
+	out.dropped_calls += source.dropped_calls;
+	if ( !source.cpus.empty() )
+	{
+		std::vector<int> cpus;
+		std::set_union( out.cpus.begin(), out.cpus.end(), source.cpus.begin(), source.cpus.end(), std::back_inserter( cpus ) );
+		out.cpus.swap( cpus );
+	}
+	bool with_stats = !source.stats.empty();
+	if ( with_stats && out.stats.empty() )
+	{
+		out.stats.resize( out.sections.size() );
+		for ( size_t i=0; i<out.stats.size(); i++ )
+			out.stats[i].Clear();
+	}
+	bool with_frames = !source.frames.empty();
+	if ( with_frames && out.frames.empty() )
+	{
+		out.frames.resize( out.sections.size() );
+		memset( out.frames.data(), 0, out.frames.size()*sizeof(DProfileFrameSummary) );
+	}
+	bool with_counters = !source.counters.empty();
+	if ( with_counters && out.counters.empty() )
+	{
+		out.counters.resize( out.sections.size() );
+		for ( size_t i=0; i<out.counters.size(); i++ )
+			out.counters[i].Clear();
+	}
+	bool with_allocs = !source.allocs.empty();
+	if ( with_allocs && out.allocs.empty() )
+	{
+		out.allocs.resize( out.sections.size() );
+		for ( size_t i=0; i<out.allocs.size(); i++ )
+			out.allocs[i].Clear();
+	}
+
+	uint32_t count = source.sections.size();
+	mapping.resize( count );
+	for ( uint32_t i=0; i<count; i++ )
+	{
+		const DProfileSectionSnapshot& s = source.sections[i];
+		uint32_t m = 0;
+		if ( i != 0 )
+		{
+			uint32_t parent = mapping[s.parent];
+			uint64_t key = ( (uint64_t)parent << 32 ) | (uint32_t)s.name_id;
+			std::unordered_map<uint64_t, uint32_t>::iterator it = children.find( key );
+			if ( it != children.end() )
+				m = it->second;
+			else
+			{
+				m = AddSection( parent, s.name_id );
+				children[key] = m;
+			}
+		}
+		mapping[i] = m;
+
+		// totals are summed after extrapolation, so the merged section is
+		// never itself "sampled"; the errors add in quadrature
+		DProfileSectionSnapshot& d = out.sections[m];
+		d.call_count += s.call_count;
+		d.total_ticks += s.GetTotalTicks();
+		d.timed_count += s.call_count;
+		if ( s.sample_rate > d.sample_rate )
+			d.sample_rate = s.sample_rate;
+		d.sampled_total_error = sqrt( d.sampled_total_error*d.sampled_total_error + s.sampled_total_error*s.sampled_total_error );
+		if ( with_stats )
+			out.stats[m].Merge( source.stats[i] );
+		if ( with_counters )
+		{
+			// extrapolated like the ticks, since every merged call counts as timed
+			double scale = s.timed_count ? (double)s.call_count / (double)s.timed_count : 0.0;
+			for ( int c=0; c<DPerfCounters::COUNT; c++ )
+				out.counters[m].values[c] += s.IsSampled() ? (uint64_t)( (double)source.counters[i].values[c] * scale ) : source.counters[i].values[c];
+		}
+		if ( with_allocs )
+		{
+			// every call is counted, sampled or not
+			out.allocs[m].count += source.allocs[i].count;
+			out.allocs[m].bytes += source.allocs[i].bytes;
+			out.allocs[m].ticks += source.allocs[i].ticks;
+		}
+		if ( with_frames )
+		{
+			// frames line up across threads, so last and average add up
+			// exactly. min and max become bounds on the true min and max.
+			DProfileFrameSummary& f = out.frames[m];
+			const DProfileFrameSummary& sf = source.frames[i];
+			if ( sf.frames > f.frames )
+				f.frames = sf.frames;
+			f.last_millis += sf.last_millis;
+			f.last_calls += sf.last_calls;
+			f.average_millis += sf.average_millis;
+			f.min_millis += sf.min_millis;
+			f.max_millis += sf.max_millis;
+		}
+	}
+}
+
+uint32_t DProfileTreeMerger::AddSection( uint32_t parent, int name_id )
+{
+	uint32_t index = out.sections.size();
+	out.sections.push_back( DProfileSectionSnapshot() );
+	DProfileSectionSnapshot& s = out.sections.back();
+	memset( &s, 0, sizeof(s) );
+	s.parent = parent;
+	s.name_id = name_id;
+	s.sample_rate = 1;
+	if ( !out.stats.empty() )
+	{
+		out.stats.push_back( DProfileStats() );
+		out.stats.back().Clear();
+	}
+	if ( !out.frames.empty() )
+	{
+		out.frames.push_back( DProfileFrameSummary() );
+		memset( &out.frames.back(), 0, sizeof(DProfileFrameSummary) );
+	}
+	if ( !out.counters.empty() )
+	{
+		out.counters.push_back( DProfileCounterTotals() );
+		out.counters.back().Clear();
+	}
+	if ( !out.allocs.empty() )
+	{
+		out.allocs.push_back( DProfileAllocTotals() );
+		out.allocs.back().Clear();
+	}
+	// link in as the last child, to keep the first thread's execution order
+	last_child.push_back( 0 );
+	if ( index != 0 )
+	{
+		if ( last_child[parent] == 0 )
+			out.sections[parent].first_child = index;
+		else
+			out.sections[last_child[parent]].next_sibling = index;
+		last_child[parent] = index;
+	}
+	return index;
+}
+
+class DProfileMergeJob
+{
+public:
+	const DProfileSnapshot* snapshot;
+	size_t begin, end;
+	DProfileThreadSnapshot partial;
+
+	void Run()
+	{
+		DProfileTreeMerger merger( partial );
+		for ( size_t i=begin; i<end; i++ )
+			merger.Add( snapshot->threads[i] );
+	}
+	static void* RunThread( void* job ) { ((DProfileMergeJob*)job)->Run(); return NULL; }
+};
+
+// fewer trees than this per worker aren't worth starting a thread for
+static const size_t MIN_TREES_PER_WORKER = 8;
+
+void DProfileSnapshot::Merge( DProfileSnapshot& out, int max_workers ) const
+{
+	out.threads.assign( 1, DProfileThreadSnapshot() );
+	out.ticks = ticks;
+	out.semaphores = semaphores;
+	out.overhead = overhead;
+	out.subtract_overhead = subtract_overhead;
+	DProfileThreadSnapshot& merged = out.threads[0];
+	merged.name = "All threads";
+
+	size_t workers = max_workers > 0 ? max_workers : sysconf( _SC_NPROCESSORS_ONLN );
+	if ( workers > threads.size()/MIN_TREES_PER_WORKER )
+		workers = threads.size()/MIN_TREES_PER_WORKER;
+
+	DProfileTreeMerger merger( merged );
+	if ( workers <= 1 )
+	{
+		for ( size_t i=0; i<threads.size(); i++ )
+			merger.Add( threads[i] );
+	}
+	else
+	{
+		// each worker merges a contiguous run of trees, then the partial
+		// trees are merged here, in order
+		std::vector<DProfileMergeJob> jobs( workers );
+		std::vector<pthread_t> handles( workers );
+		std::vector<bool> started( workers, false );
+		for ( size_t w=0; w<workers; w++ )
+		{
+			jobs[w].snapshot = this;
+			jobs[w].begin = threads.size()*w/workers;
+			jobs[w].end = threads.size()*(w+1)/workers;
+			started[w] = w > 0 && pthread_create( &handles[w], NULL, DProfileMergeJob::RunThread, &jobs[w] ) == 0;
+		}
+		for ( size_t w=0; w<workers; w++ )
+		{
+			if ( started[w] )
+				pthread_join( handles[w], NULL );
+			else
+				jobs[w].Run();
+			merger.Add( jobs[w].partial );
+		}
+	}
+
+	out.BuildIndex();
+}
@@ -0,0 +1,311 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DProfileSnapshot_H
+#define _DProfileSnapshot_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DPerfCounters.h"
+#include "DProfileStats.h"
+#include "DSemaphore.h"
+#include "DTime.h"
+
+class DProfileContext;
+
+/** DProfileSnapshot
+
+ a consistent copy of every thread's section tree, taken by
+ DProfiler::TakeSnapshot() while the profiled threads keep running. each
+ section is copied under its own seqlock, so its counters always agree with
+ each other (call count, time and statistics come from the same set of
+ calls), though different sections may be copied a few pops apart.
+
+ once taken, a snapshot can be formatted, sorted and searched at leisure
+ without holding up the profiled threads. besides the raw trees it holds a
+ flat array of DProfileSectionRecords, one per section per thread, indexed
+ by path:
+
+    DProfileSnapshot snapshot;
+    DProfiler::TakeSnapshot( snapshot );
+    const DProfileSectionRecord* shadow = snapshot.Find( "frame/render/shadow" );
+    std::vector<const DProfileSectionRecord*> top;
+    snapshot.GetTopSections( 10, DProfileSnapshot::TOP_BY_SELF, top );
+
+ to read a few sections every frame, resolve them once with
+ DProfiler::FindSection() and read them with DProfiler::ReadSection()
+ instead; that costs a seqlocked copy of one section, not a snapshot.
+
+*/
+
+class DProfileSectionSnapshot
+{
+public:
+	uint64_t call_count;
+	uint64_t total_ticks;
+	uint64_t timed_count;
+	/// tree links, as indices into DProfileThreadSnapshot::sections. 0 is the
+	/// toplevel section, and doubles as "none" for first_child/next_sibling.
+	uint32_t parent;
+	uint32_t first_child;
+	uint32_t next_sibling;
+	int name_id;
+	uint32_t sample_rate;
+	/// standard error of GetTotalTicks(), in ticks (0 unless sampled)
+	double sampled_total_error;
+	/// GetTotalTicks() less the total of the children (and less the
+	/// profiler's overhead, if the snapshot subtracts it). filled in by
+	/// DProfileSnapshot::BuildIndex().
+	uint64_t self_ticks;
+	/// estimated profiler overhead included in GetTotalTicks(): part of
+	/// each of this section's own pushes and pops, and all of every push
+	/// and pop below it. 0 unless DProfiler::Calibrate() has been run.
+	/// filled in by BuildIndex().
+	uint64_t overhead_ticks;
+	/// GetTotalTicks(), less overhead_ticks if the snapshot subtracts it.
+	/// filled in by BuildIndex().
+	uint64_t reported_ticks;
+
+	bool IsSampled() const { return timed_count != call_count; }
+	/// total ticks, extrapolated from the timed calls if sampling
+	uint64_t GetTotalTicks() const
+	{
+		if ( !IsSampled() )
+			return total_ticks;
+		return timed_count ? (uint64_t)( (double)total_ticks * (double)call_count / (double)timed_count ) : 0;
+	}
+	double GetTotalMillis() const { return DTime::TicksToMillis( GetTotalTicks() ); }
+	double GetAverageMillis() const { return timed_count ? DTime::TicksToMillis( total_ticks )/(double)timed_count : 0.0; }
+	/// reported_ticks, in total and per call
+	double GetReportedMillis() const { return DTime::TicksToMillis( reported_ticks ); }
+	double GetReportedAverageMillis() const { return call_count ? DTime::TicksToMillis( reported_ticks )/(double)call_count : 0.0; }
+};
+
+/// what profiling a section costs, in ticks per call, as measured by
+/// DProfiler::Calibrate(). inner_ticks falls between a section's own clock
+/// reads, so it is counted in the section's time; outer_ticks falls
+/// outside them, in the parent's time. a parent's time therefore includes
+/// inner_ticks + outer_ticks for every call below it.
+class DProfileOverhead
+{
+public:
+	DProfileOverhead() : inner_ticks( 0 ), outer_ticks( 0 ) {}
+	bool IsCalibrated() const { return inner_ticks + outer_ticks > 0; }
+	double GetPairTicks() const { return inner_ticks + outer_ticks; }
+
+	double inner_ticks;
+	double outer_ticks;
+};
+
+/// one section's cost over the frames in DProfiler's frame history (see
+/// DProfiler::FrameBoundary()). frames is 0 if there is no history.
+class DProfileFrameSummary
+{
+public:
+	uint32_t frames;
+	/// the most recently completed frame
+	double last_millis;
+	uint64_t last_calls;
+	/// over all frames in the history
+	double average_millis;
+	double min_millis;
+	double max_millis;
+};
+
+/// heap allocations made directly in one section (not in its children),
+/// when allocation tracking is on. see DProfiler::EnableAllocationTracking().
+class DProfileAllocTotals
+{
+public:
+	void Clear() { count = 0; bytes = 0; ticks = 0; }
+
+	/// operator new calls, and the bytes they asked for
+	uint64_t count;
+	uint64_t bytes;
+	/// time spent in operator new and operator delete
+	uint64_t ticks;
+};
+
+class DProfileThreadSnapshot
+{
+public:
+	DProfileThreadSnapshot() : context( NULL ), thread_index( 0 ), merged_count( 1 ), last_cpu( -1 ), dropped_calls( 0 ) {}
+
+	/// the context this was copied from, and the order it registered in.
+	/// NULL and -1 for a merged tree (see DProfileSnapshot::Merge()).
+	const DProfileContext* context;
+	int thread_index;
+	/// number of threads summed into this tree
+	int merged_count;
+	/// as given to DProfiler::RegisterThread(), or a description of a merged tree
+	std::string name;
+	/// CPUs the thread was seen running on (sampled; see
+	/// DProfileContext::RecordCPU()), ascending, and the latest. for a merged
+	/// tree, every CPU any of its threads ran on, and -1.
+	std::vector<int> cpus;
+	int last_cpu;
+	/// calls that weren't counted because the thread had as many sections as
+	/// DProfiler::SetLimits() allows. their time is in their parents' self time.
+	uint64_t dropped_calls;
+
+	std::vector<DProfileSectionSnapshot> sections;
+	/// per-section statistics, parallel to sections. empty unless statistics
+	/// were enabled when the snapshot was taken.
+	std::vector<DProfileStats> stats;
+	/// per-section frame history summaries, parallel to sections. empty
+	/// unless frame history is enabled.
+	std::vector<DProfileFrameSummary> frames;
+	/// per-section hardware counter totals over the timed calls, parallel to
+	/// sections. empty unless counters were enabled (see DProfiler::EnableCounters()).
+	std::vector<DProfileCounterTotals> counters;
+	/// per-section allocation totals, parallel to sections. empty unless
+	/// allocation tracking was enabled.
+	std::vector<DProfileAllocTotals> allocs;
+
+	/// return the statistics for the given section, or NULL if there are none
+	const DProfileStats* GetStats( uint32_t index ) const
+	{
+		if ( index >= stats.size() || stats[index].count == 0 )
+			return NULL;
+		return &stats[index];
+	}
+
+	/// fill in self_ticks, overhead_ticks and reported_ticks for every
+	/// section, estimating overhead with the given calibration and
+	/// subtracting it if subtract is set
+	void ComputeSelfTicks( const DProfileOverhead& overhead = DProfileOverhead(), bool subtract = false );
+};
+
+/// one section of one thread, flattened out of the tree with everything
+/// converted to milliseconds
+class DProfileSectionRecord
+{
+public:
+	/// section names from the toplevel down, joined with '/'
+	std::string path;
+	int thread_index;
+	/// this section in DProfileSnapshot::threads[thread].sections
+	uint32_t thread;
+	uint32_t index;
+	/// 1 for toplevel sections
+	int depth;
+
+	uint64_t call_count;
+	/// less the profiler's estimated overhead if the snapshot subtracts it
+	double total_millis;
+	double self_millis;
+	double average_millis;
+	/// the estimated overhead in total_millis (or that was subtracted from it)
+	double overhead_millis;
+	/// from the section's statistics; all 0 if statistics weren't enabled
+	double min_millis;
+	double max_millis;
+	double p50_millis;
+	double p90_millis;
+	double p99_millis;
+	double p999_millis;
+	/// from the section's hardware counters; all 0 if counters weren't enabled
+	double ipc;
+	double cache_misses_per_call;
+	double branch_misses_per_call;
+	/// from the section's own allocations; all 0 if allocation tracking wasn't enabled
+	double allocs_per_call;
+	double alloc_bytes_per_call;
+	double alloc_millis;
+	/// cost per frame, if frame history is enabled (frames.frames is 0 otherwise)
+	DProfileFrameSummary frames;
+};
+
+class DProfileSnapshot
+{
+public:
+	DProfileSnapshot() : ticks( 0 ), subtract_overhead( false ) {}
+
+	/// one entry per registered thread with data since the last DProfiler::Clear()
+	std::vector<DProfileThreadSnapshot> threads;
+	/// DTime::GetTicks() when the snapshot was taken
+	uint64_t ticks;
+	/// counters of every named DSemaphore
+	std::vector<DSemaphoreStats> semaphores;
+	/// the calibration current when the snapshot was taken, and whether
+	/// BuildIndex() subtracts it from reported times (see
+	/// DProfiler::EnableOverheadCorrection()). statistics are never corrected.
+	DProfileOverhead overhead;
+	bool subtract_overhead;
+
+	/// fill in self times, records and the path index from threads. called
+	/// by DProfiler::TakeSnapshot().
+	void BuildIndex();
+
+	/// every section of every thread, by thread and then in execution order
+	const std::vector<DProfileSectionRecord>& GetRecords() const { return records; }
+	/// return the record for path in the given thread (by thread_index), or
+	/// in the first thread that has it if thread_index is -1. NULL if not found.
+	const DProfileSectionRecord* Find( const std::string& path, int thread_index = -1 ) const;
+	/// add the records for path in every thread to out
+	void FindAll( const std::string& path, std::vector<const DProfileSectionRecord*>& out ) const;
+
+	typedef enum _TOP_BY { TOP_BY_TOTAL, TOP_BY_SELF } TOP_BY;
+	/// put the (up to) k most expensive records into out, most expensive first
+	void GetTopSections( size_t k, TOP_BY by, std::vector<const DProfileSectionRecord*>& out ) const;
+
+	/// sum sections with the same path over all threads, into a snapshot
+	/// with a single indexed thread. with many threads the work is split
+	/// across up to max_workers threads (0 for one per CPU).
+	void Merge( DProfileSnapshot& out, int max_workers = 0 ) const;
+
+private:
+	std::vector<DProfileSectionRecord> records;
+	// path -> first record with that path. records with the same path are
+	// chained through next_same_path, in thread order.
+	std::unordered_map<std::string, uint32_t> path_index;
+	std::vector<uint32_t> next_same_path;
+};
+
+/** DProfileTreeMerger
+
+ sums section trees into out, matching sections by parent and name. keeps
+ its lookup tables between calls, so trees can be added one at a time.
+
+*/
+
+class DProfileTreeMerger
+{
+public:
+	/// clears out
+	DProfileTreeMerger( DProfileThreadSnapshot& _out );
+
+	void Add( const DProfileThreadSnapshot& source );
+
+private:
+	uint32_t AddSection( uint32_t parent, int name_id );
+
+	DProfileThreadSnapshot& out;
+	// (merged parent << 32 | name id) -> merged section
+	std::unordered_map<uint64_t, uint32_t> children;
+	std::vector<uint32_t> last_child;
+	// source section -> merged section, for the source being added
+	std::vector<uint32_t> mapping;
+};
+
+#endif
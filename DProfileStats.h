@@ -0,0 +1,192 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DProfileStats_H
+#define _DProfileStats_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/** DProfileStats
+
+ per-section timing statistics: min, max, streaming mean/variance (Welford)
+ and a log2 histogram with SUB_BUCKETS linear sub-buckets per power of two.
+ all values are in DTime ticks. fixed size (about 8kb), so Add() never
+ allocates.
+
+*/
+
+class DProfileStats
+{
+public:
+	static const int SUB_BUCKET_BITS = 4;
+	static const int SUB_BUCKETS = 1<<SUB_BUCKET_BITS;
+	static const int NUM_BUCKETS = (64-SUB_BUCKET_BITS+1)*SUB_BUCKETS;
+
+	void Clear() { memset( this, 0, sizeof(DProfileStats) ); min_ticks = UINT64_MAX; }
+
+	/// add one sample
+	void Add( uint64_t ticks )
+	{
+		count++;
+		if ( ticks < min_ticks )
+			min_ticks = ticks;
+		if ( ticks > max_ticks )
+			max_ticks = ticks;
+		double delta = (double)ticks - mean;
+		mean += delta / (double)count;
+		m2 += delta * ( (double)ticks - mean );
+		buckets[GetBucketIndex( ticks )]++;
+	}
+
+	/// add all of other's samples, as if they had been added here
+	void Merge( const DProfileStats& other )
+	{
+		if ( other.count == 0 )
+			return;
+		if ( count == 0 )
+		{
+			*this = other;
+			return;
+		}
+		// combined mean/variance (Chan et al.)
+		double n = (double)( count + other.count );
+		double delta = other.mean - mean;
+		mean += delta * (double)other.count / n;
+		m2 += other.m2 + delta * delta * (double)count * (double)other.count / n;
+		count += other.count;
+		if ( other.min_ticks < min_ticks )
+			min_ticks = other.min_ticks;
+		if ( other.max_ticks > max_ticks )
+			max_ticks = other.max_ticks;
+		for ( int i=0; i<NUM_BUCKETS; i++ )
+			buckets[i] += other.buckets[i];
+	}
+
+	/// remove the samples of earlier, an older copy of these statistics,
+	/// leaving those added since. the histogram, count, mean and variance
+	/// are exact; min and max become the bounds of the lowest and highest
+	/// buckets in use, clamped to the overall min and max.
+	void Subtract( const DProfileStats& earlier )
+	{
+		if ( earlier.count == 0 )
+			return;
+		if ( earlier.count >= count )
+		{
+			Clear();
+			return;
+		}
+		// Merge() in reverse
+		double n = (double)( count - earlier.count );
+		double later_mean = ( mean * (double)count - earlier.mean * (double)earlier.count ) / n;
+		double delta = later_mean - earlier.mean;
+		m2 -= earlier.m2 + delta * delta * (double)earlier.count * n / (double)count;
+		if ( m2 < 0 )
+			m2 = 0;
+		mean = later_mean;
+		count -= earlier.count;
+		int lowest = -1, highest = -1;
+		for ( int i=0; i<NUM_BUCKETS; i++ )
+		{
+			buckets[i] -= earlier.buckets[i];
+			if ( buckets[i] )
+			{
+				if ( lowest < 0 )
+					lowest = i;
+				highest = i;
+			}
+		}
+		if ( lowest >= 0 )
+		{
+			uint64_t low = GetBucketLowerBound( lowest );
+			uint64_t high = GetBucketLowerBound( highest ) + GetBucketWidth( highest ) - 1;
+			if ( low > min_ticks )
+				min_ticks = low;
+			if ( high < max_ticks )
+				max_ticks = high;
+		}
+	}
+
+	/// variance of the samples, in ticks^2
+	double GetVariance() const { return count > 1 ? m2 / (double)(count-1) : 0.0; }
+	double GetStdDev() const { return sqrt( GetVariance() ); }
+
+	/// return the value below which fraction (0..1) of the samples lie, estimated
+	/// from the middle of the histogram bucket it falls in. a bucket is at most
+	/// 1/SUB_BUCKETS of its lower bound wide, so the estimate is within
+	/// 1/(2*SUB_BUCKETS) (about 3%) of the true value.
+	uint64_t GetPercentile( double fraction ) const
+	{
+		if ( count == 0 )
+			return 0;
+		uint64_t target = (uint64_t)ceil( fraction * (double)count );
+		if ( target == 0 )
+			target = 1;
+		uint64_t seen = 0;
+		for ( int i=0; i<NUM_BUCKETS; i++ )
+		{
+			seen += buckets[i];
+			if ( seen >= target )
+			{
+				uint64_t value = GetBucketLowerBound( i ) + GetBucketWidth( i )/2;
+				// the histogram can't be more accurate than the true extremes
+				if ( value < min_ticks )
+					value = min_ticks;
+				if ( value > max_ticks )
+					value = max_ticks;
+				return value;
+			}
+		}
+		return max_ticks;
+	}
+
+	static int GetBucketIndex( uint64_t ticks )
+	{
+		if ( ticks < (uint64_t)SUB_BUCKETS )
+			return (int)ticks;
+		int msb = 63 - __builtin_clzll( ticks );
+		int sub = (int)( ticks >> (msb-SUB_BUCKET_BITS) ) & (SUB_BUCKETS-1);
+		return ( (msb-SUB_BUCKET_BITS+1) << SUB_BUCKET_BITS ) + sub;
+	}
+	static uint64_t GetBucketLowerBound( int index )
+	{
+		if ( index < SUB_BUCKETS )
+			return index;
+		int msb = (index >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+		return ( 1ull << msb ) | ( (uint64_t)(index & (SUB_BUCKETS-1)) << (msb-SUB_BUCKET_BITS) );
+	}
+	static uint64_t GetBucketWidth( int index )
+	{
+		if ( index < SUB_BUCKETS )
+			return 1;
+		return 1ull << ( (index >> SUB_BUCKET_BITS) - 1 );
+	}
+
+	uint64_t count;
+	uint64_t min_ticks;
+	uint64_t max_ticks;
+	double mean;
+	double m2;
+	// 64-bit like count, so that hot sections and merged trees can't wrap them
+	uint64_t buckets[NUM_BUCKETS];
+};
+
+#endif
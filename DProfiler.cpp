@@ -20,208 +20,1740 @@
 #include "DProfiler.h"
 
 #include <algorithm>
+#include <math.h>
+#include <sched.h>
+#include <string.h>
 
 #include "DThread.h"
 
 DProfiler::DProfileContexts DProfiler::contexts;
-DSemaphore DProfiler::lock;
+DProfiler::DProfileContexts DProfiler::free_contexts;
+int DProfiler::next_thread_index = 0;
+DProfileThreadSnapshot DProfiler::retired;
+DProfileTreeMerger* DProfiler::retired_merger = NULL;
+DMutex DProfiler::retired_lock;
+pthread_key_t DProfiler::thread_key;
+pthread_once_t DProfiler::thread_key_once = PTHREAD_ONCE_INIT;
+DMutex DProfiler::lock;
+DPROFILE_THREAD_LOCAL DProfileContext* DProfiler::thread_context = NULL;
+thread_local bool DProfiler::internal_allocation = false;
+std::atomic<unsigned> DProfiler::generation( 1 );
+std::atomic<bool> DProfiler::statistics_enabled( false );
+std::atomic<bool> DProfiler::counters_enabled( false );
+std::atomic<bool> DProfiler::allocation_tracking_enabled( false );
+std::atomic<bool> DProfiler::tracing_enabled( false );
+std::atomic<bool> DProfiler::overhead_correction_enabled( false );
+DProfileOverhead DProfiler::overhead;
+TRACE_POLICY DProfiler::trace_policy = TRACE_DROP_NEWEST;
+uint32_t DProfiler::trace_capacity = 65536;
+std::vector<DProfiler::DRetiredTrace> DProfiler::retired_traces;
+uint32_t DProfiler::frame_history_size = 0;
+std::atomic<uint64_t> DProfiler::frame_count( 0 );
+uint32_t DProfiler::max_sections = 0;
+uint32_t DProfiler::max_children = 0;
+uint32_t DProfiler::max_names = 0;
+int DProfiler::other_name_id = 0;
+DMutex DProfiler::frames_lock;
+std::atomic<uint32_t> DProfiler::category_mask( PROFILE_CAT_ALL );
+std::atomic<uint32_t> DProfiler::category_sample_rates[32] = {
+    {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1},
+    {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1}, {1} };
+DProfiler::SAMPLING_MODE DProfiler::sampling_mode = DProfiler::SAMPLE_PERIODIC;
+DProfiler::DNameIds DProfiler::name_ids;
+std::vector<std::string> DProfiler::names;
+DMutex DProfiler::names_lock;
 
-int DProfileSection::EXEC_ORDER_ID = 0;
 
-DTime DProfiler::end_time;
+DProfileContext::DProfileContext()
+{
+    chunks.store( &first_chunk, std::memory_order_relaxed );
+    chunk_capacity = 1;
+    chunk_count.store( 0, std::memory_order_relaxed );
+    section_count.store( 0, std::memory_order_relaxed );
+    generation.store( 0, std::memory_order_relaxed );
+    thread_index = 0;
+    incarnation.store( 0, std::memory_order_relaxed );
+    trace.store( NULL, std::memory_order_relaxed );
+    frame_history = NULL;
+    perf = NULL;
+    random_state = 0x9e3779b9u ^ (uint32_t)(uintptr_t)this;
+    // created by the thread that will use it, so allocated on its node
+    DThread::GetCurrentCPU( &numa_node );
+    cpu_countdown = CPU_SAMPLE_INTERVAL;
+    for ( int i=0; i<MAX_CPUS/64; i++ )
+        cpus_seen[i].store( 0, std::memory_order_relaxed );
+    last_cpu.store( -1, std::memory_order_relaxed );
+    overflow_depth = 0;
+    dropped_calls.store( 0, std::memory_order_relaxed );
+    child_index_count = 0;
+    // the toplevel section
+    current = AddSection( 0, 0, NULL, 0 );
+}
 
 DProfileContext::~DProfileContext()
 {
-    if ( toplevel )
-        delete toplevel;
+    DProfileChunk* table = chunks.load();
+    for ( uint32_t i=0; i<chunk_count; i++ )
+    {
+        delete [] table[i].hot;
+        delete [] table[i].cold;
+        delete [] table[i].extras->stats.load();
+        delete [] table[i].extras->counters.load();
+        delete [] table[i].extras->allocs.load();
+        delete table[i].extras;
+    }
+    if ( table != &first_chunk )
+        delete [] table;
+    for ( size_t i=0; i<outgrown_chunks.size(); i++ )
+        delete [] outgrown_chunks[i];
+    delete trace.load();
+    delete perf;
+    delete frame_history;
+}
+
+void DProfileContext::AddChunk()
+{
+    uint32_t chunk = chunk_count.load( std::memory_order_relaxed );
+    bool internal = DProfiler::SetInternalAllocation( true );
+    if ( chunk == chunk_capacity )
+        GrowChunks( chunk_capacity*2 );
+    DProfileChunk& entry = chunks.load( std::memory_order_relaxed )[chunk];
+    entry.hot = new DProfileSection[CHUNK_SIZE];
+    entry.cold = new DProfileSectionInfo[CHUNK_SIZE];
+    entry.extras = new DProfileChunkExtras;
+    entry.extras->stats.store( NULL, std::memory_order_relaxed );
+    entry.extras->counters.store( NULL, std::memory_order_relaxed );
+    entry.extras->allocs.store( NULL, std::memory_order_relaxed );
+    chunk_count.store( chunk+1, std::memory_order_release );
+    if ( DProfiler::GetStatisticsEnabled() )
+        AllocateStats();
+    if ( DProfiler::GetCountersEnabled() )
+        AllocateCounters();
+    if ( DProfiler::GetAllocationTrackingEnabled() )
+        AllocateAllocTotals();
+    DProfiler::SetInternalAllocation( internal );
+}
+
+void DProfileContext::Reserve( uint32_t sections )
+{
+    uint32_t chunks = ( sections+CHUNK_SIZE-1 )>>CHUNK_BITS;
+    if ( chunks > MAX_CHUNKS )
+        chunks = MAX_CHUNKS;
+    if ( chunks > chunk_capacity )
+    {
+        bool internal = DProfiler::SetInternalAllocation( true );
+        GrowChunks( chunks );
+        DProfiler::SetInternalAllocation( internal );
+    }
+    while ( chunk_count.load( std::memory_order_relaxed ) < chunks )
+        AddChunk();
+
+    // room to index every section as the child of a wide parent, at a load
+    // of at most a half, so that IndexChild() never has to grow it
+    size_t slots = 64;
+    while ( slots < (size_t)chunks*CHUNK_SIZE*2 )
+        slots *= 2;
+    if ( slots > child_index.size() )
+    {
+        bool internal = DProfiler::SetInternalAllocation( true );
+        GrowChildIndex( slots );
+        DProfiler::SetInternalAllocation( internal );
+    }
+}
+
+void DProfileContext::GrowChunks( uint32_t capacity )
+{
+    if ( capacity > MAX_CHUNKS )
+        capacity = MAX_CHUNKS;
+    DProfileChunk* old = chunks.load( std::memory_order_relaxed );
+    DProfileChunk* table = new DProfileChunk[capacity];
+    uint32_t count = chunk_count.load( std::memory_order_relaxed );
+    for ( uint32_t i=0; i<count; i++ )
+        table[i] = old[i];
+    if ( old != &first_chunk )
+        outgrown_chunks.push_back( old );
+    chunks.store( table, std::memory_order_release );
+    chunk_capacity = capacity;
+}
+
+uint32_t DProfileContext::AddSection( uint32_t parent, int name_id, const DProfileSectionDescriptor* site, uint32_t children )
+{
+    // past the limit on children, new names all go to one "(other)" child
+    uint32_t max_children = DProfiler::GetMaxChildren();
+    int other_id = DProfiler::GetOtherNameId();
+    if ( max_children && children >= max_children && name_id != other_id )
+    {
+        for ( uint32_t i = Section(parent).first_child; i != 0; i = Section(i).next_sibling )
+        {
+            if ( Section(i).name_id == other_id )
+                return i;
+        }
+        name_id = other_id;
+        site = NULL;
+    }
+
+    uint32_t index = section_count.load( std::memory_order_relaxed );
+    uint32_t max_sections = DProfiler::GetMaxSections();
+    if ( index >= ( max_sections ? max_sections : MAX_CHUNKS*CHUNK_SIZE ) )
+    {
+        if ( !max_sections )
+        {
+            fprintf(stderr, "DProfileContext: out of sections (%u), profile data will be wrong\n", index );
+            assert(false);
+        }
+        return NO_SECTION;
+    }
+    if ( (index>>CHUNK_BITS) >= chunk_count )
+        AddChunk();
+
+    DProfileSection& section = Section(index);
+    section.BeginUpdate();
+    section.Init( parent, name_id );
+    Info(index).site = site;
+    Info(index).sample_mean = 0;
+    Info(index).sample_m2 = 0;
+    DProfileStats* stats = Stats(index);
+    if ( stats )
+        stats->Clear();
+    DProfileSectionCounters* counters = Counters(index);
+    if ( counters )
+        counters->Clear();
+    DProfileAllocTotals* allocs = AllocTotals(index);
+    if ( allocs )
+        allocs->Clear();
+    section.EndUpdate();
+
+    // link in as the last child of parent, so siblings stay in execution order
+    if ( index != 0 )
+    {
+        uint32_t siblings = 0;
+        uint32_t* link = &Section(parent).first_child;
+        while ( *link != 0 )
+        {
+            link = &Section(*link).next_sibling;
+            siblings++;
+        }
+        *link = index;
+        // a parent that has just become wide has all its children indexed
+        if ( siblings == WIDE_CHILDREN )
+        {
+            for ( uint32_t i = Section(parent).first_child; i != 0; i = Section(i).next_sibling )
+                IndexChild( parent, Section(i).name_id, i );
+        }
+        else if ( siblings > WIDE_CHILDREN )
+            IndexChild( parent, name_id, index );
+    }
+
+    // only now can Snapshot() see it
+    section_count.store( index+1, std::memory_order_release );
+
+    return index;
+}
+
+// the slot for (parent, name_id) in a child index of the given size (a power of two)
+static inline uint32_t ChildSlot( uint32_t parent, int name_id, size_t size )
+{
+    uint64_t key = ( (uint64_t)parent << 32 ) | (uint32_t)name_id;
+    return (uint32_t)( ( key * 0x9e3779b97f4a7c15ull ) >> 32 ) & (uint32_t)( size-1 );
+}
+
+uint32_t DProfileContext::GetWideChild( uint32_t parent, int name_id, const DProfileSectionDescriptor* site )
+{
+    size_t size = child_index.size();
+    for ( uint32_t slot = ChildSlot( parent, name_id, size ); child_index[slot].child != 0; slot = ( slot+1 )&( size-1 ) )
+    {
+        if ( child_index[slot].parent == parent && child_index[slot].name_id == name_id )
+            return child_index[slot].child;
+    }
+
+    // a new child, which is rare enough that counting the others is fine
+    uint32_t children = 0;
+    for ( uint32_t i = Section(parent).first_child; i != 0; i = Section(i).next_sibling )
+        children++;
+    return AddSection( parent, name_id, site, children );
+}
+
+void DProfileContext::GrowChildIndex( size_t slots )
+{
+    std::vector<DChildSlot> old;
+    old.swap( child_index );
+    DChildSlot empty = { 0, 0, 0 };
+    child_index.assign( slots, empty );
+    child_index_count = 0;
+    for ( size_t i=0; i<old.size(); i++ )
+    {
+        if ( old[i].child != 0 )
+            IndexChild( old[i].parent, old[i].name_id, old[i].child );
+    }
+}
+
+void DProfileContext::IndexChild( uint32_t parent, int name_id, uint32_t child )
+{
+    // keep the load under a half
+    if ( ( child_index_count+1 )*2 > child_index.size() )
+    {
+        bool internal = DProfiler::SetInternalAllocation( true );
+        GrowChildIndex( child_index.empty() ? 64 : child_index.size()*2 );
+        DProfiler::SetInternalAllocation( internal );
+    }
+
+    size_t size = child_index.size();
+    uint32_t slot = ChildSlot( parent, name_id, size );
+    while ( child_index[slot].child != 0 )
+        slot = ( slot+1 )&( size-1 );
+    child_index[slot].parent = parent;
+    child_index[slot].name_id = name_id;
+    child_index[slot].child = child;
+    child_index_count++;
+}
+
+void DProfileContext::AllocateStats()
+{
+    uint32_t count = chunk_count.load( std::memory_order_acquire );
+    for ( uint32_t i=0; i<count; i++ )
+    {
+        DProfileChunkExtras* extras = chunks.load( std::memory_order_acquire )[i].extras;
+        if ( extras->stats.load( std::memory_order_acquire ) )
+            continue;
+        DProfileStats* chunk = new DProfileStats[CHUNK_SIZE];
+        for ( uint32_t j=0; j<CHUNK_SIZE; j++ )
+            chunk[j].Clear();
+        // the owning thread may be racing us to allocate its newest chunk
+        DProfileStats* expected = NULL;
+        if ( !extras->stats.compare_exchange_strong( expected, chunk, std::memory_order_acq_rel ) )
+            delete [] chunk;
+    }
+}
+
+void DProfileContext::AllocateCounters()
+{
+    uint32_t count = chunk_count.load( std::memory_order_acquire );
+    for ( uint32_t i=0; i<count; i++ )
+    {
+        DProfileChunkExtras* extras = chunks.load( std::memory_order_acquire )[i].extras;
+        if ( extras->counters.load( std::memory_order_acquire ) )
+            continue;
+        DProfileSectionCounters* chunk = new DProfileSectionCounters[CHUNK_SIZE];
+        for ( uint32_t j=0; j<CHUNK_SIZE; j++ )
+            chunk[j].Clear();
+        DProfileSectionCounters* expected = NULL;
+        if ( !extras->counters.compare_exchange_strong( expected, chunk, std::memory_order_acq_rel ) )
+            delete [] chunk;
+    }
+}
+
+void DProfileContext::AllocateAllocTotals()
+{
+    uint32_t count = chunk_count.load( std::memory_order_acquire );
+    for ( uint32_t i=0; i<count; i++ )
+    {
+        DProfileChunkExtras* extras = chunks.load( std::memory_order_acquire )[i].extras;
+        if ( extras->allocs.load( std::memory_order_acquire ) )
+            continue;
+        DProfileAllocTotals* chunk = new DProfileAllocTotals[CHUNK_SIZE];
+        for ( uint32_t j=0; j<CHUNK_SIZE; j++ )
+            chunk[j].Clear();
+        DProfileAllocTotals* expected = NULL;
+        if ( !extras->allocs.compare_exchange_strong( expected, chunk, std::memory_order_acq_rel ) )
+            delete [] chunk;
+    }
+}
+
+double DProfileSectionInfo::GetSampledTotalError( uint64_t call_count, uint64_t timed_count ) const
+{
+    if ( timed_count == call_count || timed_count < 2 )
+        return 0;
+    // standard error of the mean, with finite population correction, scaled up to the total
+    double n = (double)timed_count;
+    double N = (double)call_count;
+    double variance = sample_m2 / ( n - 1 );
+    return N * sqrt( variance / n * ( 1.0 - n/N ) );
+}
+
+void DProfileContext::Reset()
+{
+    section_count.store( 0, std::memory_order_relaxed );
+    DChildSlot empty = { 0, 0, 0 };
+    std::fill( child_index.begin(), child_index.end(), empty );
+    child_index_count = 0;
+    current = AddSection( 0, 0, NULL, 0 );
+    overflow_depth = 0;
+    dropped_calls.store( 0, std::memory_order_relaxed );
+    for ( int i=0; i<MAX_CPUS/64; i++ )
+        cpus_seen[i].store( 0, std::memory_order_relaxed );
+    last_cpu.store( -1, std::memory_order_relaxed );
+}
+
+void DProfileContext::RecordCPU()
+{
+    cpu_countdown = CPU_SAMPLE_INTERVAL;
+    int cpu = DThread::GetCurrentCPU();
+    if ( cpu < 0 )
+        return;
+    last_cpu.store( cpu, std::memory_order_relaxed );
+    if ( cpu >= MAX_CPUS )
+        return;
+    // only the owning thread writes
+    uint64_t bit = 1ull << ( cpu&63 );
+    uint64_t seen = cpus_seen[cpu>>6].load( std::memory_order_relaxed );
+    if ( !( seen & bit ) )
+        cpus_seen[cpu>>6].store( seen | bit, std::memory_order_relaxed );
+}
+
+void DProfileContext::GetCPUs( std::vector<int>& out, int& last ) const
+{
+    out.clear();
+    for ( int i=0; i<MAX_CPUS/64; i++ )
+    {
+        uint64_t seen = cpus_seen[i].load( std::memory_order_relaxed );
+        for ( int j=0; seen; j++, seen >>= 1 )
+        {
+            if ( seen & 1 )
+                out.push_back( i*64+j );
+        }
+    }
+    last = last_cpu.load( std::memory_order_relaxed );
+}
+
+void DProfileContext::CopySection( uint32_t index, DProfileSectionSnapshot& out, DProfileStats* stats_out,
+                                   DProfileCounterTotals* counters_out, DProfileAllocTotals* allocs_out )
+{
+    uint32_t count = GetSectionCount();
+    DProfileSection& s = Section( index );
+    DProfileSectionInfo info;
+    DProfileStats* stats = stats_out ? Stats( index ) : NULL;
+    DProfileSectionCounters* counters = counters_out ? Counters( index ) : NULL;
+    DProfileAllocTotals* allocs = allocs_out ? AllocTotals( index ) : NULL;
+    for ( int attempt=0; ; attempt++ )
+    {
+        uint32_t seq = s.seq.load( std::memory_order_acquire );
+        if ( seq & 1 )
+        {
+            // the owner is mid-update; if it was preempted there, let it run
+            if ( attempt > 100 )
+                sched_yield();
+            continue;
+        }
+        out.call_count = s.call_count;
+        out.total_ticks = s.total_ticks;
+        out.timed_count = s.timed_count;
+        out.parent = s.parent;
+        out.first_child = s.first_child;
+        out.next_sibling = s.next_sibling;
+        out.name_id = s.name_id;
+        out.sample_rate = s.sample_rate;
+        info = Info( index );
+        if ( stats )
+            *stats_out = *stats;
+        if ( counters )
+            *counters_out = counters->totals;
+        if ( allocs )
+            *allocs_out = *allocs;
+        std::atomic_thread_fence( std::memory_order_acquire );
+        if ( s.seq.load( std::memory_order_relaxed ) == seq )
+            break;
+    }
+    if ( stats_out && !stats )
+        stats_out->Clear();
+    if ( counters_out && !counters )
+        counters_out->Clear();
+    if ( allocs_out && !allocs )
+        allocs_out->Clear();
+    // drop links to sections created after count was read
+    if ( out.first_child >= count )
+        out.first_child = 0;
+    if ( out.next_sibling >= count )
+        out.next_sibling = 0;
+    out.sampled_total_error = info.GetSampledTotalError( out.call_count, out.timed_count );
+    out.self_ticks = 0;
+    out.overhead_ticks = 0;
+    out.reported_ticks = out.GetTotalTicks();
+}
+
+void DProfileContext::Snapshot( DProfileThreadSnapshot& out )
+{
+    GetCPUs( out.cpus, out.last_cpu );
+    out.dropped_calls = dropped_calls.load( std::memory_order_relaxed );
+    uint32_t count = GetSectionCount();
+    bool with_stats = DProfiler::GetStatisticsEnabled();
+    bool with_counters = DProfiler::GetCountersEnabled();
+    bool with_allocs = DProfiler::GetAllocationTrackingEnabled();
+    out.sections.resize( count );
+    out.stats.resize( with_stats ? count : 0 );
+    out.counters.resize( with_counters ? count : 0 );
+    out.allocs.resize( with_allocs ? count : 0 );
+    for ( uint32_t i=0; i<count; i++ )
+    {
+        CopySection( i, out.sections[i], with_stats ? &out.stats[i] : NULL,
+                     with_counters ? &out.counters[i] : NULL, with_allocs ? &out.allocs[i] : NULL );
+        // links must stay inside the copy, even if more sections were added meanwhile
+        if ( out.sections[i].first_child >= count )
+            out.sections[i].first_child = 0;
+        if ( out.sections[i].next_sibling >= count )
+            out.sections[i].next_sibling = 0;
+    }
 }
 
-DProfileContext* DProfiler::GetContext()
+DProfileContext* DProfiler::UpdateContext()
 {
-	DThreadContext thread_context;
-	lock.Wait();
-	// try to get current thread context
-	for ( DProfileContexts::const_iterator i = contexts.begin();
-		  i!= contexts.end();
-		  ++i )
+	DProfileContext* context = thread_context;
+	if ( context )
 	{
-		if ( thread_context == ( *i )->thread_context )
+		// only this thread writes its context, so it can reset it itself if
+		// Clear() has been called since it was last reset
+		unsigned g = generation.load( std::memory_order_acquire );
+		if ( context->generation.load( std::memory_order_relaxed ) != g )
 		{
-			lock.Signal();
-			return *i;
+			context->Reset();
+			context->generation.store( g, std::memory_order_release );
 		}
+		return context;
 	}
 
-	// no context found for this thread: must create a new one
-	DProfileContext* context = new DProfileContext();
+	return RegisterContext();
+}
+
+DProfileContext* DProfiler::RegisterContext()
+{
+	pthread_once( &thread_key_once, CreateThreadKey );
+	int node;
+	DThread::GetCurrentCPU( &node );
+
+	lock.Lock();
+
+	// no context found for this thread: reuse one left by a thread that has
+	// exited (on this NUMA node, so its memory is local), or create a new one
+	DProfileContext* context = NULL;
+	for ( size_t i=free_contexts.size(); i > 0 && !context; i-- )
+	{
+		if ( free_contexts[i-1]->numa_node == node )
+		{
+			context = free_contexts[i-1];
+			free_contexts.erase( free_contexts.begin()+(i-1) );
+			// a reader may have copied the context, and the incarnation
+			// RetireContext() bumped, before it left contexts: bump it again
+			// before the new thread's tree overwrites the old one
+			context->incarnation.fetch_add( 1, std::memory_order_relaxed );
+			std::atomic_thread_fence( std::memory_order_release );
+			context->Reset();
+			context->name.clear();
+		}
+	}
+	if ( !context )
+		context = new DProfileContext();
+	if ( max_sections )
+		context->Reserve( max_sections );
+	// a reused context's chunks may predate whatever has been enabled since
+	if ( GetStatisticsEnabled() )
+		context->AllocateStats();
+	if ( GetCountersEnabled() )
+		context->AllocateCounters();
+	if ( GetAllocationTrackingEnabled() )
+		context->AllocateAllocTotals();
 	// add it to the vector
 	contexts.push_back( context );
 	// fill in details
 	context->thread_context.Set();
-	context->toplevel = new DProfileSection();
-	context->current = context->toplevel;
+	context->thread_index = next_thread_index++;
+	context->generation.store( generation.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+	if ( GetTracingEnabled() )
+		AllocateTrace( context );
+
+	// cache it for this thread, and have OnThreadExit() called when it exits
+	thread_context = context;
+	pthread_setspecific( thread_key, context );
+	context->RecordCPU();
 
 	// return
-	lock.Signal();
+	lock.Unlock();
 	return context;
 }
 
+void DProfiler::CreateThreadKey()
+{
+	pthread_key_create( &thread_key, OnThreadExit );
+}
+
+void DProfiler::OnThreadExit( void* context )
+{
+	RetireContext( (DProfileContext*)context );
+}
+
+void DProfiler::RetireContext( DProfileContext* context )
+{
+	uint64_t incarnation = context->incarnation.load( std::memory_order_relaxed );
+	// only this thread writes the context, so its copy is exact
+	unsigned g = generation.load( std::memory_order_acquire );
+	bool has_data = context->generation.load( std::memory_order_relaxed ) == g;
+	DProfileThreadSnapshot final;
+	if ( has_data )
+		context->Snapshot( final );
+
+	// the next thread to use this context starts a fresh frame history
+	frames_lock.Lock();
+	if ( context->frame_history )
+		context->frame_history->generation = 0;
+	frames_lock.Unlock();
+
+	retired_lock.Lock();
+	// readers that copied this context before now must discard their copy:
+	// its data is about to be in retired
+	context->incarnation.fetch_add( 1, std::memory_order_release );
+	if ( has_data && final.sections.size() > 1 && generation.load( std::memory_order_relaxed ) == g )
+	{
+		if ( !retired_merger )
+		{
+			retired_merger = new DProfileTreeMerger( retired );
+			retired.name = "Retired threads";
+		}
+		retired_merger->Add( final );
+	}
+	retired_lock.Unlock();
+
+	// the counters count this thread, so they're no use to the next one
+	delete context->perf;
+	context->perf = NULL;
+
+	lock.Lock();
+	DProfileContexts::iterator it = std::find( contexts.begin(), contexts.end(), context );
+	if ( it != contexts.end() )
+		contexts.erase( it );
+	// the ring's events are this thread's: hand them to the next drain, and
+	// let the next thread to use the context start a ring of its own
+	DTraceBuffer* trace = context->trace.load( std::memory_order_relaxed );
+	if ( trace )
+	{
+		DRetiredTrace retired_trace;
+		retired_trace.thread.thread_index = context->thread_index;
+		retired_trace.thread.incarnation = incarnation;
+		retired_trace.thread.name = context->name;
+		retired_trace.trace = trace;
+		retired_traces.push_back( retired_trace );
+		context->trace.store( NULL, std::memory_order_relaxed );
+	}
+	free_contexts.push_back( context );
+	lock.Unlock();
+
+	if ( thread_context == context )
+		thread_context = NULL;
+}
+
+void DProfiler::RegisterThread( const std::string& name )
+{
+	DProfileContext* context = GetContext();
+	lock.Lock();
+	context->name = name;
+	lock.Unlock();
+}
+
+void DProfiler::UnregisterThread()
+{
+	DProfileContext* context = thread_context;
+	if ( !context )
+		return;
+	pthread_setspecific( thread_key, NULL );
+	RetireContext( context );
+}
+
+std::string DProfiler::GetThreadName( const DProfileContext* context )
+{
+	lock.Lock();
+	std::string result = context->name;
+	lock.Unlock();
+	return result;
+}
+
+
+
+void DProfiler::GetContexts( std::vector<DProfileContext*>& out )
+{
+	lock.Lock();
+	out = contexts;
+	lock.Unlock();
+}
+
+void DProfiler::TakeSnapshot( DProfileSnapshot& out )
+{
+	out.ticks = DTime::GetTicks();
+
+	// threads that have exited. copied before the live contexts, so that a
+	// thread retiring in between is caught by its incarnation changing
+	// rather than counted twice.
+	DProfileThreadSnapshot retired_copy;
+	retired_lock.Lock();
+	bool have_retired = ( retired_merger != NULL );
+	if ( have_retired )
+		retired_copy = retired;
+	retired_lock.Unlock();
+
+	// contexts are never deleted, so the list can be walked off-lock once copied
+	lock.Lock();
+	DProfileContexts to_copy = contexts;
+	std::vector<uint64_t> incarnations( to_copy.size() );
+	std::vector<std::string> names( to_copy.size() );
+	for ( size_t i=0; i<to_copy.size(); i++ )
+	{
+		incarnations[i] = to_copy[i]->incarnation.load( std::memory_order_acquire );
+		names[i] = to_copy[i]->name;
+	}
+	lock.Unlock();
+
+	// reuse out's storage where possible, for callers taking regular snapshots
+	size_t count = 0;
+	for ( size_t i=0; i<to_copy.size(); i++ )
+	{
+		DProfileContext* context = to_copy[i];
+		unsigned g = generation.load( std::memory_order_acquire );
+		// not reset since the last Clear(): nothing to show
+		if ( context->generation.load( std::memory_order_acquire ) != g )
+			continue;
+		if ( out.threads.size() <= count )
+			out.threads.resize( count+1 );
+		DProfileThreadSnapshot& thread = out.threads[count];
+		thread.context = context;
+		thread.thread_index = context->thread_index;
+		thread.merged_count = 1;
+		thread.name = names[i];
+		context->Snapshot( thread );
+		thread.frames.clear();
+		if ( frame_history_size )
+		{
+			frames_lock.Lock();
+			DProfileFrameHistory* history = context->frame_history;
+			if ( history && history->generation == g )
+			{
+				thread.frames.resize( thread.sections.size() );
+				for ( uint32_t j=0; j<thread.sections.size(); j++ )
+					SummarizeFrames( history, j, thread.frames[j] );
+			}
+			frames_lock.Unlock();
+		}
+		// a Clear() during the copy means the owner may have been resetting
+		// the tree under us, and a new incarnation means it exited and the
+		// context went to another thread: discard it
+		std::atomic_thread_fence( std::memory_order_acquire );
+		if ( generation.load( std::memory_order_relaxed ) != g
+			|| context->incarnation.load( std::memory_order_relaxed ) != incarnations[i] )
+			continue;
+		count++;
+	}
+	if ( have_retired )
+	{
+		if ( out.threads.size() <= count )
+			out.threads.resize( count+1 );
+		std::swap( out.threads[count], retired_copy );
+		count++;
+	}
+	out.threads.resize( count );
+	out.semaphores.clear();
+	DSemaphore::GetAllStats( out.semaphores );
+	lock.Lock();
+	out.overhead = overhead;
+	lock.Unlock();
+	out.subtract_overhead = GetOverheadCorrectionEnabled() && out.overhead.IsCalibrated();
+	out.BuildIndex();
+}
+
+DProfileSectionHandle DProfiler::FindSection( const std::string& path, int thread_index )
+{
+	DProfileSectionHandle handle;
+	DProfileContext* context = NULL;
+	uint64_t incarnation = 0;
+	if ( thread_index == -1 )
+	{
+		context = GetContext();
+		incarnation = context->incarnation.load( std::memory_order_relaxed );
+	}
+	else
+	{
+		lock.Lock();
+		for ( size_t i=0; i<contexts.size(); i++ )
+		{
+			if ( contexts[i]->thread_index == thread_index )
+			{
+				context = contexts[i];
+				incarnation = context->incarnation.load( std::memory_order_acquire );
+			}
+		}
+		lock.Unlock();
+	}
+	if ( !context )
+		return handle;
+	unsigned g = generation.load( std::memory_order_acquire );
+	if ( context->generation.load( std::memory_order_acquire ) != g )
+		return handle;
+
+	// walk down the live tree one path component at a time. names that were
+	// never interned can't be in the tree.
+	uint32_t count = context->GetSectionCount();
+	uint32_t index = 0;
+	size_t start = 0;
+	while ( start <= path.size() )
+	{
+		size_t end = path.find( '/', start );
+		if ( end == std::string::npos )
+			end = path.size();
+		names_lock.Lock();
+		DNameIds::iterator it = name_ids.find( path.substr( start, end-start ) );
+		int name_id = ( it == name_ids.end() ) ? 0 : it->second;
+		names_lock.Unlock();
+		if ( name_id == 0 )
+			return handle;
+
+		uint32_t child = context->Section( index ).first_child;
+		while ( child != 0 && child < count && context->Section( child ).name_id != name_id )
+			child = context->Section( child ).next_sibling;
+		if ( child == 0 || child >= count )
+			return handle;
+		index = child;
+		start = end+1;
+	}
+
+	// a Clear() or the thread exiting while we walked invalidates what we found
+	std::atomic_thread_fence( std::memory_order_acquire );
+	if ( generation.load( std::memory_order_relaxed ) != g
+		|| context->incarnation.load( std::memory_order_relaxed ) != incarnation )
+		return handle;
+	handle.context = context;
+	handle.index = index;
+	handle.generation = g;
+	handle.incarnation = incarnation;
+	return handle;
+}
+
+bool DProfiler::ReadSection( const DProfileSectionHandle& handle, DProfileSectionSnapshot& out )
+{
+	if ( !handle.context || generation.load( std::memory_order_acquire ) != handle.generation
+		|| handle.context->incarnation.load( std::memory_order_acquire ) != handle.incarnation
+		|| handle.context->generation.load( std::memory_order_acquire ) != handle.generation )
+		return false;
+
+	handle.context->CopySection( handle.index, out, NULL );
+	int64_t self = out.GetTotalTicks();
+	DProfileSectionSnapshot child;
+	for ( uint32_t i = out.first_child; i != 0; i = child.next_sibling )
+	{
+		handle.context->CopySection( i, child, NULL );
+		self -= child.GetTotalTicks();
+	}
+	out.self_ticks = self > 0 ? self : 0;
+	out.overhead_ticks = 0;
+	out.reported_ticks = out.GetTotalTicks();
+
+	std::atomic_thread_fence( std::memory_order_acquire );
+	return generation.load( std::memory_order_relaxed ) == handle.generation
+		&& handle.context->incarnation.load( std::memory_order_relaxed ) == handle.incarnation;
+}
+
+void DProfiler::EnableFrameHistory( uint32_t frames )
+{
+	frames_lock.Lock();
+	lock.Lock();
+	for ( size_t i=0; i<contexts.size(); i++ )
+	{
+		delete contexts[i]->frame_history;
+		contexts[i]->frame_history = NULL;
+	}
+	frame_history_size = frames;
+	lock.Unlock();
+	frames_lock.Unlock();
+}
+
+void DProfiler::FrameBoundary()
+{
+	if ( GetTracingEnabled() )
+	{
+		static int frame_name_id = InternName( "frame" );
+		RecordTraceEvent( DTraceEvent::FRAME, frame_name_id, DTime::GetTicks() );
+	}
+
+	frames_lock.Lock();
+	uint64_t frame = frame_count.load( std::memory_order_relaxed );
+	if ( frame_history_size )
+	{
+		lock.Lock();
+		DProfileContexts to_record = contexts;
+		lock.Unlock();
+
+		DProfileSectionSnapshot section;
+		for ( size_t i=0; i<to_record.size(); i++ )
+		{
+			DProfileContext* context = to_record[i];
+			unsigned g = generation.load( std::memory_order_acquire );
+			// not reset since the last Clear(): its history is reset once it is
+			if ( context->generation.load( std::memory_order_acquire ) != g )
+				continue;
+			DProfileFrameHistory* history = context->frame_history;
+			if ( !history )
+				history = context->frame_history = new DProfileFrameHistory( frame_history_size );
+			if ( history->generation != g )
+				history->Reset( g, frame );
+
+			uint32_t count = context->GetSectionCount();
+			history->Grow( count );
+			for ( uint32_t j=0; j<count; j++ )
+			{
+				context->CopySection( j, section, NULL );
+				DProfileFrameSample now = { section.call_count, section.GetTotalTicks() };
+				DProfileFrameSample& last = history->last[j];
+				DProfileFrameSample& sample = history->Sample( j, frame );
+				// the counters only go backwards if the context was reset under us
+				sample.call_count = now.call_count >= last.call_count ? now.call_count - last.call_count : now.call_count;
+				sample.ticks = now.ticks >= last.ticks ? now.ticks - last.ticks : now.ticks;
+				last = now;
+			}
+
+			// a Clear() while we were copying: start again next frame
+			std::atomic_thread_fence( std::memory_order_acquire );
+			if ( generation.load( std::memory_order_relaxed ) != g )
+				history->generation = 0;
+		}
+	}
+	frame_count.store( frame+1, std::memory_order_relaxed );
+	frames_lock.Unlock();
+}
+
+void DProfiler::SummarizeFrames( DProfileFrameHistory* history, uint32_t index, DProfileFrameSummary& out )
+{
+	memset( &out, 0, sizeof(out) );
+	uint64_t end = frame_count.load( std::memory_order_relaxed );
+	uint64_t begin = history->first_frame;
+	if ( end - begin > history->frames )
+		begin = end - history->frames;
+	// sections created after the last boundary have no history yet
+	if ( index >= history->GetSectionCount() || end == begin )
+		return;
+
+	out.frames = end - begin;
+	uint64_t total = 0, min = UINT64_MAX, max = 0;
+	for ( uint64_t f=begin; f<end; f++ )
+	{
+		uint64_t ticks = history->Sample( index, f ).ticks;
+		total += ticks;
+		if ( ticks < min )
+			min = ticks;
+		if ( ticks > max )
+			max = ticks;
+	}
+	const DProfileFrameSample& last = history->Sample( index, end-1 );
+	out.last_millis = DTime::TicksToMillis( last.ticks );
+	out.last_calls = last.call_count;
+	out.average_millis = DTime::TicksToMillis( total ) / (double)out.frames;
+	out.min_millis = DTime::TicksToMillis( min );
+	out.max_millis = DTime::TicksToMillis( max );
+}
 
+bool DProfiler::GetSectionFrames( const DProfileSectionHandle& handle, DProfileFrameSummary& summary, std::vector<DProfileFrameSample>* samples )
+{
+	memset( &summary, 0, sizeof(summary) );
+	if ( samples )
+		samples->clear();
+	if ( !handle.context )
+		return false;
+	frames_lock.Lock();
+	DProfileFrameHistory* history = handle.context->frame_history;
+	bool valid = history && history->generation == handle.generation
+		&& generation.load( std::memory_order_acquire ) == handle.generation
+		&& handle.context->incarnation.load( std::memory_order_acquire ) == handle.incarnation;
+	if ( valid )
+	{
+		SummarizeFrames( history, handle.index, summary );
+		if ( samples )
+		{
+			uint64_t end = frame_count.load( std::memory_order_relaxed );
+			for ( uint64_t f=end-summary.frames; f<end; f++ )
+				samples->push_back( history->Sample( handle.index, f ) );
+		}
+	}
+	frames_lock.Unlock();
+	return valid;
+}
 
 void DProfiler::Clear()
 {
     // get lock
-    lock.Wait();
-    // delete everything
-    for ( int i=0; i<contexts.size(); i++ )
+    lock.Lock();
+    // every thread resets its own context on its next push/pop; until then
+    // Display() skips it
+    generation.fetch_add( 1, std::memory_order_release );
+
+    // done
+    lock.Unlock();
+
+    retired_lock.Lock();
+    delete retired_merger;
+    retired_merger = NULL;
+    retired = DProfileThreadSnapshot();
+    retired_lock.Unlock();
+
+    DSemaphore::ResetAllStats();
+
+}
+
+void DProfiler::SetCategorySampleRate( uint32_t category, uint32_t rate )
+{
+    if ( rate == 0 )
+        rate = 1;
+    for ( int i=0; i<32; i++ )
     {
-        delete contexts[i];
+        if ( category & (1u<<i) )
+            category_sample_rates[i].store( rate, std::memory_order_relaxed );
     }
-    contexts.clear();
+}
 
-    // done
-    lock.Signal();
+void DProfiler::EnableStatistics( bool enable )
+{
+    lock.Lock();
+    statistics_enabled.store( enable, std::memory_order_relaxed );
+    if ( enable )
+    {
+        for ( size_t i=0; i<contexts.size(); i++ )
+            contexts[i]->AllocateStats();
+    }
+    lock.Unlock();
+}
+
+bool DProfiler::EnableCounters( bool enable )
+{
+    if ( enable )
+    {
+        // see whether they can be opened at all before every thread tries
+        DPerfCounters test;
+        if ( !test.Open() )
+        {
+            fprintf(stderr, "DProfiler: hardware performance counters are not available\n" );
+            return false;
+        }
+    }
+    lock.Lock();
+    counters_enabled.store( enable, std::memory_order_relaxed );
+    if ( enable )
+    {
+        for ( size_t i=0; i<contexts.size(); i++ )
+            contexts[i]->AllocateCounters();
+    }
+    lock.Unlock();
+    return true;
+}
+
+void DProfiler::EnableAllocationTracking( bool enable )
+{
+    lock.Lock();
+    allocation_tracking_enabled.store( enable, std::memory_order_relaxed );
+    if ( enable )
+    {
+        for ( size_t i=0; i<contexts.size(); i++ )
+            contexts[i]->AllocateAllocTotals();
+    }
+    lock.Unlock();
+}
+
+void DProfiler::AllocateTrace( DProfileContext* context )
+{
+    if ( context->trace.load( std::memory_order_relaxed ) == NULL )
+        context->trace.store( new DTraceBuffer( trace_capacity, trace_policy ), std::memory_order_release );
+}
+
+void DProfiler::EnableTracing( bool enable, TRACE_POLICY policy, uint32_t capacity )
+{
+    lock.Lock();
+    trace_policy = policy;
+    trace_capacity = capacity;
+    if ( enable )
+    {
+        for ( size_t i=0; i<contexts.size(); i++ )
+            AllocateTrace( contexts[i] );
+    }
+    tracing_enabled.store( enable, std::memory_order_release );
+    lock.Unlock();
+}
+
+void DProfiler::RecordTraceEvent( DTraceEvent::TYPE type, uint32_t id, uint64_t ticks )
+{
+    if ( !GetTracingEnabled() )
+        return;
+    DTraceBuffer* trace = GetContext()->trace.load( std::memory_order_acquire );
+    if ( trace )
+        trace->Write( type, id, ticks );
+}
+
+void DProfiler::DrainTrace( DTraceSink* sink )
+{
+    // pair each ring with its thread under lock: RetireContext() detaches
+    // a ring under lock too, so a ring never changes threads once paired.
+    // only this function deletes rings, so they can be read off-lock.
+    lock.Lock();
+    std::vector<DRetiredTrace> to_drain;
+    for ( size_t i=0; i<contexts.size(); i++ )
+    {
+        DRetiredTrace live;
+        live.trace = contexts[i]->trace.load( std::memory_order_acquire );
+        if ( !live.trace )
+            continue;
+        live.thread.thread_index = contexts[i]->thread_index;
+        live.thread.incarnation = contexts[i]->incarnation.load( std::memory_order_relaxed );
+        live.thread.name = contexts[i]->name;
+        to_drain.push_back( live );
+    }
+    size_t live_count = to_drain.size();
+    to_drain.insert( to_drain.end(), retired_traces.begin(), retired_traces.end() );
+    retired_traces.clear();
+    lock.Unlock();
+
+    static const size_t BATCH = 4096;
+    static DTraceEvent batch[BATCH];
+    for ( size_t i=0; i<to_drain.size(); i++ )
+    {
+        size_t count;
+        while ( (count = to_drain[i].trace->Read( batch, BATCH )) > 0 )
+            sink->OnEvents( to_drain[i].thread, batch, count );
+        if ( i < live_count )
+            continue;
+        // a retired thread's ring is empty for good once read to the end;
+        // should anything be left, it waits for the next drain
+        if ( to_drain[i].trace->IsEmpty() )
+            delete to_drain[i].trace;
+        else
+        {
+            lock.Lock();
+            retired_traces.push_back( to_drain[i] );
+            lock.Unlock();
+        }
+    }
+    sink->OnDrained();
+}
+
+int DProfileSectionDescriptor::Intern()
+{
+	int i = DProfiler::InternName( label );
+	id.store( i, std::memory_order_relaxed );
+	return i;
+}
+
+int DProfiler::InternName( const std::string& name )
+{
+	bool internal = SetInternalAllocation( true );
+	names_lock.Lock();
+	int& id = name_ids[name];
+	if ( id == 0 )
+	{
+		names.push_back( name );
+		id = names.size();
+	}
+	int result = id;
+	names_lock.Unlock();
+	SetInternalAllocation( internal );
+	return result;
+}
 
+int DProfiler::InternLabel( const std::string& name )
+{
+	bool internal = SetInternalAllocation( true );
+	names_lock.Lock();
+	int result;
+	DNameIds::iterator it = name_ids.find( name );
+	if ( it != name_ids.end() )
+		result = it->second;
+	else if ( max_names && names.size() >= max_names )
+		result = other_name_id;
+	else
+	{
+		names.push_back( name );
+		result = names.size();
+		name_ids[name] = result;
+	}
+	names_lock.Unlock();
+	SetInternalAllocation( internal );
+	return result;
+}
+
+void DProfiler::SetLimits( uint32_t sections, uint32_t children, uint32_t names )
+{
+	const uint32_t most = DProfileContext::MAX_CHUNKS*DProfileContext::CHUNK_SIZE;
+	// room for at least the toplevel section and the two Calibrate() times
+	if ( sections && sections < 3 )
+		sections = 3;
+	if ( sections > most )
+		sections = most;
+	// interned before the limit on names applies, so it always fits
+	other_name_id = InternName( "(other)" );
+	lock.Lock();
+	max_sections = sections;
+	max_children = children;
+	max_names = names;
+	lock.Unlock();
+}
+
+std::string DProfiler::GetName( int name_id )
+{
+	names_lock.Lock();
+	std::string result;
+	if ( name_id > 0 && name_id <= (int)names.size() )
+		result = names[name_id-1];
+	names_lock.Unlock();
+	return result;
+}
+
+int DProfiler::GetNameCount()
+{
+	names_lock.Lock();
+	int result = names.size();
+	names_lock.Unlock();
+	return result;
 }
 
 void DProfiler::SectionPush(const std::string &name)
 {
 	DProfileContext* context = GetContext();
-	assert( context->current );
 
-	// try to grab the section out of the db
-	// we store by name so that we can accumulate results over multiple frames
-	DProfileSection* s = context->current->children[name];
-	if ( s == NULL )
+	// look up the id in this thread's cache before going to the global table
+	int id;
+	DProfileContext::DNameIds::iterator it = context->name_ids.find( name );
+	if ( it != context->name_ids.end() )
+		id = it->second;
+	else
+	{
+		id = InternLabel( name );
+		// a full cache just means going to the global table every time
+		bool internal = SetInternalAllocation( true );
+		if ( !max_names || context->name_ids.size() < max_names )
+			context->name_ids[name] = id;
+		SetInternalAllocation( internal );
+	}
+
+	SectionPush( id );
+}
+
+void DProfiler::SectionPushSlow( DProfileContext* context, uint32_t index, const DProfileSectionDescriptor* site )
+{
+	if ( index == DProfileContext::NO_SECTION )
 	{
-		s = new DProfileSection();
-		s->parent = context->current;
-		s->name = name;
-		context->current->children[name] = s;
+		// full (see SetLimits()): drop it, and let its pop know
+		context->overflow_depth++;
+		context->dropped_calls.store( context->dropped_calls.load( std::memory_order_relaxed )+1, std::memory_order_relaxed );
+		return;
 	}
 
 	// shift current to us
-	context->current = s;
+	context->current = index;
+	DProfileSection& s = context->Section( index );
+
+	// sampled sites only read the clock once every sample_rate calls
+	uint32_t rate = site ? GetSampleRate( *site ) : 1;
+	if ( rate > 1 || s.sample_rate > 1 )
+	{
+		s.sample_rate = rate;
+		// a countdown left from a higher rate (or another sampling mode)
+		// mustn't keep skipping calls: cut it to the longest interval the
+		// current rate can give, so a rate of 1 times the very next call
+		uint32_t longest = sampling_mode == SAMPLE_RANDOM ? 2*rate - 1 : rate;
+		if ( s.sample_countdown > longest )
+			s.sample_countdown = longest;
+		if ( s.sample_countdown > 1 )
+		{
+			s.sample_countdown--;
+			s.start_ticks = 0;
+			return;
+		}
+		if ( sampling_mode == SAMPLE_RANDOM && rate > 1 )
+		{
+			// xorshift32, uniform in [1, 2*rate-1] so the mean interval is rate
+			uint32_t x = context->random_state;
+			x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+			context->random_state = x;
+			s.sample_countdown = 1 + x % ( 2*rate - 1 );
+		}
+		else
+			s.sample_countdown = rate;
+	}
 
 	// store start time
-	context->current->timer.SetNow();
-//	QueryPerformanceCounter(&s->start_time);
+	s.start_ticks = DTime::GetTicks();
+	if ( GetCountersEnabled() )
+		StartCounters( context, index );
 
+	if ( GetTracingEnabled() )
+	{
+		DTraceBuffer* trace = context->trace.load( std::memory_order_acquire );
+		if ( trace )
+			trace->Write( DTraceEvent::BEGIN, s.name_id, s.start_ticks );
+	}
 }
 
 
-void DProfiler::SectionPop()
+void DProfiler::SectionPopSlow( DProfileContext* context )
 {
-    end_time.SetNow();
-
-	// grab the section
-	DProfileContext* context = GetContext();
-	DProfileSection* s = context->current;
+	// the push was dropped
+	if ( context->overflow_depth )
+	{
+		context->overflow_depth--;
+		return;
+	}
 
     // check we're not popping up too far
-	if ( context->current->parent == NULL )
+	if ( context->current == 0 )
         return;
 
-	// get time for this run in ms
-/*	LARGE_INTEGER freq;
-	QueryPerformanceFrequency(&freq);
-	double time = 1000*(double)(stop_time.QuadPart - s->start_time.QuadPart)/(double)freq.QuadPart;
-	*/
-    double time = (end_time-s->timer).ToMillis();
-    //double time = end_time.ToMillis()-s->timer.ToMillis();
+	DProfileSection& s = context->Section( context->current );
 
+	// not timed this call (sampling)
+	if ( s.start_ticks == 0 )
+	{
+		s.BeginUpdate();
+		s.call_count++;
+		s.EndUpdate();
+		context->current = s.parent;
+		return;
+	}
 
-	// work out the new avg time and increment the call count
-	double total_time = time + s->avg_time * s->call_count++;
-	s->avg_time = total_time/(double)s->call_count;
-	/*s->avg_time = (s->avg_time*7 + time)/8;
-	s->call_count = 8;*/
+	// read the counters before the clock, so they cover less than the time does
+	uint64_t deltas[DPerfCounters::COUNT];
+	bool have_deltas = GetCountersEnabled() && StopCounters( context, context->current, deltas );
+
+    // this must stay a local: threads pop concurrently.
+    uint64_t end_ticks = DTime::GetTicks();
+
+	if ( GetTracingEnabled() )
+	{
+		DTraceBuffer* trace = context->trace.load( std::memory_order_acquire );
+		if ( trace )
+			trace->Write( DTraceEvent::END, s.name_id, end_ticks );
+	}
+
+	AddTimedCall( context, context->current, end_ticks - s.start_ticks, have_deltas ? deltas : NULL );
 
 	// shift current up
-	context->current = context->current->parent;
+	context->current = s.parent;
 }
 
-void DProfiler::Display( DProfiler::SORT_BY sort )
+void DProfiler::SectionRecord( DProfileSectionDescriptor& site, uint64_t ticks )
 {
-	printf("---------------------------------------------------------------------------------------\n" );
-    // re-use formatting from individual lines
-    printf( "PRofiler output: sorted by %s\n", (sort==SORT_EXECUTION?"execution order":"total time"));
-    printf( "%-50s  %10s  %10s  %6s\n", "name                            values in ms -> ", "total ", "average ", "count" );
-    printf("---------------------------------------------------------------------------------------\n" );
-	lock.Wait();
-	for ( DProfileContexts::iterator i = contexts.begin();
-		  i != contexts.end();
-		  ++i )
+	DProfileContext* context = GetContext();
+	uint32_t index = context->overflow_depth ? DProfileContext::NO_SECTION : context->GetChild( context->current, site.GetId(), &site );
+	if ( index == DProfileContext::NO_SECTION )
 	{
-		printf("Thread %x\n", (unsigned long)&((*i)->thread_context) );
-		(*i)->toplevel->Display("| ", sort );
+		context->dropped_calls.store( context->dropped_calls.load( std::memory_order_relaxed )+1, std::memory_order_relaxed );
+		return;
 	}
-	lock.Signal();
-	printf("---------------------------------------------------------------------------------------\n" );
+	AddTimedCall( context, index, ticks );
 }
 
+void DProfiler::SectionRecordPath( const int* ids, int depth, const DProfileSectionDescriptor* site, uint64_t ticks )
+{
+	if ( depth <= 0 )
+		return;
+	DProfileContext* context = GetContext();
+	uint32_t index = 0;
+	for ( int i=0; i<depth && index != DProfileContext::NO_SECTION; i++ )
+		index = context->GetChild( index, ids[i], i == depth-1 ? site : NULL );
+	if ( index == DProfileContext::NO_SECTION )
+	{
+		context->dropped_calls.store( context->dropped_calls.load( std::memory_order_relaxed )+1, std::memory_order_relaxed );
+		return;
+	}
+	AddTimedCall( context, index, ticks );
+}
 
-DProfileSection::DProfileSection()
+int DProfiler::GetCurrentPath( int* ids, int max_depth )
 {
-	parent = NULL;
-	avg_time = 0;
-	call_count = 0;
-	exec_order_id = EXEC_ORDER_ID++;
+	DProfileContext* context = GetContext();
+	int depth = 0;
+	for ( uint32_t i = context->current; i != 0; i = context->Section( i ).parent )
+		depth++;
+	// keep the outermost max_depth
+	int skip = depth > max_depth ? depth-max_depth : 0;
+	int n = depth-skip;
+	int pos = depth;
+	for ( uint32_t i = context->current; i != 0; i = context->Section( i ).parent )
+	{
+		pos--;
+		if ( pos < n )
+			ids[pos] = context->Section( i ).name_id;
+	}
+	return n;
 }
 
-DProfileSection::~DProfileSection()
+void DProfiler::StartCounters( DProfileContext* context, uint32_t index )
 {
-    for ( DProfileSections::iterator i = children.begin();
-        i != children.end();
-        ++i )
-    {
-        delete (*i).second;
-    }
-    children.clear();
+	DProfileSectionCounters* counters = context->Counters( index );
+	if ( !counters )
+		return;
+	if ( !context->perf )
+	{
+		// if this fails the counters stay closed, and aren't tried again
+		context->perf = new DPerfCounters();
+		context->perf->Open();
+	}
+	if ( context->perf->Read( counters->start ) )
+		counters->start_ticks = context->Section( index ).start_ticks;
+}
+
+bool DProfiler::StopCounters( DProfileContext* context, uint32_t index, uint64_t* deltas )
+{
+	DProfileSectionCounters* counters = context->Counters( index );
+	// start values from an earlier call (eg counters were enabled during this one) don't count
+	if ( !counters || !context->perf || counters->start_ticks != context->Section( index ).start_ticks )
+		return false;
+	if ( !context->perf->Read( deltas ) )
+		return false;
+	for ( int i=0; i<DPerfCounters::COUNT; i++ )
+		deltas[i] -= counters->start[i];
+	return true;
+}
+
+void DProfiler::AddTimedCall( DProfileContext* context, uint32_t index, uint64_t ticks, const uint64_t* counter_deltas )
+{
+	DProfileSection& s = context->Section( index );
+	s.BeginUpdate();
+
+	// accumulate raw ticks; conversion to ms happens in Display()
+	s.call_count++;
+	s.total_ticks += ticks;
+	s.timed_count++;
+
+	if ( s.sample_rate > 1 )
+	{
+		DProfileSectionInfo& info = context->Info( index );
+		double delta = (double)ticks - info.sample_mean;
+		info.sample_mean += delta / (double)s.timed_count;
+		info.sample_m2 += delta * ( (double)ticks - info.sample_mean );
+	}
+
+	if ( GetStatisticsEnabled() )
+	{
+		DProfileStats* stats = context->Stats( index );
+		if ( stats )
+			stats->Add( ticks );
+	}
+
+	if ( counter_deltas )
+	{
+		// StopCounters() found them, so they're allocated
+		DProfileCounterTotals& totals = context->Counters( index )->totals;
+		for ( int i=0; i<DPerfCounters::COUNT; i++ )
+			totals.values[i] += counter_deltas[i];
+	}
+
+	s.EndUpdate();
+}
+
+void DProfiler::RecordAllocation( size_t bytes, uint64_t ticks )
+{
+	// never registers a context: that would allocate. nor resets one after
+	// a Clear(); until the thread does that itself, it isn't shown anyway.
+	DProfileContext* context = thread_context;
+	if ( !context || context->generation.load( std::memory_order_relaxed ) != generation.load( std::memory_order_relaxed ) )
+		return;
+	DProfileAllocTotals* allocs = context->AllocTotals( context->current );
+	if ( !allocs )
+		return;
+	DProfileSection& s = context->Section( context->current );
+	s.BeginUpdate();
+	allocs->count++;
+	allocs->bytes += bytes;
+	allocs->ticks += ticks;
+	s.EndUpdate();
+}
+
+bool DProfiler::SetInternalAllocation( bool internal )
+{
+	bool was = internal_allocation;
+	internal_allocation = internal;
+	return was;
 }
 
-bool reverse_time_comparator( DProfileSection* a, DProfileSection* b )
+void DProfiler::RecordFree( uint64_t ticks )
 {
-    return a->avg_time*a->call_count > b->avg_time*b->call_count;
+	DProfileContext* context = thread_context;
+	if ( !context || context->generation.load( std::memory_order_relaxed ) != generation.load( std::memory_order_relaxed ) )
+		return;
+	DProfileAllocTotals* allocs = context->AllocTotals( context->current );
+	if ( !allocs )
+		return;
+	DProfileSection& s = context->Section( context->current );
+	s.BeginUpdate();
+	allocs->ticks += ticks;
+	s.EndUpdate();
 }
 
-bool execution_order_comparator( DProfileSection* a, DProfileSection* b )
+struct DProfileCalibration
 {
-    return a->exec_order_id < b->exec_order_id;
+	uint32_t pairs;
+	DProfileOverhead result;
+};
+
+void* DProfiler::CalibrateThread( void* arg )
+{
+	DProfileCalibration* calibration = (DProfileCalibration*)arg;
+	uint32_t pairs = calibration->pairs;
+	// always timed, whatever the default category's sample rate
+	static DProfileSectionDescriptor parent_site( "DProfiler calibration", __FILE__, __LINE__, PROFILE_CAT_DEFAULT, 1 );
+	static DProfileSectionDescriptor child_site( "DProfiler calibration child", __FILE__, __LINE__, PROFILE_CAT_DEFAULT, 1 );
+
+	// a first call creates the sections, opens any counters and warms the caches
+	DProfileContext* context = GetContext();
+	SectionPush( parent_site );
+	SectionPush( child_site );
+	SectionPop();
+	SectionPop();
+	uint32_t parent = context->GetChild( 0, parent_site.GetId(), &parent_site );
+	uint32_t child = context->GetChild( parent, child_site.GetId(), &child_site );
+
+	// the parent of pairs empty children gains a whole push and pop for
+	// each; each child's own time is the part between its clock reads. noise
+	// (preemption, interrupts) only ever adds time, so keep the fastest of
+	// several runs.
+	static const int RUNS = 9;
+	double pair_ticks = 0, inner_ticks = 0;
+	for ( int run=0; run<RUNS; run++ )
+	{
+		DProfileSectionSnapshot parent_before, child_before, parent_after, child_after;
+		context->CopySection( parent, parent_before, NULL );
+		context->CopySection( child, child_before, NULL );
+		SectionPush( parent_site );
+		for ( uint32_t i=0; i<pairs; i++ )
+		{
+			SectionPush( child_site );
+			SectionPop();
+		}
+		SectionPop();
+		context->CopySection( parent, parent_after, NULL );
+		context->CopySection( child, child_after, NULL );
+		double pair = (double)( parent_after.total_ticks - parent_before.total_ticks )/pairs;
+		double inner = (double)( child_after.total_ticks - child_before.total_ticks )/pairs;
+		if ( run == 0 || pair < pair_ticks )
+			pair_ticks = pair;
+		if ( run == 0 || inner < inner_ticks )
+			inner_ticks = inner;
+	}
+	calibration->result.inner_ticks = inner_ticks;
+	calibration->result.outer_ticks = std::max( 0.0, pair_ticks - inner_ticks );
+
+	// mark the context stale, so that neither snapshots nor the retired
+	// tree see the calibration sections
+	context->generation.store( generation.load( std::memory_order_relaxed )-1, std::memory_order_release );
+	UnregisterThread();
+	return NULL;
 }
 
-void DProfileSection::Display( const std::string& prefix, DProfiler::SORT_BY sort_by )
+DProfileOverhead DProfiler::Calibrate( uint32_t pairs )
 {
-    std::vector<DProfileSection* > children_vect;
-	for ( DProfileSections::iterator i = children.begin();
-		  i!= children.end();
-		  ++i )
+	DProfileCalibration calibration;
+	calibration.pairs = pairs ? pairs : 1;
+	pthread_t thread;
+	if ( pthread_create( &thread, NULL, CalibrateThread, &calibration ) != 0 )
 	{
-        children_vect.push_back( (*i).second );
+		fprintf(stderr, "DProfiler: couldn't start calibration thread\n" );
+		return GetOverhead();
 	}
+	pthread_join( thread, NULL );
+	lock.Lock();
+	overhead = calibration.result;
+	lock.Unlock();
+	return calibration.result;
+}
 
-    // sort by ..
-    if ( sort_by == DProfiler::SORT_TIME )
+DProfileOverhead DProfiler::GetOverhead()
+{
+	lock.Lock();
+	DProfileOverhead result = overhead;
+	lock.Unlock();
+	return result;
+}
+
+void DProfiler::EnableOverheadCorrection( bool enable )
+{
+	if ( enable && !GetOverhead().IsCalibrated() )
+		Calibrate();
+	overhead_correction_enabled.store( enable, std::memory_order_relaxed );
+}
+
+void DProfiler::Display( DProfiler::SORT_BY sort, bool merge_threads )
+{
+	DProfileSnapshot snapshot;
+	TakeSnapshot( snapshot );
+	if ( merge_threads )
+	{
+		DProfileSnapshot merged;
+		snapshot.Merge( merged );
+		Display( merged, sort );
+	}
+	else
+		Display( snapshot, sort );
+}
+
+/// ascending cpus as "0-3,8"
+static std::string FormatCPUs( const std::vector<int>& cpus )
+{
+	std::string out;
+	char buf[32];
+	for ( size_t i=0; i<cpus.size(); )
+	{
+		size_t j = i;
+		while ( j+1 < cpus.size() && cpus[j+1] == cpus[j]+1 )
+			j++;
+		if ( j > i )
+			snprintf( buf, 32, "%s%i-%i", out.empty() ? "" : ",", cpus[i], cpus[j] );
+		else
+			snprintf( buf, 32, "%s%i", out.empty() ? "" : ",", cpus[i] );
+		out += buf;
+		i = j+1;
+	}
+	return out;
+}
+
+void DProfiler::Display( const DProfileSnapshot& snapshot, DProfiler::SORT_BY sort )
+{
+	printf("---------------------------------------------------------------------------------------\n" );
+    // re-use formatting from individual lines
+    printf( "PRofiler output: sorted by %s%s\n", (sort==SORT_EXECUTION?"execution order":"total time"),
+        snapshot.subtract_overhead ? ", profiler overhead subtracted" : "" );
+    bool show_overhead = snapshot.overhead.IsCalibrated();
+    bool show_stats = false, show_frames = false, show_counters = false, show_allocs = false;
+    for ( size_t i=0; i<snapshot.threads.size(); i++ )
+    {
+        show_stats = show_stats || !snapshot.threads[i].stats.empty();
+        show_frames = show_frames || !snapshot.threads[i].frames.empty();
+        show_counters = show_counters || !snapshot.threads[i].counters.empty();
+        show_allocs = show_allocs || !snapshot.threads[i].allocs.empty();
+    }
+    printf( "%-50s  %10s  %10s  %10s  %6s", "name                            values in ms -> ", "total ", "self ", "average ", "count" );
+    if ( show_overhead )
+        printf( "  %6s", "ovh % " );
+    if ( show_frames )
+        printf( "  %10s  %10s", "frame avg ", "frame max " );
+    if ( show_stats )
+        printf( "  %10s  %10s  %10s  %10s  %10s  %10s  %10s", "min ", "max ", "stddev ", "p50 ", "p90 ", "p99 ", "p99.9 " );
+    if ( show_counters )
+        printf( "  %6s  %13s  %13s", "IPC ", "LLC miss/call ", "br miss/call " );
+    if ( show_allocs )
+        printf( "  %11s  %10s", "allocs/call ", "bytes/call " );
+    printf( "\n" );
+    printf("---------------------------------------------------------------------------------------\n" );
+	for ( size_t i=0; i<snapshot.threads.size(); i++ )
+	{
+		const DProfileThreadSnapshot& thread = snapshot.threads[i];
+		if ( thread.thread_index == -1 )
+			printf("%s (%i threads)", thread.name.c_str(), thread.merged_count );
+		else if ( !thread.name.empty() )
+			printf("Thread %i (%s)", thread.thread_index, thread.name.c_str() );
+		else
+			printf("Thread %i", thread.thread_index );
+		if ( !thread.cpus.empty() )
+			printf(", cpus %s", FormatCPUs( thread.cpus ).c_str() );
+		if ( thread.last_cpu >= 0 )
+			printf(" (last %i)", thread.last_cpu );
+		if ( thread.dropped_calls )
+			printf(", %llu calls dropped over the section limit", (unsigned long long)thread.dropped_calls );
+		printf("\n");
+		DisplaySection( thread, 0, "| ", sort, show_frames, show_stats, show_counters, show_overhead );
+	}
+	printf("---------------------------------------------------------------------------------------\n" );
+	if ( snapshot.semaphores.empty() )
+		return;
+	printf( "%-50s  %10s  %10s  %10s  %10s  %10s  %10s\n", "semaphores                      values in ms -> ",
+		"acquires ", "contended ", "wait ", "max wait ", "hold ", "max hold " );
+	printf("---------------------------------------------------------------------------------------\n" );
+	for ( size_t i=0; i<snapshot.semaphores.size(); i++ )
+	{
+		const DSemaphoreStats& s = snapshot.semaphores[i];
+		printf( "%-50s  %10llu  %10llu  %10.2f  %10.5f  %10.2f  %10.5f\n", s.name.c_str(),
+			(unsigned long long)s.acquires, (unsigned long long)s.contended,
+			DTime::TicksToMillis( s.total_wait_ticks ), DTime::TicksToMillis( s.max_wait_ticks ),
+			DTime::TicksToMillis( s.total_hold_ticks ), DTime::TicksToMillis( s.max_hold_ticks ) );
+	}
+	printf("---------------------------------------------------------------------------------------\n" );
+}
+
+
+class reverse_time_comparator
+{
+public:
+    reverse_time_comparator( const DProfileThreadSnapshot& _thread ) : thread( _thread ) {}
+    bool operator() ( uint32_t a, uint32_t b )
     {
-        std::sort( children_vect.begin(), children_vect.end(), reverse_time_comparator );
+        return thread.sections[a].reported_ticks > thread.sections[b].reported_ticks;
     }
-    else if ( sort_by == DProfiler::SORT_EXECUTION )
+private:
+    const DProfileThreadSnapshot& thread;
+};
+
+void DProfiler::DisplaySection( const DProfileThreadSnapshot& thread, uint32_t index, const std::string& prefix, DProfiler::SORT_BY sort_by,
+                                bool show_frames, bool show_stats, bool show_counters, bool show_overhead )
+{
+    // children are linked in execution order
+    std::vector<uint32_t> children_vect;
+    for ( uint32_t i = thread.sections[index].first_child; i != 0; i = thread.sections[i].next_sibling )
+    {
+        children_vect.push_back( i );
+    }
+
+    // sort by ..
+    if ( sort_by == DProfiler::SORT_TIME )
     {
-        std::sort( children_vect.begin(), children_vect.end(), execution_order_comparator );
+        std::sort( children_vect.begin(), children_vect.end(), reverse_time_comparator( thread ) );
     }
 
-    for ( int i=0; i<children_vect.size(); i++ )
+    for ( size_t i=0; i<children_vect.size(); i++ )
     {
-        DProfileSection* sect = children_vect[i];
+        const DProfileSectionSnapshot& sect = thread.sections[children_vect[i]];
 	    // replace '+' with '|';
 		std::string name;
 		if ( prefix.size()>1 )
-            name = prefix.substr( 0, prefix.size()-2 ) + std::string("+ ") + sect->name;
+            name = prefix.substr( 0, prefix.size()-2 ) + std::string("+ ") + GetName( sect.name_id );
         else
-            name = sect->name;
-		printf( "%-50s  %10.2f  %10.5f  %6d\n", name.c_str(),
-				  sect->avg_time * sect->call_count,
-				  sect->avg_time, sect->call_count );
+            name = GetName( sect.name_id );
+		printf( "%-50s  %10.2f  %10.2f  %10.5f  %6llu", name.c_str(),
+				  sect.GetReportedMillis(), DTime::TicksToMillis( sect.self_ticks ),
+				  sect.GetReportedAverageMillis(), (unsigned long long)sect.call_count );
+		// of the raw total, how much was the profiler's own
+		if ( show_overhead )
+		{
+			uint64_t total = sect.GetTotalTicks();
+			printf( "  %5.1f%%", total ? 100.0*sect.overhead_ticks/total : 0.0 );
+		}
+		if ( show_frames )
+		{
+			if ( children_vect[i] < thread.frames.size() && thread.frames[children_vect[i]].frames > 0 )
+				printf( "  %10.5f  %10.5f", thread.frames[children_vect[i]].average_millis, thread.frames[children_vect[i]].max_millis );
+			else
+				printf( "  %10s  %10s", "", "" );
+		}
+		const DProfileStats* stats = thread.GetStats( children_vect[i] );
+		if ( stats )
+		{
+			printf( "  %10.5f  %10.5f  %10.5f  %10.5f  %10.5f  %10.5f  %10.5f",
+				DTime::TicksToMillis( stats->min_ticks ), DTime::TicksToMillis( stats->max_ticks ),
+				DTime::TicksToMillis( 1 )*stats->GetStdDev(),
+				DTime::TicksToMillis( stats->GetPercentile( 0.5 ) ), DTime::TicksToMillis( stats->GetPercentile( 0.9 ) ),
+				DTime::TicksToMillis( stats->GetPercentile( 0.99 ) ), DTime::TicksToMillis( stats->GetPercentile( 0.999 ) ) );
+		}
+		else if ( show_stats && ( !thread.counters.empty() || !thread.allocs.empty() ) )
+			printf( "  %10s  %10s  %10s  %10s  %10s  %10s  %10s", "", "", "", "", "", "", "" );
+		if ( children_vect[i] < thread.counters.size() )
+		{
+			// counters are only read by timed calls
+			const DProfileCounterTotals& c = thread.counters[children_vect[i]];
+			printf( "  %6.2f  %13.1f  %13.1f", c.GetIPC(),
+				c.GetPerCall( DPerfCounters::CACHE_MISSES, sect.timed_count ),
+				c.GetPerCall( DPerfCounters::BRANCH_MISSES, sect.timed_count ) );
+		}
+		else if ( show_counters && !thread.allocs.empty() )
+			printf( "  %6s  %13s  %13s", "", "", "" );
+		if ( children_vect[i] < thread.allocs.size() )
+		{
+			// allocations are counted on every call, timed or not
+			const DProfileAllocTotals& a = thread.allocs[children_vect[i]];
+			double calls = sect.call_count ? (double)sect.call_count : 1.0;
+			printf( "  %11.2f  %10.1f", (double)a.count/calls, (double)a.bytes/calls );
+		}
+		// merged sections aren't IsSampled(), but keep their rate and error
+		if ( sect.sample_rate > 1 )
+		{
+			printf( "  (1/%u sampled, total +-%.2f)", sect.sample_rate,
+				DTime::TicksToMillis( 1 )*sect.sampled_total_error );
+		}
+		printf( "\n" );
 
         // if this is the last child,
         std::string next_prefix = prefix;
@@ -231,7 +1763,7 @@ void DProfileSection::Display( const std::string& prefix, DProfiler::SORT_BY sor
             next_prefix = next_prefix.substr(0, next_prefix.size()-2 ) + std::string("  ");
         }
         // next deeper level
-        sect->Display( next_prefix + "| ", sort_by );
+        DisplaySection( thread, children_vect[i], next_prefix + "| ", sort_by, show_frames, show_stats, show_counters, show_overhead );
 
 	}
 }
@@ -58,6 +58,15 @@
 
         NOTE: all labels at a given level in the tree must be unique.
 
+        NOTE: label must be a string literal. Each macro site keeps a static
+        DProfileSectionDescriptor holding the label, file and line, so the
+        label is only interned once, on the site's first call; a label
+        computed at runtime would file every later call under the first
+        one's name and then dangle. So anything else (a std::string, or
+        name.c_str()) is a compile error. For labels built at runtime use
+        PROFILE_SECTION_PUSH_DYNAMIC( name ) or PROFILE_THIS_BLOCK_DYNAMIC( name ),
+        which take a std::string and are correspondingly slower.
+
     * PROFILE_THIS_FUNCTION()
 
         Wraps the current function in a pair of
@@ -77,49 +86,602 @@
                 // code to run on test condition
             }
 
+    * PROFILE_THIS_BLOCK_DYNAMIC( name )
+
+        As PROFILE_THIS_BLOCK, for a label built at runtime: name is a
+        std::string (or anything convertible to one), looked up on every call
+        like PROFILE_SECTION_PUSH_DYNAMIC.
+
+            for ( size_t i=0; i<layers.size(); i++ )
+            {
+                PROFILE_THIS_BLOCK_DYNAMIC( layers[i].name );
+                layers[i].Run();
+            }
+
+
+    * PROFILE_THIS_BLOCK_CAT( label, category ) and PROFILE_THIS_FUNCTION_CAT( category )
+
+        As PROFILE_THIS_BLOCK and PROFILE_THIS_FUNCTION, but belonging to a
+        category (one of the PROFILE_CAT_* bits below, or your own bits from
+        PROFILE_CAT_USER upwards). Categories not in the PROFILE_CATEGORIES
+        mask at build time compile to nothing:
+
+            g++ -DPROFILE -DPROFILE_CATEGORIES="(PROFILE_CAT_DEFAULT|PROFILE_CAT_IO)" ...
+
+        Enabled categories can then be switched on and off at runtime with
+        DProfiler::SetCategoryMask(); a disabled section costs one relaxed
+        atomic load. For example, leave coarse sections on and only enable
+        PROFILE_CAT_FINE inner loop sections on demand.
+
+        The uncategorised macros always profile, regardless of the mask.
+
+    * PROFILE_THIS_BLOCK_SAMPLED( label, rate ) and PROFILE_THIS_FUNCTION_SAMPLED( rate )
+
+        For very hot sections: only 1 in rate calls reads the clock. Call
+        counts stay exact; total time is extrapolated from the timed calls,
+        and Display() shows the rate and the standard error of the total.
+        Sampling can also be set per category with
+        DProfiler::SetCategorySampleRate(), and DProfiler::SetSamplingMode()
+        chooses between every Nth call and a pseudo-random 1 in N.
+
+    For frame-based programs, call DProfiler::EnableFrameHistory( N ) and
+    then DProfiler::FrameBoundary() once per frame: every section's cost in
+    each of the last N frames is kept in a ring, for per-frame costs, moving
+    averages and spikes (see GetSectionFrames() and DProfileFrameSummary).
+
+    To display profile results, call DProfiler::Display(); pass
+    merge_threads = true to sum identical section paths over all threads
+    (eg the workers of a thread pool) into a single tree. To read them
+    from code, call DProfiler::TakeSnapshot() (see DProfileSnapshot.h).
+    Neither blocks the profiled threads, so both are safe to call
+    periodically while profiling continues.
+    Each thread's header also lists the CPUs it was seen running on (see
+    DThreadAttributes in DThread.h to pin threads to CPUs or NUMA nodes).
+
+    Time a thread spends blocked on a lock shows up as inclusive time in
+    whatever section it was in. To see where it went, name the semaphore
+    ( DSemaphore queue_lock( "queue lock" ); ): Display() then lists every
+    named DSemaphore's acquires, contended acquires, wait and hold times
+    after the section tree.
+
+    Tasks run on a DThreadPool (see DThreadPool.h) are profiled as the
+    section they were submitted with, next to the time they spent queued.
+
+    Code that can suspend and resume on another thread (coroutines,
+    callback continuations) must not use PROFILE_THIS_BLOCK across the
+    suspension: use PROFILE_SCOPE / DProfileScope (see DProfileScope.h),
+    whose timing moves with the task.
+
+    To also collect min, max, standard deviation and p50/p90/p99/p99.9 per
+    section, call DProfiler::EnableStatistics( true ).
+
+    To see why a section is slow, call DProfiler::EnableCounters( true ):
+    every timed call then also reads the thread's hardware counters (see
+    DPerfCounters.h), and Display() adds instructions per cycle and cache
+    and branch misses per call. Linux only; it returns false where the
+    counters aren't available.
+
+    To find heap churn, link in DProfilerAlloc.cpp (which replaces the
+    global operator new and delete) and call
+    DProfiler::EnableAllocationTracking( true ): each section then counts
+    the allocations made directly inside it, and Display() shows
+    allocations and bytes per call.
+
+    To record a timeline of every push and pop as well, call
+    DProfiler::EnableTracing( true ) and collect the events with a
+    DTraceDrainer (see DTrace.h), eg into a Chrome trace or Perfetto file
+    (see DTraceExport.h).
 
-    To display profile results, call DProfiler::Display();
+    Every push and pop costs some time of its own, which shows up in the
+    totals of the sections around it. For deep trees of tiny sections,
+    call DProfiler::EnableOverheadCorrection( true ) to measure that cost
+    once and take it out of the reported times; Display() then shows how
+    much each section's raw figure was overhead, as a percentage.
+
+    make builds the profiler into libfprofiler.a. The common case of a
+    push and pop is inline in this header, so it compiles into the call
+    site. For the cheapest calls, let the compiler see the rest of the
+    profiler as well: build libfprofiler_lto.a with make lto and link with
+    -flto, or #include "DProfilerUnity.cpp" in one of your source files
+    (make bench-fast compares the two).
+
+    To save results for offline analysis or for comparing runs in CI, write
+    a DProfileDump file and compare dumps with tools/dprofdiff (see
+    DProfileDump.h).
+
+    To see which thread's work bounds the frame time in a pipeline, drain
+    a trace into a DProfileDump file, name the DSemaphores the stages hand
+    work over with, call FrameBoundary() once per frame, and run
+    tools/dprofcrit on the file: it reports how much of each section lies
+    on the critical path and how much is parallel slack.
+
+    To keep a long-running process with unbounded dynamic labels within a
+    fixed budget, call DProfiler::SetLimits() before starting its threads:
+    each thread's sections are then allocated once, up front, and whatever
+    doesn't fit is folded into "(other)" sections or dropped and counted.
+    (dynamic labels still allocate the first time a thread sees each one.)
+
+    To watch a long-running process live, start a DProfileReporter (see
+    DProfileReporter.h) and connect tools/dprofwatch to it: every interval
+    it streams what each section cost since the last one.
 
 @author Damian
 
 */
 
 
+/// categories
+#define PROFILE_CAT_DEFAULT 0x00000001u
+#define PROFILE_CAT_IO      0x00000002u
+#define PROFILE_CAT_RENDER  0x00000004u
+#define PROFILE_CAT_THREADS 0x00000008u
+#define PROFILE_CAT_FINE    0x00000010u
+#define PROFILE_CAT_USER    0x00000100u
+#define PROFILE_CAT_ALL     0xffffffffu
+/// categories compiled in
+#ifndef PROFILE_CATEGORIES
+#define PROFILE_CATEGORIES PROFILE_CAT_ALL
+#endif
+
+/// the hot path (see the end of this file) is small, and inlining it into
+/// every call site is the point, so don't leave that to the compiler
+#if defined(__GNUC__)
+#define DPROFILE_INLINE inline __attribute__((always_inline))
+#else
+#define DPROFILE_INLINE inline
+#endif
+/// thread_local variables shared between translation units are read
+/// through a function call in case they need initialising; __thread ones
+/// can't, so they are read directly
+#if defined(__GNUC__)
+#define DPROFILE_THREAD_LOCAL __thread
+#else
+#define DPROFILE_THREAD_LOCAL thread_local
+#endif
+
 /// macros
+#define DPROFILE_CONCAT_( a, b ) a##b
+#define DPROFILE_CONCAT( a, b ) DPROFILE_CONCAT_( a, b )
 #ifdef PROFILE
-#define PROFILE_SECTION_PUSH( label ) DProfiler::SectionPush( label );
+#define PROFILE_SECTION_PUSH( label ) { static DProfileSectionDescriptor __section_profiler_site__( "" label, __FILE__, __LINE__ ); DProfiler::SectionPush( __section_profiler_site__ ); }
+#define PROFILE_SECTION_PUSH_DYNAMIC( name ) DProfiler::SectionPush( name );
 #define PROFILE_SECTION_POP() DProfiler::SectionPop();
-#define PROFILE_THIS_FUNCTION() volatile FFunctionProfiler __function_profiler_object__( __FUNCTION__ );
-#define PROFILE_THIS_BLOCK( label ) volatile FFunctionProfiler __section_profiler_object__##__LINE__( label );
+#define PROFILE_THIS_FUNCTION() static DProfileSectionDescriptor __function_profiler_site__( __FUNCTION__, __FILE__, __LINE__ ); \
+    volatile FFunctionProfiler __function_profiler_object__( __function_profiler_site__ );
+#define PROFILE_THIS_BLOCK( label ) static DProfileSectionDescriptor DPROFILE_CONCAT( __section_profiler_site__, __LINE__ )( "" label, __FILE__, __LINE__ ); \
+    volatile FFunctionProfiler DPROFILE_CONCAT( __section_profiler_object__, __LINE__ )( DPROFILE_CONCAT( __section_profiler_site__, __LINE__ ) );
+#define PROFILE_THIS_BLOCK_DYNAMIC( name ) volatile FFunctionProfiler DPROFILE_CONCAT( __section_profiler_object__, __LINE__ )( name );
+#define PROFILE_THIS_FUNCTION_SAMPLED( rate ) static DProfileSectionDescriptor __function_profiler_site__( __FUNCTION__, __FILE__, __LINE__, PROFILE_CAT_DEFAULT, rate ); \
+    volatile FFunctionProfiler __function_profiler_object__( __function_profiler_site__ );
+#define PROFILE_THIS_BLOCK_SAMPLED( label, rate ) static DProfileSectionDescriptor DPROFILE_CONCAT( __section_profiler_site__, __LINE__ )( "" label, __FILE__, __LINE__, PROFILE_CAT_DEFAULT, rate ); \
+    volatile FFunctionProfiler DPROFILE_CONCAT( __section_profiler_object__, __LINE__ )( DPROFILE_CONCAT( __section_profiler_site__, __LINE__ ) );
+#define PROFILE_THIS_FUNCTION_CAT( cat ) static DProfileSectionDescriptor __function_profiler_site__( __FUNCTION__, __FILE__, __LINE__, cat ); \
+    volatile FCategoryProfiler< ( (PROFILE_CATEGORIES) & (cat) ) != 0 > __function_profiler_object__( __function_profiler_site__ );
+#define PROFILE_THIS_BLOCK_CAT( label, cat ) static DProfileSectionDescriptor DPROFILE_CONCAT( __section_profiler_site__, __LINE__ )( "" label, __FILE__, __LINE__, cat ); \
+    volatile FCategoryProfiler< ( (PROFILE_CATEGORIES) & (cat) ) != 0 > DPROFILE_CONCAT( __section_profiler_object__, __LINE__ )( DPROFILE_CONCAT( __section_profiler_site__, __LINE__ ) );
 #warning Profiling with DProfiler enabled
 #else
 #define PROFILE_SECTION_PUSH( label ) ;
+#define PROFILE_SECTION_PUSH_DYNAMIC( name ) ;
 #define PROFILE_SECTION_POP() ;
 #define PROFILE_THIS_FUNCTION() ;
 #define PROFILE_THIS_BLOCK( label );
+#define PROFILE_THIS_BLOCK_DYNAMIC( name ) ;
+#define PROFILE_THIS_FUNCTION_SAMPLED( rate ) ;
+#define PROFILE_THIS_BLOCK_SAMPLED( label, rate ) ;
+#define PROFILE_THIS_FUNCTION_CAT( cat ) ;
+#define PROFILE_THIS_BLOCK_CAT( label, cat ) ;
 //#warning Profiling with DProfiler disabled
 #endif
 
 
+#include "DProfileSnapshot.h"
+#include "DProfileStats.h"
+#include "DMutex.h"
+#include "DPerfCounters.h"
 #include "DSemaphore.h"
 #include "DTime.h"
+#include "DTrace.h"
 #include "DThread.h"
+#include <atomic>
 #include <map>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
 
-class DProfileSection;
+/** DProfileSectionDescriptor
+
+    static description of one profiled site, declared as a function-local
+    static by the PROFILE_* macros. Constant-initialised, so it costs nothing
+    until first use; the label is interned to an integer id on the first push.
+
+*/
+
+class DProfileSectionDescriptor
+{
+public:
+    constexpr DProfileSectionDescriptor( const char* _label, const char* _file, int _line,
+                                         uint32_t _category = PROFILE_CAT_DEFAULT, uint32_t _sample_rate = 0 )
+        : label( _label ), file( _file ), line( _line ), category( _category ), sample_rate( _sample_rate ), id( 0 ) {}
+
+    /// return the interned id for label, interning it if necessary
+    int GetId()
+    {
+        int i = id.load( std::memory_order_relaxed );
+        return i ? i : Intern();
+    }
+
+    const char* label;
+    const char* file;
+    int line;
+    /// PROFILE_CAT_* bit(s)
+    uint32_t category;
+    /// time 1 in sample_rate calls. 0 means use the category's rate.
+    uint32_t sample_rate;
+
+private:
+    int Intern();
+
+    // 0 until interned
+    std::atomic<int> id;
+};
+
+/// one section: the hot part, touched on every push/pop. sections live in a
+/// DProfileContext and refer to each other by index; 0 is the toplevel section,
+/// and doubles as "none" for first_child/next_sibling.
+class DProfileSection {
+public:
+	DProfileSection() : seq( 0 ) {}
+
+	/// (re)initialise the counters. seq isn't touched: a section reused after
+	/// Reset() keeps counting up, so that a reader that copied the old section
+	/// can't mistake the new one for it. call between BeginUpdate() and EndUpdate().
+	void Init( uint32_t _parent, int _name_id )
+	{
+		call_count = 0; total_ticks = 0; start_ticks = 0; timed_count = 0;
+		parent = _parent; first_child = 0; next_sibling = 0;
+		name_id = _name_id;
+		sample_countdown = 0; sample_rate = 1;
+	}
+
+	/// bracket every change to the counters (and the section's info and
+	/// stats), so that DProfileContext::Snapshot() can copy them consistently
+	/// from another thread. only the owning thread may call these.
+	void BeginUpdate()
+	{
+		seq.store( seq.load( std::memory_order_relaxed )+1, std::memory_order_relaxed );
+		std::atomic_thread_fence( std::memory_order_release );
+	}
+	void EndUpdate() { seq.store( seq.load( std::memory_order_relaxed )+1, std::memory_order_release ); }
+
+	uint64_t call_count;
+	// accumulated DTime ticks of timed calls, converted to ms only for display
+	uint64_t total_ticks;
+	// DTime ticks at the most recent push, or 0 if that call isn't being timed
+	uint64_t start_ticks;
+	// number of calls that were timed. == call_count unless sampling.
+	uint64_t timed_count;
+
+	uint32_t parent;
+	uint32_t first_child;
+	uint32_t next_sibling;
+	int name_id;
+
+	// calls until the next timed call, and the rate that was used to pick it
+	uint32_t sample_countdown;
+	uint32_t sample_rate;
+
+	// seqlock: odd while the counters are being updated
+	std::atomic<uint32_t> seq;
+
+	bool IsSampled() const { return timed_count != call_count; }
+	/// total ticks, extrapolated from the timed calls if sampling
+	uint64_t GetTotalTicks() const
+	{
+		if ( !IsSampled() )
+			return total_ticks;
+		return timed_count ? (uint64_t)( (double)total_ticks * (double)call_count / (double)timed_count ) : 0;
+	}
+	double GetTotalMillis() const { return DTime::TicksToMillis( GetTotalTicks() ); }
+	/// average is computed here rather than on every pop, to keep the divide off the hot path
+	double GetAverageMillis() const { return timed_count ? DTime::TicksToMillis( total_ticks )/(double)timed_count : 0.0; }
+};
+
+/// one section: the cold part, only needed for reporting.
+class DProfileSectionInfo {
+public:
+	// the site that created this section, or NULL for dynamic labels
+	const DProfileSectionDescriptor* site;
+
+	// running mean/variance (Welford) of timed calls, kept only for sampled
+	// sections to estimate the error of the extrapolated total
+	double sample_mean;
+	double sample_m2;
+
+	/// standard error of DProfileSection::GetTotalTicks(), in ticks
+	double GetSampledTotalError( uint64_t call_count, uint64_t timed_count ) const;
+};
+
+/// one section's calls and (extrapolated) ticks during one frame
+class DProfileFrameSample
+{
+public:
+	uint64_t call_count;
+	uint64_t ticks;
+};
+
+/** DProfileFrameHistory
+
+    the last frames frames of one context, as per-section deltas of its
+    cumulative counters. only touched by DProfiler::FrameBoundary() and the
+    frame queries, under DProfiler's frames lock, so the profiled thread
+    never pays for it.
+
+*/
+
+class DProfileFrameHistory
+{
+public:
+	DProfileFrameHistory( uint32_t _frames ) : frames( _frames ) { Reset( 0, 0 ); }
+
+	/// forget everything: the context was reset at generation, and the next
+	/// frame to be recorded is frame
+	void Reset( unsigned _generation, uint64_t frame )
+	{
+		generation = _generation;
+		first_frame = frame;
+		last.clear();
+		samples.clear();
+	}
+	/// make room for count sections
+	void Grow( uint32_t count )
+	{
+		if ( count <= last.size() )
+			return;
+		DProfileFrameSample zero = { 0, 0 };
+		last.resize( count, zero );
+		samples.resize( (size_t)count*frames, zero );
+	}
+	uint32_t GetSectionCount() const { return last.size(); }
+	DProfileFrameSample& Sample( uint32_t section, uint64_t frame ) { return samples[(size_t)section*frames + frame%frames]; }
+
+	/// number of slots in the ring
+	uint32_t frames;
+	/// context generation the deltas are relative to
+	unsigned generation;
+	/// the first frame recorded since the last Reset()
+	uint64_t first_frame;
+	/// cumulative counters at the last frame boundary, per section
+	std::vector<DProfileFrameSample> last;
+	/// [section*frames + frame%frames]
+	std::vector<DProfileFrameSample> samples;
+};
+
+/** DProfileChunk
+
+    one entry of a DProfileContext's chunk table: CHUNK_SIZE sections' hot
+    counters and cold metadata, and the storage that is only allocated once
+    statistics, hardware counters or allocation tracking are enabled. an entry
+    never changes once published, so the table can be copied when it grows;
+    the on-demand storage goes in extras, which never moves, so that it can
+    be filled in from any thread meanwhile.
+
+*/
+
+struct DProfileChunkExtras
+{
+    std::atomic<DProfileStats*> stats;
+    std::atomic<DProfileSectionCounters*> counters;
+    std::atomic<DProfileAllocTotals*> allocs;
+};
+
+struct DProfileChunk
+{
+    DProfileSection* hot;
+    DProfileSectionInfo* cold;
+    DProfileChunkExtras* extras;
+};
+
+
+/** DProfileContext
+
+    per-thread profile data. the section tree is stored as a flat arena of
+    fixed-size chunks, hot counters apart from cold metadata. sections are
+    created in execution order, so their index doubles as the execution order
+    id. chunks, and the table that points to them, are only allocated while
+    the tree grows; Reset() keeps them.
+
+*/
 
 class DProfileContext
 {
 public:
+    DProfileContext();
+    ~DProfileContext();
+
+    static const uint32_t CHUNK_BITS = 8;
+    static const uint32_t CHUNK_SIZE = 1<<CHUNK_BITS;
+    static const uint32_t CHUNK_MASK = CHUNK_SIZE-1;
+    static const uint32_t MAX_CHUNKS = 4096;
+    /// parents with more children than this have them indexed by name id
+    static const uint32_t WIDE_CHILDREN = 8;
+
+    DProfileSection& Section( uint32_t index ) { return Chunk(index).hot[index&CHUNK_MASK]; }
+    DProfileSectionInfo& Info( uint32_t index ) { return Chunk(index).cold[index&CHUNK_MASK]; }
+    /// return the statistics for the given section, or NULL if they haven't been allocated
+    DProfileStats* Stats( uint32_t index )
+    {
+        DProfileStats* chunk = Chunk(index).extras->stats.load( std::memory_order_acquire );
+        return chunk ? chunk + (index&CHUNK_MASK) : NULL;
+    }
+    /// allocate statistics for every chunk that doesn't have them yet. may be called from any thread.
+    void AllocateStats();
+    /// as Stats() and AllocateStats(), for hardware counters
+    DProfileSectionCounters* Counters( uint32_t index )
+    {
+        DProfileSectionCounters* chunk = Chunk(index).extras->counters.load( std::memory_order_acquire );
+        return chunk ? chunk + (index&CHUNK_MASK) : NULL;
+    }
+    void AllocateCounters();
+    /// as Stats() and AllocateStats(), for allocation tracking
+    DProfileAllocTotals* AllocTotals( uint32_t index )
+    {
+        DProfileAllocTotals* chunk = Chunk(index).extras->allocs.load( std::memory_order_acquire );
+        return chunk ? chunk + (index&CHUNK_MASK) : NULL;
+    }
+    void AllocateAllocTotals();
+    uint32_t GetSectionCount() const { return section_count.load( std::memory_order_acquire ); }
+
+    /// copy every section into out. safe to call from any thread while the
+    /// owning thread is profiling, as long as the context isn't being Reset().
+    void Snapshot( DProfileThreadSnapshot& out );
+    /// copy one section (< GetSectionCount()) into out, and its statistics into
+    /// stats, counter totals into counters and allocation totals into allocs
+    /// if given. same rules as Snapshot().
+    void CopySection( uint32_t index, DProfileSectionSnapshot& out, DProfileStats* stats,
+                      DProfileCounterTotals* counters = NULL, DProfileAllocTotals* allocs = NULL );
+
+    /// returned by GetChild() when the context is full (see DProfiler::SetLimits())
+    static const uint32_t NO_SECTION = 0xffffffffu;
+    /// return the index of the child of parent with the given name id, creating it if
+    /// necessary. past DProfiler's limits this is parent's "(other)" child, or NO_SECTION.
+    uint32_t GetChild( uint32_t parent, int name_id, const DProfileSectionDescriptor* site )
+    {
+        // the first WIDE_CHILDREN children are searched in order; a parent
+        // with more has all of its children in the child index
+        uint32_t children = 0;
+        for ( uint32_t i = Section(parent).first_child; i != 0; i = Section(i).next_sibling )
+        {
+            if ( Section(i).name_id == name_id )
+                return i;
+            if ( ++children == WIDE_CHILDREN && Section(i).next_sibling != 0 )
+                return GetWideChild( parent, name_id, site );
+        }
+        return AddSection( parent, name_id, site, children );
+    }
+    /// allocate storage for at least sections sections now, and room to index
+    /// them all as children, so adding them later doesn't
+    void Reserve( uint32_t sections );
+
+    /// drop all sections apart from the toplevel, keeping the allocated memory.
+    void Reset();
+
+    static const int MAX_CPUS = 256;
+    static const uint32_t CPU_SAMPLE_INTERVAL = 64;
+    /// note the CPU the owning thread is running on now. called from the
+    /// owning thread on registration and every CPU_SAMPLE_INTERVAL toplevel
+    /// sections, and never below the toplevel, so a thread that stays in one
+    /// section isn't sampled again until it leaves.
+    void RecordCPU();
+    /// the CPUs recorded since the last Reset(), in order, and the latest
+    void GetCPUs( std::vector<int>& out, int& last ) const;
+
 	DThreadContext thread_context;
-	DProfileSection* toplevel;
-	DProfileSection* current;
+	/// order in which this context's thread registered, from 0. unique: never
+	/// reused, even when the context itself is reused for a new thread.
+	int thread_index;
+	/// as given to DProfiler::RegisterThread(). guarded by DProfiler's lock.
+	std::string name;
+	/// bumped each time the context's thread exits and the context is
+	/// recycled, so that readers holding on to it can tell
+	std::atomic<uint64_t> incarnation;
+	/// index of the section currently being profiled
+	uint32_t current;
+	/// pushes that found the context full and haven't been popped yet. while
+	/// there are any, every push is dropped along with its pop.
+	uint32_t overflow_depth;
+	/// calls dropped because the context was full, since the last Reset()
+	std::atomic<uint64_t> dropped_calls;
+	/// the DProfiler generation this context was last reset at
+	std::atomic<unsigned> generation;
 
-    DProfileContext() { toplevel = NULL; }
-    ~DProfileContext();
+	// event trace ring, allocated once tracing is enabled
+	std::atomic<DTraceBuffer*> trace;
+
+	// per-frame history, allocated by the first FrameBoundary() after frame
+	// history is enabled. guarded by DProfiler's frames lock.
+	DProfileFrameHistory* frame_history;
+
+	// state for SAMPLE_RANDOM
+	uint32_t random_state;
+
+	// the owning thread's hardware counters, opened by its first timed push
+	// after counters are enabled and closed when it exits. only touched by
+	// the owning thread.
+	DPerfCounters* perf;
+
+	/// NUMA node this context's memory was allocated on, or -1 if unknown
+	int numa_node;
+	/// toplevel pushes until the next RecordCPU()
+	uint32_t cpu_countdown;
+
+	// name -> id cache for dynamic labels, so the global name table is only
+	// consulted the first time this thread sees a given label
+	typedef std::map<std::string, int> DNameIds;
+	DNameIds name_ids;
+
+private:
+    /// children is the number parent has already
+    uint32_t AddSection( uint32_t parent, int name_id, const DProfileSectionDescriptor* site, uint32_t children );
+    /// allocate the next chunk of sections
+    void AddChunk();
+    /// GetChild() for a parent with more than WIDE_CHILDREN children
+    uint32_t GetWideChild( uint32_t parent, int name_id, const DProfileSectionDescriptor* site );
+    /// add child of parent to the child index
+    void IndexChild( uint32_t parent, int name_id, uint32_t child );
+    /// rehash the child index into slots slots (a power of two)
+    void GrowChildIndex( size_t slots );
+
+    /// make room in the chunk table for at least capacity chunks
+    void GrowChunks( uint32_t capacity );
+    const DProfileChunk& Chunk( uint32_t index ) const { return chunks.load( std::memory_order_acquire )[index>>CHUNK_BITS]; }
+
+    // the chunk table, grown on demand by the owning thread. readers may still
+    // be using a table that has been outgrown, so those are kept until the
+    // context is deleted.
+    std::atomic<DProfileChunk*> chunks;
+    uint32_t chunk_capacity;
+    std::atomic<uint32_t> chunk_count;
+    DProfileChunk first_chunk;
+    std::vector<DProfileChunk*> outgrown_chunks;
+    // open-addressed hash of (parent, name id) -> child index, for the
+    // children of wide parents. empty slots have child 0. only touched by
+    // the owning thread.
+    struct DChildSlot
+    {
+        uint32_t parent;
+        int name_id;
+        uint32_t child;
+    };
+    std::vector<DChildSlot> child_index;
+    uint32_t child_index_count;
+    // published with release once a new section is initialised and linked in
+    std::atomic<uint32_t> section_count;
+    // bitmask of the CPUs recorded, and the latest (-1 for none)
+    std::atomic<uint64_t> cpus_seen[MAX_CPUS/64];
+    std::atomic<int> last_cpu;
+};
+
+
+/** DProfileSectionHandle
+
+    refers to one section of one thread's live tree. find it once with
+    DProfiler::FindSection(), then read it as often as needed with
+    DProfiler::ReadSection(). a handle goes stale on DProfiler::Clear().
+
+*/
+
+class DProfileSectionHandle
+{
+public:
+    DProfileSectionHandle() : context( NULL ), index( 0 ), generation( 0 ), incarnation( 0 ) {}
+    bool IsValid() const { return context != NULL; }
+
+    DProfileContext* context;
+    uint32_t index;
+    unsigned generation;
+    uint64_t incarnation;
 };
 
 
@@ -129,65 +691,344 @@ public:
     /// clear the database and restart profiling
     static void Clear();
 
-	/// start a section
+	/// start a section described by a static descriptor (fast)
+	static DPROFILE_INLINE void SectionPush( DProfileSectionDescriptor& site ) { SectionPush( site.GetId(), &site ); }
+	/// start a section with the given interned name id. this and SectionPop()
+	/// are inline (see below) for a timed call to an existing section with no
+	/// counters or tracing; anything else goes through an out-of-line slow path.
+	static DPROFILE_INLINE void SectionPush( int name_id, const DProfileSectionDescriptor* site = NULL );
+	/// start a section with a label built at runtime (slower: the label is
+	/// looked up in a per-thread name cache on every call)
 	static void SectionPush( const std::string& name = "unlabelled section" );
 	/// end a section
-	static void SectionPop();
+	static DPROFILE_INLINE void SectionPop();
+	/// record one call of site lasting ticks, as a child of the current
+	/// section, for time measured some other way (eg how long a task sat in
+	/// a queue). not sampled and not traced.
+	static void SectionRecord( DProfileSectionDescriptor& site, uint64_t ticks );
+	/// as SectionRecord(), at the given path of name ids from the toplevel
+	/// down rather than under the current section. site describes the last
+	/// id. used by DProfileScope.
+	static void SectionRecordPath( const int* ids, int depth, const DProfileSectionDescriptor* site, uint64_t ticks );
+	/// fill ids with the name ids of the calling thread's current section
+	/// and its parents, from the toplevel down, and return how many. stops
+	/// at max_depth.
+	static int GetCurrentPath( int* ids, int max_depth );
+	/// bumped by every Clear()
+	static unsigned GetGeneration() { return generation.load( std::memory_order_acquire ); }
+
+	/// return a pointer to the context for the current thread. lock-free once
+	/// the thread has registered (on its first call).
+	static DPROFILE_INLINE DProfileContext* GetContext();
+	/// register the calling thread, if it isn't already, and give it a name
+	/// for reports. DThread does this for its threads automatically.
+	static void RegisterThread( const std::string& name );
+	/// fold the calling thread's results into the "retired threads" tree and
+	/// give up its context. happens automatically when a registered thread
+	/// exits; profiling again afterwards registers it anew.
+	static void UnregisterThread();
+	/// return the name given to RegisterThread() by the context's thread
+	static std::string GetThreadName( const DProfileContext* context );
+	/// copy the list of all live contexts into out
+	static void GetContexts( std::vector<DProfileContext*>& out );
+	/// copy every thread's current results into out, without blocking the
+	/// profiled threads. the lock is only held long enough to copy the list
+	/// of contexts. threads that have exited since the last Clear() appear
+	/// summed together as one extra tree, with thread_index -1.
+	static void TakeSnapshot( DProfileSnapshot& out );
 
-	/// return a pointer to the context for the current thread
-	static DProfileContext* GetContext();
+	/// find the section at path (eg "frame/render/shadow") in the given
+	/// thread's tree (by thread_index; -1 for the calling thread). returns an
+	/// invalid handle if the section hasn't been created yet.
+	static DProfileSectionHandle FindSection( const std::string& path, int thread_index = -1 );
+	/// copy the current counters of the section into out, with self_ticks
+	/// filled in. lock-free and about as cheap as a push/pop per child of the
+	/// section. returns false if the handle is invalid or stale.
+	static bool ReadSection( const DProfileSectionHandle& handle, DProfileSectionSnapshot& out );
 
-	/// show profiles recorded. SORT_BY defines sort order.
+	/// set which categories are profiled at runtime (only affects the *_CAT macros)
+	static void SetCategoryMask( uint32_t mask ) { category_mask.store( mask, std::memory_order_relaxed ); }
+	static uint32_t GetCategoryMask() { return category_mask.load( std::memory_order_relaxed ); }
+	static bool IsCategoryEnabled( uint32_t category ) { return ( category_mask.load( std::memory_order_relaxed ) & category ) != 0; }
+
+	/// set the sample rate for all sampled-by-category sites in the given category bit(s). 1 = time every call.
+	static void SetCategorySampleRate( uint32_t category, uint32_t rate );
+	/// sample rate for a site: its own rate if it has one, otherwise its category's
+	static uint32_t GetSampleRate( const DProfileSectionDescriptor& site )
+	{
+		if ( site.sample_rate )
+			return site.sample_rate;
+		return category_sample_rates[ __builtin_ctz( site.category | 0x80000000u ) ].load( std::memory_order_relaxed );
+	}
+	/// SAMPLE_PERIODIC times every Nth call; SAMPLE_RANDOM times a pseudo-random
+	/// 1 in N, which avoids aliasing with periodic behaviour in the profiled code.
+	typedef enum _SAMPLING_MODE { SAMPLE_PERIODIC, SAMPLE_RANDOM } SAMPLING_MODE;
+	static void SetSamplingMode( SAMPLING_MODE mode ) { sampling_mode = mode; }
+
+	/// enable or disable per-section min/max/stddev/percentile statistics.
+	/// costs about 8kb per section, allocated when enabled or when sections are created.
+	static void EnableStatistics( bool enable );
+	static bool GetStatisticsEnabled() { return statistics_enabled.load( std::memory_order_relaxed ); }
+
+	/// enable or disable per-section hardware counters (cycles, instructions,
+	/// cache and branch misses; see DPerfCounters). each thread opens its own
+	/// on its next timed push. returns false, and leaves them disabled, if the
+	/// counters can't be opened here.
+	static bool EnableCounters( bool enable );
+	static bool GetCountersEnabled() { return counters_enabled.load( std::memory_order_relaxed ); }
+
+	/// enable or disable charging heap allocations (count, bytes and time
+	/// in the allocator) to the section each thread is in when it makes
+	/// them. only works if DProfilerAlloc.cpp is linked in to provide the
+	/// hooks; otherwise nothing is recorded.
+	static void EnableAllocationTracking( bool enable );
+	static bool GetAllocationTrackingEnabled() { return allocation_tracking_enabled.load( std::memory_order_relaxed ); }
+	/// charge an allocation of bytes that took ticks, or ticks spent freeing
+	/// memory, to the calling thread's current section. for the hooks in
+	/// DProfilerAlloc.cpp. threads that have never profiled are ignored.
+	static void RecordAllocation( size_t bytes, uint64_t ticks );
+	static void RecordFree( uint64_t ticks );
+	/// mark the calling thread as allocating for the profiler itself (or
+	/// for recording an allocation), so that the hooks don't charge it to
+	/// a section. returns the previous setting, to restore afterwards.
+	static bool SetInternalAllocation( bool internal );
+
+	/// enable or disable event trace recording. each thread records into its own
+	/// ring of capacity events (16 bytes each), allocated on first enable; capacity
+	/// and policy only apply to rings allocated after the call.
+	static void EnableTracing( bool enable, TRACE_POLICY policy = TRACE_DROP_NEWEST, uint32_t capacity = 65536 );
+	static bool GetTracingEnabled() { return tracing_enabled.load( std::memory_order_relaxed ); }
+	/// append an event to the calling thread's ring, if tracing is enabled.
+	/// for events other than section pushes and pops (see DTrace.h).
+	static void RecordTraceEvent( DTraceEvent::TYPE type, uint32_t id, uint64_t ticks );
+	/// collect recorded events from every thread's ring, and from the rings
+	/// of threads that have exited since the last drain, and pass them to
+	/// sink. only call from one thread at a time (usually a DTraceDrainer).
+	static void DrainTrace( DTraceSink* sink );
+
+	/// keep per-section costs for each of the last frames frames, in a ring
+	/// that is rotated by FrameBoundary(). 0 turns frame history off.
+	static void EnableFrameHistory( uint32_t frames );
+	static uint32_t GetFrameHistorySize() { return frame_history_size; }
+	/// mark the end of a frame. call once per frame, from one thread (eg
+	/// alongside DTime::Update()). records what every section of every thread
+	/// cost during the frame; costs nothing on the profiled threads themselves.
+	static void FrameBoundary();
+	/// number of FrameBoundary() calls so far
+	static uint64_t GetFrameCount() { return frame_count.load( std::memory_order_relaxed ); }
+	/// summarise a section's cost over the frame history, and optionally copy
+	/// its per-frame samples (oldest first) into samples. returns false if the
+	/// handle is invalid or stale, or frame history isn't enabled.
+	static bool GetSectionFrames( const DProfileSectionHandle& handle, DProfileFrameSummary& summary, std::vector<DProfileFrameSample>* samples = NULL );
+
+	/// measure what a timed push and pop cost on this machine, with the
+	/// current tick source and whatever statistics, counters, tracing and
+	/// allocation tracking are enabled now, by timing empty sections on a
+	/// short-lived thread whose results are then discarded. snapshots taken
+	/// afterwards estimate each section's overhead from it; call again
+	/// after changing what's enabled. the estimate assumes every call is
+	/// timed, so it runs high under sampling.
+	static DProfileOverhead Calibrate( uint32_t pairs = 20000 );
+	static DProfileOverhead GetOverhead();
+	/// subtract the estimated overhead from total, self and average times
+	/// in snapshots and Display() (not from statistics, or ReadSection()).
+	/// calibrates first if Calibrate() hasn't been called.
+	static void EnableOverheadCorrection( bool enable );
+	static bool GetOverheadCorrectionEnabled() { return overhead_correction_enabled.load( std::memory_order_relaxed ); }
+
+	/// show profiles recorded. SORT_BY defines sort order. with merge_threads,
+	/// sections with the same path are summed over all threads and shown as
+	/// one tree. works from a snapshot, so profiled threads carry on while the
+	/// output is formatted.
 	typedef enum _SORT_BY { SORT_EXECUTION, SORT_TIME } SORT_BY;
-	static void Display( SORT_BY sort = SORT_TIME );
+	static void Display( SORT_BY sort = SORT_TIME, bool merge_threads = false );
+	static void Display( const DProfileSnapshot& snapshot, SORT_BY sort = SORT_TIME );
+
+	/// bound the memory each thread's profile can use. max_sections caps the
+	/// sections per thread; their storage, and the index of wide sections'
+	/// children, is allocated when the thread registers, so pushes of static
+	/// labels never allocate. dynamic labels (PROFILE_SECTION_PUSH_DYNAMIC)
+	/// still allocate the first time each thread sees each name, to intern it
+	/// and cache its id, up to max_names. once max_sections is reached, calls
+	/// to new sections are dropped (their time stays in the parent's self
+	/// time) and counted in DProfileThreadSnapshot::dropped_calls. past
+	/// max_children children, new names under a section share an "(other)"
+	/// child. past max_names interned names, new dynamic labels are all named
+	/// "(other)". 0 means no limit. call before the profiled threads start.
+	static void SetLimits( uint32_t max_sections, uint32_t max_children, uint32_t max_names = 4096 );
+	static uint32_t GetMaxSections() { return max_sections; }
+	static uint32_t GetMaxChildren() { return max_children; }
+	/// name id of "(other)", or 0 if SetLimits() hasn't been called
+	static int GetOtherNameId() { return other_name_id; }
+
+	/// return the id for the given section name, allocating a new one if necessary. ids start at 1.
+	static int InternName( const std::string& name );
+	/// return the section name for the given id
+	static std::string GetName( int name_id );
+	/// return the number of interned names; valid ids are 1..GetNameCount()
+	static int GetNameCount();
 
 private:
 
-    // for efficiency: avoid re-allocating
-    static DTime end_time;
+    /// slow path for GetContext(): reset the calling thread's context after
+    /// a Clear(), or register one if it has none
+    static DProfileContext* UpdateContext();
+    /// create and register a context for this thread
+    static DProfileContext* RegisterContext();
+    /// slow paths for SectionPush() and SectionPop(). index is the section
+    /// being pushed, or DProfileContext::NO_SECTION if the push is dropped.
+    static void SectionPushSlow( DProfileContext* context, uint32_t index, const DProfileSectionDescriptor* site );
+    static void SectionPopSlow( DProfileContext* context );
+    /// fold context into retired and recycle it. call on context's own thread.
+    static void RetireContext( DProfileContext* context );
+    /// pthread key destructor: the thread owning context is exiting
+    static void OnThreadExit( void* context );
+    static void CreateThreadKey();
+
+    /// recursively display the children of the given section
+    static void DisplaySection( const DProfileThreadSnapshot& thread, uint32_t index, const std::string& prefix, SORT_BY sort_by,
+                                bool show_frames, bool show_stats, bool show_counters, bool show_overhead );
+    /// add one timed call of ticks to section index of context. call from
+    /// the owning thread.
+    /// counter_deltas, if given, are the hardware counter deltas for the call.
+    static void AddTimedCall( DProfileContext* context, uint32_t index, uint64_t ticks, const uint64_t* counter_deltas = NULL );
+    /// read the hardware counters at the start of a timed call of section
+    /// index, opening them first if need be
+    static void StartCounters( DProfileContext* context, uint32_t index );
+    /// fill deltas with the counters for the timed call of section index
+    /// that is ending. returns false if there are none for this call.
+    static bool StopCounters( DProfileContext* context, uint32_t index, uint64_t* deltas );
+
+    // per-thread cached context
+    static DPROFILE_THREAD_LOCAL DProfileContext* thread_context;
+    // see SetInternalAllocation()
+    static thread_local bool internal_allocation;
+    // bumped by Clear(). each thread resets its own context when it notices.
+    static std::atomic<unsigned> generation;
+
+    static std::atomic<bool> statistics_enabled;
+    static std::atomic<bool> counters_enabled;
+    static std::atomic<bool> allocation_tracking_enabled;
+    static std::atomic<bool> tracing_enabled;
+    static std::atomic<bool> overhead_correction_enabled;
+    // from Calibrate(). guarded by lock.
+    static DProfileOverhead overhead;
+    /// the body of Calibrate(), on its own thread
+    static void* CalibrateThread( void* arg );
+    static TRACE_POLICY trace_policy;
+    static uint32_t trace_capacity;
+    /// give context a trace ring if it doesn't have one. call with lock held.
+    static void AllocateTrace( DProfileContext* context );
+    /// rings detached from contexts by RetireContext(), with the thread that
+    /// recorded them, until DrainTrace() has emptied and deleted them.
+    /// guarded by lock.
+    struct DRetiredTrace
+    {
+        DTraceThread thread;
+        DTraceBuffer* trace;
+    };
+    static std::vector<DRetiredTrace> retired_traces;
+    /// summarise section index of history into out. call with frames_lock held.
+    static void SummarizeFrames( DProfileFrameHistory* history, uint32_t index, DProfileFrameSummary& out );
+    static uint32_t frame_history_size;
+    static std::atomic<uint64_t> frame_count;
+    // see SetLimits()
+    static uint32_t max_sections;
+    static uint32_t max_children;
+    static uint32_t max_names;
+    static int other_name_id;
+    /// as InternName(), but once there are max_names names, new ones get other_name_id
+    static int InternLabel( const std::string& name );
+    // guards every context's frame_history. taken before lock, never after.
+    static DMutex frames_lock;
+
+    static std::atomic<uint32_t> category_mask;
+    static std::atomic<uint32_t> category_sample_rates[32];
+    static SAMPLING_MODE sampling_mode;
 
 
 	typedef std::vector<DProfileContext*> DProfileContexts;
+	/// live contexts, in registration order
 	static DProfileContexts contexts;
+	/// contexts whose threads have exited, for reuse. never deleted, so that
+	/// readers working off-lock never see freed memory.
+	static DProfileContexts free_contexts;
+	static int next_thread_index;
+	/// sum of the retired threads' trees since the last Clear()
+	static DProfileThreadSnapshot retired;
+	static DProfileTreeMerger* retired_merger;
+	// guards retired. never held together with lock.
+	static DMutex retired_lock;
+	static pthread_key_t thread_key;
+	static pthread_once_t thread_key_once;
+
+	static DMutex lock;
 
-	static DSemaphore lock;
+	// interned section names. names[id-1] is the name for id.
+	typedef std::map<std::string, int> DNameIds;
+	static DNameIds name_ids;
+	static std::vector<std::string> names;
+	// separate from lock so that names can be resolved while lock is held
+	static DMutex names_lock;
 };
 
-// one section
-class DProfileSection {
-public:
-	DProfileSection();
-	~DProfileSection();
 
-	void Display( const std::string& prefix, DProfiler::SORT_BY sort_by );
 
-	int call_count;
-	double avg_time;
-	int exec_order_id;
-	static int EXEC_ORDER_ID;
 
-	DTime timer;
-//	LARGE_INTEGER start_time;
+// the hot path, inline so that it is compiled into the call sites
 
-	DProfileSection* parent;
-	std::string name;
+DPROFILE_INLINE DProfileContext* DProfiler::GetContext()
+{
+	DProfileContext* context = thread_context;
+	if ( context && context->generation.load( std::memory_order_relaxed ) == generation.load( std::memory_order_acquire ) )
+		return context;
+	return UpdateContext();
+}
 
-	// map of sections
-	typedef std::map<const std::string, DProfileSection* > DProfileSections;
+DPROFILE_INLINE void DProfiler::SectionPush( int name_id, const DProfileSectionDescriptor* site )
+{
+	DProfileContext* context = GetContext();
 
-	// don't try this at home
-	/*struct less_than_comparator : public std::binary_function<const ProfileSection*,const ProfileSection*,bool>
-	{
-		result_type operator() ( first_argument_type a, second_argument_type b )
+	// now and then, note which CPU we're on. only at toplevel pushes, so a
+	// thread that stays inside one long toplevel section keeps the CPU it
+	// was last seen on at one of those, however it migrates meanwhile
+	if ( context->current == 0 && --context->cpu_countdown == 0 )
+		context->RecordCPU();
+
+	// below a dropped push, everything is dropped until it pops
+	uint32_t index = context->overflow_depth ? DProfileContext::NO_SECTION : context->GetChild( context->current, name_id, site );
+	if ( index == DProfileContext::NO_SECTION || ( site && GetSampleRate( *site ) > 1 ) || context->Section( index ).sample_rate > 1
+		|| GetCountersEnabled() || GetTracingEnabled() )
 	{
-			return ( a->avg_time * a->call_count < b->avg_time*b->call_count );
+		SectionPushSlow( context, index, site );
+		return;
 	}
-	};*/
-	DProfileSections children;
 
+	context->current = index;
+	context->Section( index ).start_ticks = DTime::GetTicks();
+}
 
-};
+DPROFILE_INLINE void DProfiler::SectionPop()
+{
+	DProfileContext* context = GetContext();
+	uint32_t index = context->current;
+	if ( context->overflow_depth || index == 0 || context->Section( index ).start_ticks == 0
+		|| context->Section( index ).sample_rate > 1 || GetStatisticsEnabled() || GetCountersEnabled() || GetTracingEnabled() )
+	{
+		SectionPopSlow( context );
+		return;
+	}
 
+	// this must stay a local: threads pop concurrently.
+	uint64_t end_ticks = DTime::GetTicks();
+	DProfileSection& s = context->Section( index );
+	s.BeginUpdate();
+	s.call_count++;
+	s.total_ticks += end_ticks - s.start_ticks;
+	s.timed_count++;
+	s.EndUpdate();
+	context->current = s.parent;
+}
 
 
 
@@ -200,12 +1041,44 @@ public:
 class FFunctionProfiler
 {
 public:
-	FFunctionProfiler( const char* function_name )
-	{	DProfiler::SectionPush(function_name);	}
+	FFunctionProfiler( DProfileSectionDescriptor& site )
+	{	DProfiler::SectionPush(site);	}
+	FFunctionProfiler( const std::string& name )
+	{	DProfiler::SectionPush(name);	}
 	~FFunctionProfiler()
 	{	DProfiler::SectionPop(); }
 };
 
+/** FCategoryProfiler
+
+  as FFunctionProfiler, for sections with a category. ENABLED is whether the
+  category was compiled in; if not, this is an empty object and the section
+  costs nothing. otherwise the runtime category mask is checked before
+  anything else happens.
+
+*/
+
+template <bool ENABLED> class FCategoryProfiler
+{
+public:
+	FCategoryProfiler( DProfileSectionDescriptor& site )
+	{
+		pushed = DProfiler::IsCategoryEnabled( site.category );
+		if ( pushed )
+			DProfiler::SectionPush( site );
+	}
+	~FCategoryProfiler()
+	{	if ( pushed ) DProfiler::SectionPop(); }
+private:
+	bool pushed;
+};
+
+template <> class FCategoryProfiler<false>
+{
+public:
+	FCategoryProfiler( DProfileSectionDescriptor& ) {}
+};
+
 
 
 #endif
@@ -0,0 +1,125 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** DProfilerAlloc
+
+ replaces the global operator new and delete with versions that charge
+ each allocation to the calling thread's current section, while
+ DProfiler::EnableAllocationTracking() is on. it's a separate file so that
+ only programs that want the hooks get them: add it to the build alongside
+ the profiler sources.
+
+ memory still comes from malloc() and goes back to free(). allocations
+ made with malloc() directly, eg by C libraries, aren't seen.
+
+*/
+
+#include "DProfiler.h"
+
+#include <new>
+#include <stdlib.h>
+
+static inline void* Allocate( size_t size )
+{
+	if ( size == 0 )
+		size = 1;
+	// anything the profiler allocates while recording goes straight to
+	// malloc(), as does its own bookkeeping
+	if ( !DProfiler::GetAllocationTrackingEnabled() || DProfiler::SetInternalAllocation( true ) )
+		return malloc( size );
+	uint64_t start = DTime::GetTicks();
+	void* p = malloc( size );
+	DProfiler::RecordAllocation( size, DTime::GetTicks() - start );
+	DProfiler::SetInternalAllocation( false );
+	return p;
+}
+
+static inline void Free( void* p )
+{
+	if ( !p )
+		return;
+	if ( !DProfiler::GetAllocationTrackingEnabled() || DProfiler::SetInternalAllocation( true ) )
+	{
+		free( p );
+		return;
+	}
+	uint64_t start = DTime::GetTicks();
+	free( p );
+	DProfiler::RecordFree( DTime::GetTicks() - start );
+	DProfiler::SetInternalAllocation( false );
+}
+
+void* operator new( size_t size )
+{
+	void* p = Allocate( size );
+	if ( !p )
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[]( size_t size )
+{
+	void* p = Allocate( size );
+	if ( !p )
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) noexcept
+{
+	return Allocate( size );
+}
+
+void* operator new[]( size_t size, const std::nothrow_t& ) noexcept
+{
+	return Allocate( size );
+}
+
+void operator delete( void* p ) noexcept
+{
+	Free( p );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+	Free( p );
+}
+
+void operator delete( void* p, const std::nothrow_t& ) noexcept
+{
+	Free( p );
+}
+
+void operator delete[]( void* p, const std::nothrow_t& ) noexcept
+{
+	Free( p );
+}
+
+#if __cpp_sized_deallocation
+void operator delete( void* p, size_t ) noexcept
+{
+	Free( p );
+}
+
+void operator delete[]( void* p, size_t ) noexcept
+{
+	Free( p );
+}
+#endif
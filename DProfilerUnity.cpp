@@ -0,0 +1,51 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** DProfilerUnity
+
+ the whole profiler as a single translation unit. compile this file instead
+ of the separate sources (make unity), so the compiler sees all of it at
+ once, or #include it at the end of one of your own source files: calls to
+ DProfiler::SectionPush() and SectionPop() made in that file can then be
+ inlined into their call sites without link-time optimisation, eg
+
+    #define PROFILE
+    #include "DProfiler.h"
+    ... code using PROFILE_THIS_BLOCK() etc
+    #include "DProfilerUnity.cpp"
+
+ include it in one file per program only. DProfilerAlloc.cpp, which
+ replaces the global operator new and delete, is left out: add it
+ separately if you want allocation tracking.
+
+*/
+
+#include "DProfiler.cpp"
+#include "DTime.cpp"
+#include "DThread.cpp"
+#include "DTrace.cpp"
+#include "DTraceExport.cpp"
+#include "DProfileDump.cpp"
+#include "DProfileSnapshot.cpp"
+#include "DSemaphore.cpp"
+#include "DThreadPool.cpp"
+#include "DProfileScope.cpp"
+#include "DPerfCounters.cpp"
+#include "DProfileReporter.cpp"
@@ -0,0 +1,124 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DSemaphore.h"
+#include "DMutex.h"
+#include "DProfiler.h"
+
+// named semaphores, in creation order. DMutex is constant-initialised, so
+// this works for static semaphores constructed before main().
+static DMutex named_lock;
+static DSemaphore* first_named = NULL;
+static DSemaphore* last_named = NULL;
+
+void DSemaphore::Register()
+{
+	named_lock.Lock();
+	prev_named = last_named;
+	next_named = NULL;
+	if ( last_named )
+		last_named->next_named = this;
+	else
+		first_named = this;
+	last_named = this;
+	named_lock.Unlock();
+}
+
+void DSemaphore::Unregister()
+{
+	named_lock.Lock();
+	if ( prev_named )
+		prev_named->next_named = next_named;
+	else
+		first_named = next_named;
+	if ( next_named )
+		next_named->prev_named = prev_named;
+	else
+		last_named = prev_named;
+	named_lock.Unlock();
+}
+
+uint32_t DSemaphore::GetNameId()
+{
+	// racing threads intern the same name, so both get the same id
+	uint32_t id = name_id.load( std::memory_order_relaxed );
+	if ( id == 0 )
+	{
+		id = DProfiler::InternName( name );
+		name_id.store( id, std::memory_order_relaxed );
+	}
+	return id;
+}
+
+void DSemaphore::TraceWait( uint64_t start, uint64_t end )
+{
+	if ( !DProfiler::GetTracingEnabled() )
+		return;
+	uint32_t id = GetNameId();
+	DProfiler::RecordTraceEvent( DTraceEvent::WAIT_BEGIN, id, start );
+	DProfiler::RecordTraceEvent( DTraceEvent::WAIT_END, id, end );
+}
+
+void DSemaphore::TraceSignal()
+{
+	if ( DProfiler::GetTracingEnabled() )
+		DProfiler::RecordTraceEvent( DTraceEvent::SIGNAL, GetNameId(), DTime::GetTicks() );
+}
+
+void DSemaphore::GetStats( DSemaphoreStats& out ) const
+{
+	out.name = name;
+	out.acquires = acquires.load( std::memory_order_relaxed );
+	out.contended = contended.load( std::memory_order_relaxed );
+	out.total_wait_ticks = total_wait_ticks.load( std::memory_order_relaxed );
+	out.max_wait_ticks = max_wait_ticks.load( std::memory_order_relaxed );
+	out.total_hold_ticks = total_hold_ticks.load( std::memory_order_relaxed );
+	out.max_hold_ticks = max_hold_ticks.load( std::memory_order_relaxed );
+}
+
+void DSemaphore::ResetStats()
+{
+	acquires.store( 0, std::memory_order_relaxed );
+	contended.store( 0, std::memory_order_relaxed );
+	total_wait_ticks.store( 0, std::memory_order_relaxed );
+	max_wait_ticks.store( 0, std::memory_order_relaxed );
+	total_hold_ticks.store( 0, std::memory_order_relaxed );
+	max_hold_ticks.store( 0, std::memory_order_relaxed );
+	// not acquired_ticks: the semaphore may be held right now
+}
+
+void DSemaphore::GetAllStats( std::vector<DSemaphoreStats>& out )
+{
+	named_lock.Lock();
+	for ( DSemaphore* s = first_named; s; s = s->next_named )
+	{
+		out.push_back( DSemaphoreStats() );
+		s->GetStats( out.back() );
+	}
+	named_lock.Unlock();
+}
+
+void DSemaphore::ResetAllStats()
+{
+	named_lock.Lock();
+	for ( DSemaphore* s = first_named; s; s = s->next_named )
+		s->ResetStats();
+	named_lock.Unlock();
+}
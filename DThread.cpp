@@ -19,59 +19,236 @@
  */
  
 #include "DThread.h"
+#include "DProfiler.h"
 #include <pthread.h>
 #include <sys/errno.h>
 #include <signal.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+void * DThread::run_function(void * objPtr){
+    DThread* the_DThread = (DThread*)objPtr;
+
+#ifdef __linux__
+    // before anything is allocated, so that the profiler context (and the
+    // stack pages, as they're touched) come from the preferred node
+    int node = the_DThread->attributes.numa_node;
+    if ( node >= 0 )
+    {
+        unsigned long mask[16] = { 0 };
+        if ( node < (int)( sizeof(mask)*8 ) )
+        {
+            mask[node/( sizeof(unsigned long)*8 )] |= 1ul << ( node%( sizeof(unsigned long)*8 ) );
+            if ( syscall( SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask)*8 ) != 0 )
+                fprintf(stderr, "DThread %p: couldn't prefer NUMA node %i: %s\n", (void*)the_DThread, node, strerror( errno ) );
+        }
+    }
+#endif
+
+#ifdef PROFILE
+    DProfiler::RegisterThread( the_DThread->thread_name );
+#endif
+
+    while( !the_DThread->thread_should_stop )
+        the_DThread->ThreadedFunction();
+
+    the_DThread->thread_running = false;
+
+    pthread_exit(0);
+    return 0;
+}
 
 void DThread::StartThread( int thread_priority )
+{
+    DThreadAttributes attributes;
+    if ( thread_priority > 0 )
+    {
+        printf("DThread %p attempting to set thread priority to %i\n", (void*)this, thread_priority );
+        attributes.sched_policy = SCHED_RR;
+        attributes.sched_priority = thread_priority;
+    }
+    if ( !StartThread( attributes ) && thread_priority > 0 && !thread_running )
+    {
+        // as before: without the privileges for SCHED_RR, run anyway
+        fprintf(stderr, "DThread %p: starting with default scheduling instead\n", (void*)this );
+        StartThread( DThreadAttributes() );
+    }
+}
+
+bool DThread::StartThread( const DThreadAttributes& _attributes )
 {
 	if ( thread_running ) {
-	    printf("DThread::Start(): DThread %x already running\n", this );
-        return;
+	    printf("DThread::Start(): DThread %p already running\n", (void*)this );
+        return false;
 	}
 	thread_should_stop = false;
+    attributes = _attributes;
 
     pthread_attr_t thread_attr;
     pthread_attr_init(&thread_attr);
     pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
-    // launch
-	int result = pthread_create( &the_thread, &thread_attr, run_function, this );
-    if ( result != 0 )
+
+    int res = 0;
+    const char* what = "";
+    if ( attributes.stack_size > 0 )
     {
-        fprintf(stderr, "DThread %x: pthread_create failed with error %i\n", this, result );
+        size_t stack_size = attributes.stack_size;
+        if ( stack_size < (size_t)PTHREAD_STACK_MIN )
+            stack_size = PTHREAD_STACK_MIN;
+        long page = sysconf( _SC_PAGESIZE );
+        stack_size = ( stack_size + page-1 ) / page * page;
+        res = pthread_attr_setstacksize( &thread_attr, stack_size );
+        what = "set stack size";
     }
-    // priority
-    if ( thread_priority > 0 )
+    if ( res == 0 && attributes.sched_policy >= 0 )
     {
-        printf("DThread %x attempting to set thread priority to %i\n", this ,thread_priority );
+        // applied at creation, rather than racing the new thread afterwards
         struct sched_param param;
-        param.sched_priority = thread_priority;
-        int res = pthread_setschedparam( the_thread, SCHED_RR, &param );
-        if ( res != 0 )
+        param.sched_priority = attributes.sched_priority;
+        res = pthread_attr_setinheritsched( &thread_attr, PTHREAD_EXPLICIT_SCHED );
+        if ( res == 0 )
+            res = pthread_attr_setschedpolicy( &thread_attr, attributes.sched_policy );
+        if ( res == 0 )
+            res = pthread_attr_setschedparam( &thread_attr, &param );
+        what = "set scheduling";
+    }
+    std::vector<int> cpus = attributes.cpus;
+    if ( cpus.empty() && attributes.numa_node >= 0 && !GetNUMANodeCPUs( attributes.numa_node, cpus ) )
+        fprintf(stderr, "DThread %p: couldn't find the CPUs of NUMA node %i\n", (void*)this, attributes.numa_node );
+    if ( res == 0 && !cpus.empty() )
+    {
+#if defined(__linux__) && defined(CPU_SET)
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        for ( size_t i=0; i<cpus.size(); i++ )
         {
-            fprintf(stderr,"pthread_setschedparam failed: %s\n",
-                   (res == ENOSYS) ? "ENOSYS" :
-                   (res == EINVAL) ? "EINVAL" :
-                   (res == ENOTSUP) ? "ENOTSUP" :
-                   (res == EPERM) ? "EPERM" :
-                   (res == ESRCH) ? "ESRCH" :
-                   "???"
-                   );
+            if ( cpus[i] >= 0 && cpus[i] < CPU_SETSIZE )
+                CPU_SET( cpus[i], &set );
         }
+        res = pthread_attr_setaffinity_np( &thread_attr, sizeof(set), &set );
+        what = "set CPU affinity";
+#else
+        fprintf(stderr, "DThread %p: CPU affinity is not supported on this platform, ignoring\n", (void*)this );
+#endif
+    }
+    if ( res != 0 )
+    {
+        fprintf(stderr, "DThread %p: couldn't %s: %s\n", (void*)this, what, strerror( res ) );
+        pthread_attr_destroy( &thread_attr );
+        return false;
     }
 
+    // launch. running before the thread can exit and clear it.
+    thread_running = true;
+	int result = pthread_create( &the_thread, &thread_attr, run_function, this );
     pthread_attr_destroy( &thread_attr );
+    if ( result != 0 )
+    {
+        fprintf(stderr, "DThread %p: pthread_create failed with error %i (%s)\n", (void*)this, result, strerror( result ) );
+        thread_running = false;
+        return false;
+    }
+    return true;
+}
+
+#ifdef __linux__
+// the NUMA node of each CPU, or -1, read from sysfs once
+static std::vector<int> cpu_nodes;
+static pthread_once_t cpu_nodes_once = PTHREAD_ONCE_INIT;
+
+static void ReadCPUNodes()
+{
+    std::vector<int> nodes, cpus;
+    if ( !DThread::ReadCPUList( "/sys/devices/system/node/possible", nodes ) )
+        return;
+    for ( size_t i=0; i<nodes.size(); i++ )
+    {
+        if ( !DThread::GetNUMANodeCPUs( nodes[i], cpus ) )
+            continue;
+        for ( size_t j=0; j<cpus.size(); j++ )
+        {
+            if ( cpus[j] >= (int)cpu_nodes.size() )
+                cpu_nodes.resize( cpus[j]+1, -1 );
+            cpu_nodes[cpus[j]] = nodes[i];
+        }
+    }
+}
+#endif
+
+int DThread::GetCurrentCPU( int* node )
+{
+#ifdef __linux__
+    // sched_getcpu() is answered by the vDSO (or rseq), not a system call
+    int cpu = sched_getcpu();
+    if ( cpu >= 0 )
+    {
+        if ( node )
+        {
+            pthread_once( &cpu_nodes_once, ReadCPUNodes );
+            *node = cpu < (int)cpu_nodes.size() ? cpu_nodes[cpu] : -1;
+        }
+        return cpu;
+    }
+#endif
+    if ( node )
+        *node = -1;
+    return -1;
+}
+
+bool DThread::GetNUMANodeCPUs( int node, std::vector<int>& cpus )
+{
+#ifdef __linux__
+    char path[128];
+    snprintf( path, 128, "/sys/devices/system/node/node%i/cpulist", node );
+    return ReadCPUList( path, cpus );
+#else
+    cpus.clear();
+    return false;
+#endif
+}
 
-	thread_running = true;
+bool DThread::ReadCPUList( const char* path, std::vector<int>& cpus )
+{
+    cpus.clear();
+#ifdef __linux__
+    // eg "0-3,8-11"
+    FILE* f = fopen( path, "r" );
+    if ( !f )
+        return false;
+    int first, last;
+    char separator;
+    while ( fscanf( f, "%d", &first ) == 1 )
+    {
+        last = first;
+        if ( fscanf( f, "%c", &separator ) == 1 && separator == '-' )
+        {
+            if ( fscanf( f, "%d", &last ) != 1 )
+                break;
+            if ( fscanf( f, "%c", &separator ) != 1 )
+                separator = 0;
+        }
+        for ( int cpu=first; cpu<=last; cpu++ )
+            cpus.push_back( cpu );
+        if ( separator != ',' )
+            break;
+    }
+    fclose( f );
+#endif
+    return !cpus.empty();
 }
 
 void DThread::StopThread()
 {
 	if ( !thread_running ) {
-	    printf("DThread::Stop(): DThread %x not running\n", this );
+	    printf("DThread::Stop(): DThread %p not running\n", (void*)this );
         return;
 	}
-	printf("stopping DThread %x\n", this );
+	printf("stopping DThread %p\n", (void*)this );
 	thread_should_stop = true;
 	void * ret;
 	pthread_join( the_thread, &ret );
@@ -22,21 +22,64 @@
 #define _THREAD_H
 
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string>
+#include <vector>
+
+/** DThreadAttributes
+
+ how to start a DThread. everything is applied through pthread_attr_t
+ before the thread launches, so the thread never runs with the wrong
+ scheduling or on the wrong CPU, and DThread::StartThread() fails rather
+ than carrying on if any of it can't be applied.
+
+ numa_node makes the thread prefer memory on that node (set_mempolicy) before
+ running anything, so its stack pages and its profiler context are
+ allocated there; if cpus is empty it is also pinned to that node's CPUs.
+ affinity and NUMA are Linux only, and ignored with a warning elsewhere.
+
+*/
+
+class DThreadAttributes
+{
+public:
+	DThreadAttributes() : sched_policy( -1 ), sched_priority( 0 ), stack_size( 0 ), numa_node( -1 ) {}
+
+	/// CPUs the thread may run on. empty for any.
+	std::vector<int> cpus;
+	/// SCHED_OTHER, SCHED_FIFO or SCHED_RR, or -1 to inherit the creating
+	/// thread's. real-time policies usually need root.
+	int sched_policy;
+	int sched_priority;
+	/// in bytes. 0 for the system default.
+	size_t stack_size;
+	/// -1 for no preference
+	int numa_node;
+};
 
 /** base class for threads */
 
 class DThread
 {
 public:
-    DThread( ) { thread_running = false; }
+    DThread( ) : thread_name( "DThread" ) { thread_running = false; }
     virtual ~DThread() { if ( thread_running ) StopThread(); }
 
+    /// name for the thread in profiler reports. takes effect on the next StartThread().
+    void SetThreadName( const std::string& name ) { thread_name = name; }
+
     /// start running the ThreadedFunction. thread_priority only takes effect if running as root.
+    /// when built with PROFILE, the new thread registers itself with DProfiler by name.
     void StartThread( int thread_priority = 0 ) ;
+    /// start running the ThreadedFunction with the given attributes. returns
+    /// false, with a message on stderr, if the thread couldn't be started
+    /// exactly as asked.
+    bool StartThread( const DThreadAttributes& attributes );
     /// stop running ThreadedFunction
     void StopThread();
+    bool IsRunning() const { return thread_running; }
 
 protected:
 
@@ -46,21 +89,25 @@ protected:
 
 
     /// called internally
-    static void * run_function(void * objPtr){
-        DThread* the_DThread = (DThread*)objPtr;
+    static void * run_function(void * objPtr);
 
-        while( !the_DThread->thread_should_stop )
-            the_DThread->ThreadedFunction();
-
-        the_DThread->thread_running = false;
+public:
+    /// return the CPU the calling thread is running on, and its NUMA node in
+    /// node if given, or -1 if unknown
+    static int GetCurrentCPU( int* node = NULL );
+    /// fill cpus with the CPUs of the given NUMA node. returns false if unknown.
+    static bool GetNUMANodeCPUs( int node, std::vector<int>& cpus );
+    /// fill cpus with the numbers in a sysfs CPU list file, such as
+    /// "0-3,8-11". returns false if there are none.
+    static bool ReadCPUList( const char* path, std::vector<int>& cpus );
 
-        pthread_exit(0);
-        return 0;
-    }
+protected:
 
     pthread_t the_thread;
     bool thread_running;
     bool thread_should_stop;
+    std::string thread_name;
+    DThreadAttributes attributes;
 
 };
 
@@ -0,0 +1,273 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DThreadPool.h"
+#include "DMutex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <deque>
+#include <new>
+
+class DThreadPoolWorker : public DThread
+{
+public:
+	DThreadPoolWorker( DThreadPool* _pool, size_t _index ) : index( _index ), pool( _pool ) {}
+
+	// DMutex is cache line aligned, which plain new only honours from C++17
+	static void* operator new( size_t size )
+	{
+		void* p;
+		if ( posix_memalign( &p, DMUTEX_CACHE_LINE, size ) != 0 )
+			throw std::bad_alloc();
+		return p;
+	}
+	static void operator delete( void* p ) { free( p ); }
+
+	/// in DThreadPool::workers
+	size_t index;
+
+	// guards queue. the owner pushes and pops at the back, thieves take
+	// from the front.
+	DMutex queue_lock;
+	std::deque<DThreadPool::Job> queue;
+
+protected:
+	void ThreadedFunction();
+
+private:
+	DThreadPool* pool;
+};
+
+// the worker running on this thread, if any
+static thread_local DThreadPoolWorker* current_worker = NULL;
+
+void DThreadPoolWorker::ThreadedFunction()
+{
+	current_worker = this;
+	DThreadPool::Job job;
+	if ( pool->Take( this, job ) )
+		pool->Run( job );
+	else
+		pool->Park();
+}
+
+
+
+DThreadPool::DThreadPool( const std::string& _name )
+	: name( _name ), wait_label( _name + " queue wait" ),
+	  wait_site( wait_label.c_str(), __FILE__, __LINE__, PROFILE_CAT_THREADS ),
+	  next_worker( 0 ), queued( 0 ), outstanding( 0 ), sleepers( 0 ), stopping( false ),
+	  submitted( 0 ), completed( 0 ), stolen( 0 ), parks( 0 )
+{
+	pthread_mutex_init( &park_mutex, NULL );
+	pthread_cond_init( &work_ready, NULL );
+	pthread_cond_init( &idle, NULL );
+}
+
+DThreadPool::~DThreadPool()
+{
+	Stop();
+	pthread_cond_destroy( &idle );
+	pthread_cond_destroy( &work_ready );
+	pthread_mutex_destroy( &park_mutex );
+}
+
+void DThreadPool::Start( int num_workers, const DThreadAttributes& attributes )
+{
+	if ( !workers.empty() )
+	{
+		printf("DThreadPool::Start(): %s already running\n", name.c_str() );
+		return;
+	}
+	if ( num_workers <= 0 )
+		num_workers = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( num_workers <= 0 )
+		num_workers = 1;
+
+	stopping = false;
+	for ( int i=0; i<num_workers; i++ )
+	{
+		DThreadPoolWorker* worker = new DThreadPoolWorker( this, i );
+		char buf[32];
+		snprintf( buf, 32, " %i", i );
+		worker->SetThreadName( name + buf );
+		workers.push_back( worker );
+	}
+	// start them once the vector won't change, since they read it to steal
+	for ( size_t i=0; i<workers.size(); i++ )
+	{
+		if ( !workers[i]->StartThread( attributes ) )
+		{
+			// tasks queued for a missing worker would only run if stolen
+			fprintf(stderr, "DThreadPool %s: worker %i didn't start, stopping\n", name.c_str(), (int)i );
+			Stop();
+			return;
+		}
+	}
+}
+
+void DThreadPool::Stop()
+{
+	if ( workers.empty() )
+		return;
+	Wait();
+
+	pthread_mutex_lock( &park_mutex );
+	stopping = true;
+	pthread_cond_broadcast( &work_ready );
+	pthread_mutex_unlock( &park_mutex );
+	for ( size_t i=0; i<workers.size(); i++ )
+	{
+		if ( workers[i]->IsRunning() )
+			workers[i]->StopThread();
+		delete workers[i];
+	}
+	workers.clear();
+}
+
+void DThreadPool::Submit( DThreadPoolTask* task, DProfileSectionDescriptor* section )
+{
+	Job job;
+	job.task = task;
+	job.section = section;
+	job.submit_ticks = DTime::GetTicks();
+	submitted.fetch_add( 1, std::memory_order_relaxed );
+	outstanding.fetch_add( 1 );
+	if ( workers.empty() )
+	{
+		Run( job );
+		return;
+	}
+
+	DThreadPoolWorker* worker = current_worker;
+	if ( !worker || worker->index >= workers.size() || workers[worker->index] != worker )
+		worker = workers[next_worker.fetch_add( 1, std::memory_order_relaxed ) % workers.size()];
+	worker->queue_lock.Lock();
+	worker->queue.push_back( job );
+	worker->queue_lock.Unlock();
+
+	// pairs with Park(): either it sees queued > 0, or we see it sleeping
+	queued.fetch_add( 1 );
+	if ( sleepers.load() > 0 )
+	{
+		pthread_mutex_lock( &park_mutex );
+		pthread_cond_signal( &work_ready );
+		pthread_mutex_unlock( &park_mutex );
+	}
+}
+
+bool DThreadPool::Take( DThreadPoolWorker* worker, Job& job )
+{
+	worker->queue_lock.Lock();
+	bool found = !worker->queue.empty();
+	if ( found )
+	{
+		job = worker->queue.back();
+		worker->queue.pop_back();
+	}
+	worker->queue_lock.Unlock();
+
+	// steal, starting from our neighbour so that thieves spread out
+	size_t count = workers.size();
+	for ( size_t i=1; i<count && !found; i++ )
+	{
+		// don't queue up behind another thief
+		DThreadPoolWorker* victim = workers[( worker->index+i ) % count];
+		if ( !victim->queue_lock.TryLock() )
+			continue;
+		found = !victim->queue.empty();
+		if ( found )
+		{
+			job = victim->queue.front();
+			victim->queue.pop_front();
+			stolen.fetch_add( 1, std::memory_order_relaxed );
+		}
+		victim->queue_lock.Unlock();
+	}
+
+	if ( found )
+		queued.fetch_sub( 1 );
+	return found;
+}
+
+void DThreadPool::Run( const Job& job )
+{
+#ifdef PROFILE
+	uint64_t start = DTime::GetTicks();
+	if ( DProfiler::IsCategoryEnabled( wait_site.category ) )
+		DProfiler::SectionRecord( wait_site, start - job.submit_ticks );
+	if ( job.section )
+		DProfiler::SectionPush( *job.section );
+#endif
+
+	job.task->Run();
+
+#ifdef PROFILE
+	if ( job.section )
+		DProfiler::SectionPop();
+#endif
+
+	completed.fetch_add( 1, std::memory_order_relaxed );
+	if ( outstanding.fetch_sub( 1 ) == 1 )
+	{
+		pthread_mutex_lock( &park_mutex );
+		pthread_cond_broadcast( &idle );
+		pthread_mutex_unlock( &park_mutex );
+	}
+}
+
+void DThreadPool::Park()
+{
+	pthread_mutex_lock( &park_mutex );
+	sleepers.fetch_add( 1 );
+	if ( queued.load() == 0 && !stopping )
+	{
+		parks.fetch_add( 1, std::memory_order_relaxed );
+		while ( queued.load() == 0 && !stopping )
+			pthread_cond_wait( &work_ready, &park_mutex );
+	}
+	sleepers.fetch_sub( 1 );
+	pthread_mutex_unlock( &park_mutex );
+	if ( stopping )
+	{
+		// DThread calls us again until StopThread() sets thread_should_stop
+		sched_yield();
+	}
+}
+
+void DThreadPool::Wait()
+{
+	pthread_mutex_lock( &park_mutex );
+	while ( outstanding.load() > 0 )
+		pthread_cond_wait( &idle, &park_mutex );
+	pthread_mutex_unlock( &park_mutex );
+}
+
+DThreadPoolStats DThreadPool::GetStats() const
+{
+	DThreadPoolStats out;
+	out.submitted = submitted.load( std::memory_order_relaxed );
+	out.completed = completed.load( std::memory_order_relaxed );
+	out.stolen = stolen.load( std::memory_order_relaxed );
+	out.parks = parks.load( std::memory_order_relaxed );
+	return out;
+}
@@ -0,0 +1,152 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DThreadPool_H
+#define _DThreadPool_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "DProfiler.h"
+
+/** DThreadPool
+
+ a fixed set of DThread workers running submitted tasks. each worker has
+ its own deque: it takes its newest task first, and when its deque is empty
+ it steals the oldest task from another worker. workers with nothing to do
+ sleep on a condition variable rather than spinning, and are woken by
+ Submit().
+
+ a task submitted with a section descriptor runs inside that section on the
+ worker, so with PROFILE defined each worker's tree shows the time spent in
+ each kind of task, and beside it "<pool name> queue wait": how long tasks
+ sat queued before a worker picked them up (with DProfiler statistics
+ enabled, its percentiles are the pool's scheduling latency). workers
+ register with DProfiler as "<pool name> <n>"; Display( SORT_TIME, true )
+ sums them. the queue wait section is in PROFILE_CAT_THREADS.
+
+ usage:
+
+    class ResizeTask : public DThreadPoolTask
+    {
+        void Run() { .. work; delete this; }
+    };
+
+    static DProfileSectionDescriptor resize_site( "resize", __FILE__, __LINE__ );
+    DThreadPool pool( "image workers" );
+    pool.Start();
+    for ( .. )
+        pool.Submit( new ResizeTask( .. ), &resize_site );
+    pool.Wait();
+
+*/
+
+class DThreadPoolTask
+{
+public:
+	virtual ~DThreadPoolTask() {}
+	/// called once on a worker thread. the pool doesn't own the task: Run()
+	/// may delete it.
+	virtual void Run() = 0;
+};
+
+class DThreadPoolStats
+{
+public:
+	uint64_t submitted;
+	uint64_t completed;
+	/// tasks taken from another worker's deque
+	uint64_t stolen;
+	/// times a worker went to sleep for lack of work
+	uint64_t parks;
+};
+
+class DThreadPoolWorker;
+
+class DThreadPool
+{
+public:
+	DThreadPool( const std::string& _name = "DThreadPool" );
+	/// calls Stop()
+	~DThreadPool();
+
+	/// start num_workers workers (0 for one per CPU), each started with
+	/// attributes (eg to keep the pool on one NUMA node)
+	void Start( int num_workers = 0, const DThreadAttributes& attributes = DThreadAttributes() );
+	/// wait for every queued task to finish, then stop the workers
+	void Stop();
+	int GetWorkerCount() const { return workers.size(); }
+
+	/// queue task to be run on a worker, as section if given. from a worker,
+	/// the task goes on that worker's own deque; from any other thread, the
+	/// deques are filled round robin. if the pool isn't running, task runs
+	/// right away on the calling thread. don't call concurrently with
+	/// Start() or Stop().
+	void Submit( DThreadPoolTask* task, DProfileSectionDescriptor* section = NULL );
+
+	/// block until every task submitted so far has finished. don't call
+	/// from a task.
+	void Wait();
+
+	DThreadPoolStats GetStats() const;
+
+private:
+	friend class DThreadPoolWorker;
+
+	struct Job
+	{
+		DThreadPoolTask* task;
+		DProfileSectionDescriptor* section;
+		uint64_t submit_ticks;
+	};
+
+	/// find a task for worker: its own newest, else another's oldest
+	bool Take( DThreadPoolWorker* worker, Job& job );
+	void Run( const Job& job );
+	/// sleep until there is work or the pool is stopping
+	void Park();
+
+	std::string name;
+	std::string wait_label;
+	DProfileSectionDescriptor wait_site;
+
+	std::vector<DThreadPoolWorker*> workers;
+	std::atomic<uint32_t> next_worker;
+
+	// tasks queued but not yet taken, and submitted but not yet finished
+	std::atomic<int64_t> queued;
+	std::atomic<int64_t> outstanding;
+	std::atomic<int> sleepers;
+	std::atomic<bool> stopping;
+	// for work_ready and idle
+	pthread_mutex_t park_mutex;
+	pthread_cond_t work_ready;
+	pthread_cond_t idle;
+
+	std::atomic<uint64_t> submitted;
+	std::atomic<uint64_t> completed;
+	std::atomic<uint64_t> stolen;
+	std::atomic<uint64_t> parks;
+};
+
+#endif
@@ -29,6 +29,163 @@
 #endif
 
 #include <assert.h>
+#include <pthread.h>
+#ifdef DTIME_HAVE_CYCLE_COUNTER
+#ifndef __aarch64__
+#include <cpuid.h>
+#endif
+#endif
+
+#ifdef DTIME_HAVE_CYCLE_COUNTER
+/// system clock in nanoseconds, to calibrate the cycle counter against
+#ifndef OSX
+static uint64_t ClockNanos()
+{
+	timespec now;
+	clock_gettime(DTIME_CLOCK, &now);
+	return uint64_t(now.tv_sec)*1000000000ull + now.tv_nsec;
+}
+#else
+static uint64_t ClockNanos()
+{
+	mach_timebase_info_data_t info;
+	mach_timebase_info( &info );
+	return mach_absolute_time() * info.numer / info.denom;
+}
+#endif
+
+/// true if the cycle counter runs at a constant rate regardless of power state
+static bool CycleCounterIsInvariant()
+{
+	#ifdef __aarch64__
+	// the generic timer always runs at cntfrq_el0
+	return true;
+	#else
+	unsigned int eax, ebx, ecx, edx;
+	if ( !__get_cpuid( 0x80000000, &eax, &ebx, &ecx, &edx ) || eax < 0x80000007 )
+		return false;
+	__get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx );
+	return ( edx & (1<<8) ) != 0;
+	#endif
+}
+
+std::atomic<int> DTime::tick_source( DTime::TICKS_UNDECIDED );
+#else
+std::atomic<int> DTime::tick_source( DTime::TICKS_CLOCK );
+#endif
+
+std::atomic<double> DTime::millis_per_tick( 0.0 );
+
+// guards choosing the tick source, the calibration baseline and calibrating
+static pthread_mutex_t calibration_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef DTIME_HAVE_CYCLE_COUNTER
+// the clock/cycle counter pair that cycle counter calibration measures from,
+// taken when the tick source is chosen
+static uint64_t calibration_start_nanos = 0;
+static uint64_t calibration_start_ticks = 0;
+
+// choose at static init time at the latest, so that by the time anything
+// needs converting there's usually a long enough baseline for a full calibration
+static DTime::TICK_SOURCE initial_tick_source = DTime::GetTickSource();
+#endif
+
+DTime::TICK_SOURCE DTime::ChooseTickSource()
+{
+	#ifdef DTIME_HAVE_CYCLE_COUNTER
+	pthread_mutex_lock( &calibration_lock );
+	int source = tick_source.load( std::memory_order_relaxed );
+	if ( source == TICKS_UNDECIDED )
+	{
+		source = CycleCounterIsInvariant() ? TICKS_CYCLE_COUNTER : TICKS_CLOCK;
+		calibration_start_nanos = ClockNanos();
+		calibration_start_ticks = ( source == TICKS_CYCLE_COUNTER ) ? ReadCycleCounter() : ReadClock();
+		tick_source.store( source, std::memory_order_release );
+	}
+	pthread_mutex_unlock( &calibration_lock );
+	return (TICK_SOURCE)source;
+	#else
+	return TICKS_CLOCK;
+	#endif
+}
+
+bool DTime::SetTickSource( DTime::TICK_SOURCE source )
+{
+	if ( source == TICKS_CYCLE_COUNTER )
+	{
+		#ifdef DTIME_HAVE_CYCLE_COUNTER
+		if ( !CycleCounterIsInvariant() )
+			return false;
+		#else
+		return false;
+		#endif
+	}
+
+	pthread_mutex_lock( &calibration_lock );
+	if ( source != tick_source.load( std::memory_order_relaxed ) )
+	{
+		millis_per_tick.store( 0.0, std::memory_order_relaxed );
+		#ifdef DTIME_HAVE_CYCLE_COUNTER
+		calibration_start_nanos = ClockNanos();
+		calibration_start_ticks = ( source == TICKS_CYCLE_COUNTER ) ? ReadCycleCounter() : ReadClock();
+		#endif
+		tick_source.store( source, std::memory_order_release );
+	}
+	pthread_mutex_unlock( &calibration_lock );
+	return true;
+}
+
+double DTime::Calibrate()
+{
+	TICK_SOURCE source = GetTickSource();
+	double millis = 0.0;
+	bool final = true;
+	pthread_mutex_lock( &calibration_lock );
+	if ( source == TICKS_CLOCK )
+	{
+		#ifdef OSX
+		mach_timebase_info_data_t info;
+		mach_timebase_info( &info );
+		millis = 1e-6*(double)info.numer / (double) info.denom;
+		#else
+		// ReadClock() returns nanoseconds
+		millis = 1e-6;
+		#endif
+	}
+
+	#ifdef DTIME_HAVE_CYCLE_COUNTER
+	#ifdef __aarch64__
+	if ( source == TICKS_CYCLE_COUNTER )
+	{
+		uint64_t frequency;
+		__asm__ __volatile__( "mrs %0, cntfrq_el0" : "=r"( frequency ) );
+		if ( frequency != 0 )
+			millis = 1e3 / (double)frequency;
+	}
+	#endif
+
+	if ( millis == 0.0 )
+	{
+		// measure against the system clock since the source was chosen. under
+		// 20ms in, don't make the caller wait: use what there is (at least
+		// 100us) and measure again next time.
+		static const uint64_t MIN_CALIBRATION_NANOS = 20000000;
+		static const uint64_t MIN_PROVISIONAL_NANOS = 100000;
+		uint64_t nanos = ClockNanos();
+		while ( nanos - calibration_start_nanos < MIN_PROVISIONAL_NANOS )
+			nanos = ClockNanos();
+		uint64_t ticks = ReadCycleCounter();
+		millis = 1e-6 * (double)( nanos - calibration_start_nanos ) / (double)( ticks - calibration_start_ticks );
+		final = ( nanos - calibration_start_nanos >= MIN_CALIBRATION_NANOS );
+	}
+	#endif
+
+	// SetTickSource() may have changed the source since it was read
+	if ( final && tick_source.load( std::memory_order_relaxed ) == source )
+		millis_per_tick.store( millis, std::memory_order_relaxed );
+	pthread_mutex_unlock( &calibration_lock );
+	return millis;
+}
 
 double DTime::Update()
 {
@@ -51,7 +208,7 @@ double DTime::Update()
 
 	#else
 	timespec now;
-	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(DTIME_CLOCK, &now);
 
 	// calculate diff
 	double diff = now.tv_sec - time.tv_sec;
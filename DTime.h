@@ -27,6 +27,26 @@
 
  can store either a high-precision relative time or a high-precision absolute time
 
+ also provides raw 64 bit ticks via the static GetTicks(), for code (such as
+ DProfiler) that needs to take timestamps as cheaply as possible and convert
+ them later with TicksToMillis(). ticks come from the CPU's cycle counter
+ (rdtsc on x86, cntvct_el0 on ARM64) where that is available and runs at a
+ constant rate, calibrated against the system clock; otherwise from
+ clock_gettime (nanoseconds) or mach_absolute_time. the tick source is chosen
+ by the first GetTicks(), even one made by another file's static
+ constructor, and the calibration is measured from then on. conversions
+ made in the first 20ms after that use a provisional rate rather than
+ waiting for a full one.
+
+ define DTIME_NO_CYCLE_COUNTER to compile out the cycle counter backend.
+
+ on Linux all times come from a monotonic clock, so NTP adjustments can't
+ produce negative or huge intervals. this is CLOCK_MONOTONIC by default, or
+ CLOCK_MONOTONIC_RAW (immune to NTP slewing too, but not accelerated by the
+ vDSO on older kernels) if DTIME_USE_CLOCK_MONOTONIC_RAW is defined. note that
+ this means a DTime holds time since an arbitrary point (usually boot), not
+ wall clock time.
+
 */
 
 #ifdef __APPLE__
@@ -39,6 +59,23 @@
 #include <time.h>
 #endif
 #include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifndef OSX
+#if defined(DTIME_USE_CLOCK_MONOTONIC_RAW) && defined(CLOCK_MONOTONIC_RAW)
+#define DTIME_CLOCK CLOCK_MONOTONIC_RAW
+#else
+#define DTIME_CLOCK CLOCK_MONOTONIC
+#endif
+#endif
+
+#if !defined(DTIME_NO_CYCLE_COUNTER) && ( defined(__x86_64__) || defined(__i386__) )
+#define DTIME_HAVE_CYCLE_COUNTER
+#include <x86intrin.h>
+#elif !defined(DTIME_NO_CYCLE_COUNTER) && defined(__aarch64__)
+#define DTIME_HAVE_CYCLE_COUNTER
+#endif
 
 #include <assert.h>
 
@@ -61,14 +98,47 @@ public:
         #ifdef OSX
         time = mach_absolute_time();
         #else
-        // clock_gettime(CLOCK_MONOTONIC, &ts); // Works on FreeBSD
-        clock_gettime(CLOCK_REALTIME, &time); // Works on Linux
+        clock_gettime(DTIME_CLOCK, &time);
         #endif
     }
 
 	// set us to the given time in seconds
 	void SetSeconds( double seconds );
 
+	typedef enum _TICK_SOURCE { TICKS_CLOCK, TICKS_CYCLE_COUNTER } TICK_SOURCE;
+	/// select where GetTicks() comes from. returns false if the source is not
+	/// available on this machine. ticks from different sources can't be mixed,
+	/// so this must be called before any profiling or other timestamps are
+	/// taken, and not while another thread may be calling GetTicks().
+	static bool SetTickSource( TICK_SOURCE source );
+	static TICK_SOURCE GetTickSource()
+	{
+		int source = tick_source.load( std::memory_order_acquire );
+		return source == TICKS_UNDECIDED ? ChooseTickSource() : (TICK_SOURCE)source;
+	}
+
+	/// return the current time in raw ticks
+	static inline uint64_t GetTicks()
+	{
+		#ifdef DTIME_HAVE_CYCLE_COUNTER
+		int source = tick_source.load( std::memory_order_relaxed );
+		if ( source == TICKS_CYCLE_COUNTER )
+			return ReadCycleCounter();
+		if ( source == TICKS_UNDECIDED && ChooseTickSource() == TICKS_CYCLE_COUNTER )
+			return ReadCycleCounter();
+		#endif
+		return ReadClock();
+	}
+
+	/// convert a tick count (difference) to milliseconds. safe from any thread.
+	static double TicksToMillis( uint64_t ticks )
+	{
+		double millis = millis_per_tick.load( std::memory_order_relaxed );
+		if ( millis == 0.0 )
+			millis = Calibrate();
+		return millis * (double)ticks;
+	}
+
 	// update our time to the current time, returning
 	// delta time in seconds as a float
 	double Update();
@@ -141,6 +211,45 @@ public:
 
 private:
 
+    static inline uint64_t ReadClock()
+    {
+        #ifdef OSX
+        return mach_absolute_time();
+        #else
+        timespec now;
+        clock_gettime(DTIME_CLOCK, &now);
+        return uint64_t(now.tv_sec)*1000000000ull + now.tv_nsec;
+        #endif
+    }
+
+    #ifdef DTIME_HAVE_CYCLE_COUNTER
+    static inline uint64_t ReadCycleCounter()
+    {
+        #ifdef __aarch64__
+        uint64_t ticks;
+        __asm__ __volatile__( "mrs %0, cntvct_el0" : "=r"( ticks ) );
+        return ticks;
+        #else
+        // rdtsc is not serialising; that's fine for anything longer than a few dozen cycles
+        return __rdtsc();
+        #endif
+    }
+    #endif
+
+    /// return the milliseconds per tick of the current tick source, and store
+    /// them in millis_per_tick once they have been measured for long enough
+    static double Calibrate();
+    /// pick the tick source, if it hasn't been already, and start the
+    /// calibration baseline. returns the tick source.
+    static TICK_SOURCE ChooseTickSource();
+
+    // until the first GetTicks(). constant-initialised, so that it is valid
+    // during other files' static initialisation.
+    static const int TICKS_UNDECIDED = -1;
+    static std::atomic<int> tick_source;
+    // 0 until calibrated
+    static std::atomic<double> millis_per_tick;
+
     void Copy( const DTime& other )
     {
         if ( this != &other )
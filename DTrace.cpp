@@ -0,0 +1,107 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DTrace.h"
+#include "DProfiler.h"
+
+#include <unistd.h>
+
+DTraceBuffer::DTraceBuffer( uint32_t _capacity, TRACE_POLICY _policy )
+: write_pos( 0 ), dropped( 0 ), read_pos( 0 )
+{
+	capacity = 1;
+	while ( capacity < _capacity )
+		capacity <<= 1;
+	mask = capacity-1;
+	policy = _policy;
+	overwritten = 0;
+	events = new DTraceEvent[capacity];
+}
+
+DTraceBuffer::~DTraceBuffer()
+{
+	delete [] events;
+}
+
+size_t DTraceBuffer::Read( DTraceEvent* out, size_t max )
+{
+	// a lap during the copy can leave nothing usable while there are still
+	// events to read: try again then, unless the producer keeps outrunning us
+	static const int MAX_LAP_RETRIES = 100;
+	for ( int attempt=0; ; attempt++ )
+	{
+		uint64_t r = read_pos.load( std::memory_order_relaxed );
+		uint64_t w = write_pos.load( std::memory_order_acquire );
+
+		// the producer has lapped us: skip what's gone
+		if ( w - r > capacity )
+		{
+			overwritten += w - r - capacity;
+			r = w - capacity;
+		}
+
+		size_t count = w - r;
+		if ( count > max )
+			count = max;
+		for ( size_t i=0; i<count; i++ )
+			out[i] = events[(r+i) & mask];
+
+		bool lapped = false;
+		if ( policy == TRACE_OVERWRITE_OLDEST )
+		{
+			// anything the producer overwrote while we were copying is garbage,
+			// and so is the slot it may be overwriting now for event w2
+			std::atomic_thread_fence( std::memory_order_acquire );
+			uint64_t w2 = write_pos.load( std::memory_order_relaxed );
+			if ( w2 >= capacity && r <= w2 - capacity )
+			{
+				size_t bad = w2 - capacity + 1 - r;
+				if ( bad > count )
+					bad = count;
+				overwritten += bad;
+				for ( size_t i=bad; i<count; i++ )
+					out[i-bad] = out[i];
+				count -= bad;
+				r += bad;
+				lapped = true;
+			}
+		}
+
+		read_pos.store( r + count, std::memory_order_release );
+		if ( count > 0 || !lapped || attempt == MAX_LAP_RETRIES )
+			return count;
+	}
+}
+
+
+void DTraceDrainer::ThreadedFunction()
+{
+	DProfiler::DrainTrace( sink );
+	usleep( interval_ms*1000 );
+}
+
+void DTraceDrainer::StopThread()
+{
+	if ( !thread_running )
+		return;
+	DThread::StopThread();
+	// pick up anything recorded since the last pass
+	DProfiler::DrainTrace( sink );
+}
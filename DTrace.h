@@ -0,0 +1,170 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DTrace_H
+#define _DTrace_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "DThread.h"
+
+/** DTrace
+
+ event trace recording for DProfiler. with tracing enabled (see
+ DProfiler::EnableTracing()), every timed section push and pop also appends a
+ DTraceEvent to the thread's DTraceBuffer: a fixed-size single-producer,
+ single-consumer ring, so recording never locks or allocates. a consumer,
+ usually a DTraceDrainer thread, periodically collects the events and passes
+ them on to a DTraceSink.
+
+ when a ring is full, TRACE_DROP_NEWEST drops new events and counts them,
+ and TRACE_OVERWRITE_OLDEST overwrites the oldest undrained events (the
+ consumer counts how many it missed). either way the cost to the profiled
+ thread stays constant.
+
+ besides section pushes and pops, named DSemaphores record WAIT_BEGIN and
+ WAIT_END around each Wait() that blocks and SIGNAL at each Signal(), with
+ the semaphore's name as id, and DProfiler::FrameBoundary() records FRAME.
+ together they let an analyzer follow work from thread to thread (see
+ tools/dprofcrit.cpp).
+
+*/
+
+class DProfileContext;
+
+/// one recorded event. 16 bytes.
+struct DTraceEvent
+{
+	typedef enum _TYPE { BEGIN = 0, END = 1, WAIT_BEGIN = 2, WAIT_END = 3, SIGNAL = 4, FRAME = 5 } TYPE;
+
+	/// DTime ticks
+	uint64_t ticks;
+	/// interned section or semaphore name id (see DProfiler::GetName())
+	uint32_t id;
+	uint32_t type;
+};
+
+typedef enum _TRACE_POLICY { TRACE_DROP_NEWEST, TRACE_OVERWRITE_OLDEST } TRACE_POLICY;
+
+class DTraceBuffer
+{
+public:
+	/// capacity is rounded up to a power of two
+	DTraceBuffer( uint32_t capacity, TRACE_POLICY _policy );
+	~DTraceBuffer();
+
+	/// append an event. only call from the owning thread.
+	void Write( DTraceEvent::TYPE type, uint32_t id, uint64_t ticks )
+	{
+		uint64_t w = write_pos.load( std::memory_order_relaxed );
+		if ( policy == TRACE_DROP_NEWEST && w - read_pos.load( std::memory_order_acquire ) >= capacity )
+		{
+			dropped.store( dropped.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+			return;
+		}
+		DTraceEvent& e = events[w & mask];
+		e.ticks = ticks;
+		e.id = id;
+		e.type = type;
+		write_pos.store( w+1, std::memory_order_release );
+	}
+
+	/// copy out up to max events, oldest first, returning the number copied.
+	/// only call from one consumer thread at a time. once the producer has
+	/// lapped the consumer (TRACE_OVERWRITE_OLDEST), the oldest slot left is
+	/// skipped too, as the producer may be rewriting it. returns 0 with
+	/// events left only if a live producer keeps lapping every attempt.
+	size_t Read( DTraceEvent* out, size_t max );
+	/// true if the consumer has read everything written. only meaningful once
+	/// the producer has stopped.
+	bool IsEmpty() const { return read_pos.load( std::memory_order_relaxed ) == write_pos.load( std::memory_order_acquire ); }
+
+	uint32_t GetCapacity() const { return capacity; }
+	TRACE_POLICY GetPolicy() const { return policy; }
+	/// events dropped because the buffer was full (TRACE_DROP_NEWEST)
+	uint64_t GetDropped() const { return dropped.load( std::memory_order_relaxed ); }
+	/// events overwritten before they could be read (TRACE_OVERWRITE_OLDEST)
+	uint64_t GetOverwritten() const { return overwritten; }
+
+private:
+	DTraceEvent* events;
+	uint32_t capacity;
+	uint32_t mask;
+	TRACE_POLICY policy;
+
+	// written by the producer
+	std::atomic<uint64_t> write_pos;
+	std::atomic<uint64_t> dropped;
+	// written by the consumer
+	std::atomic<uint64_t> read_pos;
+	uint64_t overwritten;
+};
+
+/// the thread drained events were recorded by. contexts are reused by later
+/// threads, so sinks should tell threads apart by this, not by context.
+struct DTraceThread
+{
+	/// DProfileContext::thread_index, which is never reused
+	int thread_index;
+	/// DProfileContext::incarnation while the thread owned the context
+	uint64_t incarnation;
+	/// as given to DProfiler::RegisterThread(), or empty
+	std::string name;
+};
+
+/// receives drained events
+class DTraceSink
+{
+public:
+	virtual ~DTraceSink() {}
+	/// called with each batch of events drained from thread's buffer, oldest first
+	virtual void OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count ) = 0;
+	/// called after each complete drain of all contexts
+	virtual void OnDrained() {}
+};
+
+/** DTraceDrainer
+
+ background thread that calls DProfiler::DrainTrace( sink ) every interval_ms
+ milliseconds, and once more when stopped.
+
+*/
+
+class DTraceDrainer : public DThread
+{
+public:
+	DTraceDrainer( DTraceSink* _sink, int _interval_ms = 10 ) : sink( _sink ), interval_ms( _interval_ms ) { SetThreadName( "DTraceDrainer" ); }
+	~DTraceDrainer() { if ( thread_running ) StopThread(); }
+
+	/// stop the thread, then do a final drain
+	void StopThread();
+
+protected:
+	void ThreadedFunction();
+
+private:
+	DTraceSink* sink;
+	int interval_ms;
+};
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DTraceExport.h"
+#include "DProfiler.h"
+
+#include <unistd.h>
+
+DTraceFileWriter::DTraceFileWriter( size_t _chunk_size )
+{
+	file = NULL;
+	chunk_size = _chunk_size;
+	have_first_ticks = false;
+	first_ticks = 0;
+}
+
+DTraceFileWriter::~DTraceFileWriter()
+{
+	// derived classes Close() in their destructors, so that the right footer is written
+	if ( file )
+		fclose( file );
+}
+
+bool DTraceFileWriter::Open( const char* path )
+{
+	Close();
+	file = fopen( path, "wb" );
+	if ( !file )
+	{
+		fprintf(stderr, "DTraceFileWriter: couldn't open %s for writing\n", path );
+		return false;
+	}
+	tracks.clear();
+	// timestamps are relative to when the file was opened
+	first_ticks = DTime::GetTicks();
+	have_first_ticks = true;
+	WriteHeader();
+	return true;
+}
+
+void DTraceFileWriter::Close()
+{
+	if ( !file )
+		return;
+	WriteFooter();
+	Flush();
+	fclose( file );
+	file = NULL;
+}
+
+void DTraceFileWriter::Flush()
+{
+	if ( file && !buffer.empty() )
+	{
+		if ( fwrite( buffer.data(), 1, buffer.size(), file ) != buffer.size() )
+			fprintf(stderr, "DTraceFileWriter: write failed\n" );
+		fflush( file );
+	}
+	buffer.clear();
+}
+
+const std::string& DTraceFileWriter::GetName( uint32_t id )
+{
+	if ( id >= names.size() )
+		names.resize( id+1 );
+	if ( names[id].empty() )
+		names[id] = DProfiler::GetName( id );
+	return names[id];
+}
+
+int DTraceFileWriter::GetTrack( const DTraceThread& thread )
+{
+	std::pair<int, uint64_t> key( thread.thread_index, thread.incarnation );
+	std::map<std::pair<int, uint64_t>, int>::iterator it = tracks.find( key );
+	if ( it != tracks.end() )
+		return it->second;
+	int track = tracks.size();
+	tracks[key] = track;
+	OnNewTrack( thread, track );
+	return track;
+}
+
+std::string DTraceFileWriter::GetTrackName( const DTraceThread& thread )
+{
+	if ( !thread.name.empty() )
+		return thread.name;
+	char buf[64];
+	snprintf( buf, 64, "Thread %i", thread.thread_index );
+	return buf;
+}
+
+double DTraceFileWriter::ToNanos( uint64_t ticks )
+{
+	if ( !have_first_ticks )
+	{
+		first_ticks = ticks;
+		have_first_ticks = true;
+	}
+	if ( ticks < first_ticks )
+		return -1e6 * DTime::TicksToMillis( first_ticks - ticks );
+	return 1e6 * DTime::TicksToMillis( ticks - first_ticks );
+}
+
+
+
+static void AppendJSONString( std::string& out, const std::string& s )
+{
+	out += '"';
+	for ( size_t i=0; i<s.size(); i++ )
+	{
+		unsigned char c = s[i];
+		if ( c == '"' || c == '\\' )
+		{
+			out += '\\';
+			out += c;
+		}
+		else if ( c < 0x20 )
+		{
+			char buf[8];
+			snprintf( buf, 8, "\\u%04x", c );
+			out += buf;
+		}
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+void DChromeTraceWriter::WriteHeader()
+{
+	first_event = true;
+	Append( "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+}
+
+void DChromeTraceWriter::WriteFooter()
+{
+	Append( "\n]}\n" );
+}
+
+void DChromeTraceWriter::AppendSeparator()
+{
+	if ( !first_event )
+		Append( ",\n", 2 );
+	first_event = false;
+}
+
+void DChromeTraceWriter::OnNewTrack( const DTraceThread& thread, int track )
+{
+	char buf[256];
+	snprintf( buf, 256, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%i,\"tid\":%i,\"args\":{\"name\":",
+		(int)getpid(), track+1 );
+	std::string line = buf;
+	AppendJSONString( line, GetTrackName( thread ) );
+	line += "}}";
+	AppendSeparator();
+	Append( line );
+}
+
+void DChromeTraceWriter::OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count )
+{
+	if ( !IsOpen() )
+		return;
+	int tid = GetTrack( thread )+1;
+	int pid = getpid();
+	std::string line;
+	char buf[128];
+	for ( size_t i=0; i<count; i++ )
+	{
+		const DTraceEvent& e = events[i];
+		// blocked semaphore waits are slices too; signals and frames are instants
+		const char* phase = "i";
+		if ( e.type == DTraceEvent::BEGIN || e.type == DTraceEvent::WAIT_BEGIN )
+			phase = "B";
+		else if ( e.type == DTraceEvent::END || e.type == DTraceEvent::WAIT_END )
+			phase = "E";
+		line = "{\"name\":";
+		AppendJSONString( line, e.type == DTraceEvent::WAIT_BEGIN ? "wait " + GetName( e.id ) : GetName( e.id ) );
+		// ts is in microseconds
+		snprintf( buf, 128, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%i,\"tid\":%i%s}",
+			phase, ToNanos( e.ticks )*1e-3, pid, tid, phase[0] == 'i' ? ",\"s\":\"t\"" : "" );
+		line += buf;
+		AppendSeparator();
+		Append( line );
+	}
+}
+
+
+
+/// minimal protobuf encoding
+static void PutVarint( std::string& out, uint64_t v )
+{
+	while ( v >= 0x80 )
+	{
+		out += (char)( (v & 0x7f) | 0x80 );
+		v >>= 7;
+	}
+	out += (char)v;
+}
+static void PutUInt( std::string& out, int field, uint64_t v )
+{
+	PutVarint( out, (uint64_t)( field<<3 ) | 0 );
+	PutVarint( out, v );
+}
+static void PutBytes( std::string& out, int field, const std::string& bytes )
+{
+	PutVarint( out, (uint64_t)( field<<3 ) | 2 );
+	PutVarint( out, bytes.size() );
+	out += bytes;
+}
+
+// perfetto field numbers, from protos/perfetto/trace/
+enum
+{
+	TRACE_PACKET = 1,
+
+	PACKET_TIMESTAMP = 8,
+	PACKET_SEQUENCE_ID = 10,
+	PACKET_TRACK_EVENT = 11,
+	PACKET_INTERNED_DATA = 12,
+	PACKET_SEQUENCE_FLAGS = 13,
+	PACKET_TRACK_DESCRIPTOR = 60,
+
+	SEQ_INCREMENTAL_STATE_CLEARED = 1,
+	SEQ_NEEDS_INCREMENTAL_STATE = 2,
+
+	TRACK_EVENT_TYPE = 9,
+	TRACK_EVENT_NAME_IID = 10,
+	TRACK_EVENT_TRACK_UUID = 11,
+	TYPE_SLICE_BEGIN = 1,
+	TYPE_SLICE_END = 2,
+	TYPE_INSTANT = 3,
+
+	INTERNED_EVENT_NAMES = 2,
+	EVENT_NAME_IID = 1,
+	EVENT_NAME_NAME = 2,
+
+	TRACK_DESCRIPTOR_UUID = 1,
+	TRACK_DESCRIPTOR_THREAD = 4,
+	THREAD_PID = 1,
+	THREAD_TID = 2,
+	THREAD_NAME = 5,
+};
+
+static const uint32_t PERFETTO_SEQUENCE_ID = 1;
+
+void DPerfettoTraceWriter::AppendPacket( const std::string& packet )
+{
+	std::string wrapped;
+	PutBytes( wrapped, TRACE_PACKET, packet );
+	Append( wrapped );
+}
+
+void DPerfettoTraceWriter::OnNewTrack( const DTraceThread& thread, int track )
+{
+	std::string descriptor_thread;
+	PutUInt( descriptor_thread, THREAD_PID, getpid() );
+	PutUInt( descriptor_thread, THREAD_TID, track+1 );
+	PutBytes( descriptor_thread, THREAD_NAME, GetTrackName( thread ) );
+
+	std::string descriptor;
+	PutUInt( descriptor, TRACK_DESCRIPTOR_UUID, track+1 );
+	PutBytes( descriptor, TRACK_DESCRIPTOR_THREAD, descriptor_thread );
+
+	std::string packet;
+	PutUInt( packet, PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID );
+	if ( first_packet )
+	{
+		PutUInt( packet, PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED );
+		first_packet = false;
+	}
+	PutBytes( packet, PACKET_TRACK_DESCRIPTOR, descriptor );
+	AppendPacket( packet );
+}
+
+void DPerfettoTraceWriter::OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count )
+{
+	if ( !IsOpen() )
+		return;
+	uint64_t track_uuid = GetTrack( thread )+1;
+	std::string packet, track_event, interned_data;
+	for ( size_t i=0; i<count; i++ )
+	{
+		const DTraceEvent& e = events[i];
+		packet.clear();
+		track_event.clear();
+		interned_data.clear();
+
+		double nanos = ToNanos( e.ticks );
+		PutUInt( packet, PACKET_TIMESTAMP, nanos > 0 ? (uint64_t)nanos : 0 );
+		PutUInt( packet, PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID );
+		PutUInt( packet, PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE );
+
+		// blocked semaphore waits are slices too; signals and frames are instants
+		int type = TYPE_INSTANT;
+		if ( e.type == DTraceEvent::BEGIN || e.type == DTraceEvent::WAIT_BEGIN )
+			type = TYPE_SLICE_BEGIN;
+		else if ( e.type == DTraceEvent::END || e.type == DTraceEvent::WAIT_END )
+			type = TYPE_SLICE_END;
+		PutUInt( track_event, TRACK_EVENT_TYPE, type );
+		PutUInt( track_event, TRACK_EVENT_TRACK_UUID, track_uuid );
+		if ( type != TYPE_SLICE_END )
+		{
+			// name ids double as perfetto interning ids
+			PutUInt( track_event, TRACK_EVENT_NAME_IID, e.id );
+			if ( e.id >= interned.size() )
+				interned.resize( e.id+1, false );
+			if ( !interned[e.id] )
+			{
+				std::string event_name;
+				PutUInt( event_name, EVENT_NAME_IID, e.id );
+				PutBytes( event_name, EVENT_NAME_NAME, GetName( e.id ) );
+				PutBytes( interned_data, INTERNED_EVENT_NAMES, event_name );
+				PutBytes( packet, PACKET_INTERNED_DATA, interned_data );
+				interned[e.id] = true;
+			}
+		}
+		PutBytes( packet, PACKET_TRACK_EVENT, track_event );
+		AppendPacket( packet );
+	}
+}
@@ -0,0 +1,147 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DTraceExport_H
+#define _DTraceExport_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "DTrace.h"
+
+/** DTraceExport
+
+ DTraceSinks that stream recorded trace events to a file, for viewing in
+ chrome://tracing or https://ui.perfetto.dev. each profiled thread becomes a
+ track. output is buffered and written in chunks of about chunk_size bytes,
+ so captures of any size can be written with constant memory; hand the
+ writer to a DTraceDrainer to export from a background thread while
+ profiling continues.
+
+ usage:
+
+    DChromeTraceWriter writer;
+    writer.Open( "capture.json" );
+    DTraceDrainer drainer( &writer );
+    DProfiler::EnableTracing( true );
+    drainer.StartThread();
+    .. run
+    drainer.StopThread();
+    writer.Close();
+
+*/
+
+class DTraceFileWriter : public DTraceSink
+{
+public:
+	DTraceFileWriter( size_t _chunk_size );
+	virtual ~DTraceFileWriter();
+
+	/// open path for writing. returns false on failure.
+	bool Open( const char* path );
+	/// finish the file and close it
+	void Close();
+	bool IsOpen() const { return file != NULL; }
+
+	void OnDrained() { Flush(); }
+
+protected:
+	virtual void WriteHeader() {}
+	virtual void WriteFooter() {}
+
+	/// append to the output buffer, writing it out if it's grown past chunk_size
+	void Append( const char* data, size_t length )
+	{
+		buffer.append( data, length );
+		if ( buffer.size() >= chunk_size )
+			Flush();
+	}
+	void Append( const std::string& data ) { Append( data.data(), data.size() ); }
+	void Flush();
+
+	/// name for the given section name id, cached locally
+	const std::string& GetName( uint32_t id );
+	/// track number for the given thread, assigning one on first sight
+	/// and calling OnNewTrack()
+	int GetTrack( const DTraceThread& thread );
+	virtual void OnNewTrack( const DTraceThread& thread, int track ) = 0;
+	/// the thread's name if it has one, otherwise "Thread <thread_index>"
+	std::string GetTrackName( const DTraceThread& thread );
+
+	/// nanoseconds since the first exported event
+	double ToNanos( uint64_t ticks );
+
+private:
+	FILE* file;
+	std::string buffer;
+	size_t chunk_size;
+
+	std::vector<std::string> names;
+	// (thread_index, incarnation) -> track
+	std::map<std::pair<int, uint64_t>, int> tracks;
+	bool have_first_ticks;
+	uint64_t first_ticks;
+};
+
+/// Chrome Trace Event JSON format
+class DChromeTraceWriter : public DTraceFileWriter
+{
+public:
+	DChromeTraceWriter( size_t chunk_size = 1<<20 ) : DTraceFileWriter( chunk_size ), first_event( true ) {}
+	~DChromeTraceWriter() { Close(); }
+
+	void OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count );
+
+protected:
+	void WriteHeader();
+	void WriteFooter();
+	void OnNewTrack( const DTraceThread& thread, int track );
+
+private:
+	void AppendSeparator();
+	bool first_event;
+};
+
+/// Perfetto protobuf trace format (TracePacket/TrackEvent, with interned event names)
+class DPerfettoTraceWriter : public DTraceFileWriter
+{
+public:
+	DPerfettoTraceWriter( size_t chunk_size = 1<<20 ) : DTraceFileWriter( chunk_size ), first_packet( true ) {}
+	~DPerfettoTraceWriter() { Close(); }
+
+	void OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count );
+
+protected:
+	void WriteHeader() { first_packet = true; interned.clear(); }
+	void OnNewTrack( const DTraceThread& thread, int track );
+
+private:
+	/// wrap packet as a Trace.packet field and append it
+	void AppendPacket( const std::string& packet );
+
+	bool first_packet;
+	// name ids already emitted as interned data
+	std::vector<bool> interned;
+};
+
+#endif
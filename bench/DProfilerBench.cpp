@@ -0,0 +1,363 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** DProfilerBench
+
+ microbenchmarks for the profiler's own overhead. prints one CSV line per
+ measurement to stdout:
+
+   benchmark,depth,labels,threads,iterations,ns_per_op
+
+ where an op is one push/pop pair for the push_pop_* benchmarks, one
+ lock/unlock pair for the lock benchmarks, and one call for the rest. depth is how deeply nested the pairs are, labels how many
+ distinct sibling sections are cycled through at the innermost level.
+
+ usage: bench [max_threads] [quick]
+
+ built with -DDPROFILER_UNITY, the profiler is compiled into this file (see
+ DProfilerUnity.cpp), so pushes and pops can be inlined into the loops.
+
+*/
+
+#define PROFILE
+#include "DProfiler.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+static long iterations = 2000000;
+
+static double NanosSince( const std::chrono::steady_clock::time_point& start )
+{
+	return std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count();
+}
+
+static void Report( const char* name, int depth, int labels, int threads, long n, double ns_per_op )
+{
+	printf( "%s,%d,%d,%d,%ld,%.2f\n", name, depth, labels, threads, n, ns_per_op );
+	fflush( stdout );
+}
+
+/// a set of sites to push, one per (level, label)
+class BenchSites
+{
+public:
+	BenchSites( int _depth, int _labels ) : depth( _depth ), labels( _labels )
+	{
+		for ( int d=0; d<depth; d++ )
+		{
+			for ( int l=0; l<labels; l++ )
+			{
+				char buf[64];
+				snprintf( buf, 64, "level %d label %d", d, l );
+				names.push_back( buf );
+			}
+		}
+		// names must not move once the sites point at them
+		for ( size_t i=0; i<names.size(); i++ )
+			sites.push_back( std::unique_ptr<DProfileSectionDescriptor>( new DProfileSectionDescriptor( names[i].c_str(), __FILE__, __LINE__ ) ) );
+	}
+
+	DProfileSectionDescriptor& Get( int d, int l ) { return *sites[d*labels+l]; }
+	const std::string& GetName( int d, int l ) { return names[d*labels+l]; }
+
+	int depth;
+	int labels;
+private:
+	std::vector<std::string> names;
+	std::vector<std::unique_ptr<DProfileSectionDescriptor> > sites;
+};
+
+typedef enum _PUSH_KIND { PUSH_SITE, PUSH_DYNAMIC, PUSH_SAMPLED } PUSH_KIND;
+
+struct PushPopArgs
+{
+	BenchSites* sites;
+	PUSH_KIND kind;
+	long n;
+	double ns_per_pair;
+};
+
+static void* PushPopThread( void* arg )
+{
+	PushPopArgs* args = (PushPopArgs*)arg;
+	BenchSites& sites = *args->sites;
+	int depth = sites.depth, labels = sites.labels;
+	long outer = args->n / depth;
+
+	// warm up: create the tree and register the context
+	for ( int l=0; l<labels; l++ )
+	{
+		for ( int d=0; d<depth; d++ )
+			DProfiler::SectionPush( sites.Get( d, d==depth-1 ? l : 0 ) );
+		for ( int d=0; d<depth; d++ )
+			DProfiler::SectionPop();
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for ( long i=0; i<outer; i++ )
+	{
+		int label = labels > 1 ? (int)( i % labels ) : 0;
+		for ( int d=0; d<depth; d++ )
+		{
+			int l = d==depth-1 ? label : 0;
+			if ( args->kind == PUSH_DYNAMIC )
+				DProfiler::SectionPush( sites.GetName( d, l ) );
+			else
+				DProfiler::SectionPush( sites.Get( d, l ) );
+		}
+		for ( int d=0; d<depth; d++ )
+			DProfiler::SectionPop();
+	}
+	args->ns_per_pair = NanosSince( start ) / (double)( outer*depth );
+	return 0;
+}
+
+static void BenchPushPop( const char* name, PUSH_KIND kind, int depth, int labels, int threads )
+{
+	DProfiler::Clear();
+	BenchSites sites( depth, labels );
+	if ( kind == PUSH_SAMPLED )
+	{
+		// sample every site 1 in 64
+		for ( int d=0; d<depth; d++ )
+			for ( int l=0; l<labels; l++ )
+				sites.Get( d, l ).sample_rate = 64;
+	}
+
+	long n = iterations / ( kind == PUSH_DYNAMIC ? 4 : 1 );
+	std::vector<pthread_t> pthreads( threads );
+	std::vector<PushPopArgs> args( threads );
+	for ( int i=0; i<threads; i++ )
+	{
+		args[i].sites = &sites;
+		args[i].kind = kind;
+		args[i].n = n;
+		pthread_create( &pthreads[i], NULL, PushPopThread, &args[i] );
+	}
+	double total = 0;
+	for ( int i=0; i<threads; i++ )
+	{
+		pthread_join( pthreads[i], NULL );
+		total += args[i].ns_per_pair;
+	}
+	Report( name, depth, labels, threads, n, total/threads );
+}
+
+static void BenchFunctionProfiler()
+{
+	DProfiler::Clear();
+	long n = iterations;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for ( long i=0; i<n; i++ )
+	{
+		PROFILE_THIS_BLOCK( "function profiler" );
+	}
+	Report( "function_profiler", 1, 1, 1, n, NanosSince( start ) / n );
+}
+
+static void BenchTime()
+{
+	long n = iterations;
+	DTime t;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for ( long i=0; i<n; i++ )
+		t.SetNow();
+	Report( "dtime_setnow", 0, 0, 1, n, NanosSince( start ) / n );
+
+	volatile uint64_t sink = 0;
+	start = std::chrono::steady_clock::now();
+	for ( long i=0; i<n; i++ )
+		sink += DTime::GetTicks();
+	Report( "dtime_getticks", 0, 0, 1, n, NanosSince( start ) / n );
+}
+
+static void BenchSemaphore()
+{
+	long n = iterations;
+	DSemaphore sem;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for ( long i=0; i<n; i++ )
+	{
+		sem.Wait();
+		sem.Signal();
+	}
+	Report( "dsemaphore_wait_signal", 0, 0, 1, n, NanosSince( start ) / n );
+
+	static DMutex mutex;
+	start = std::chrono::steady_clock::now();
+	for ( long i=0; i<n; i++ )
+	{
+		mutex.Lock();
+		mutex.Unlock();
+	}
+	Report( "dmutex_lock_unlock", 0, 0, 1, n, NanosSince( start ) / n );
+}
+
+/// threads repeatedly taking one lock around a short critical section
+template <class LOCK> struct ContendedArgs
+{
+	LOCK* lock;
+	volatile long* shared;
+	long n;
+	double ns_per_op;
+};
+
+static void Acquire( DSemaphore& sem ) { sem.Wait(); }
+static void Release( DSemaphore& sem ) { sem.Signal(); }
+static void Acquire( DMutex& mutex ) { mutex.Lock(); }
+static void Release( DMutex& mutex ) { mutex.Unlock(); }
+
+template <class LOCK> static void* ContendedThread( void* arg )
+{
+	ContendedArgs<LOCK>* args = (ContendedArgs<LOCK>*)arg;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for ( long i=0; i<args->n; i++ )
+	{
+		Acquire( *args->lock );
+		(*args->shared)++;
+		Release( *args->lock );
+	}
+	args->ns_per_op = NanosSince( start ) / args->n;
+	return 0;
+}
+
+template <class LOCK> static void BenchContended( const char* name, LOCK& lock, int threads )
+{
+	long n = iterations / 4;
+	volatile long shared = 0;
+	std::vector<pthread_t> pthreads( threads );
+	std::vector<ContendedArgs<LOCK> > args( threads );
+	for ( int i=0; i<threads; i++ )
+	{
+		args[i].lock = &lock;
+		args[i].shared = &shared;
+		args[i].n = n;
+		pthread_create( &pthreads[i], NULL, ContendedThread<LOCK>, &args[i] );
+	}
+	double total = 0;
+	for ( int i=0; i<threads; i++ )
+	{
+		pthread_join( pthreads[i], NULL );
+		total += args[i].ns_per_op;
+	}
+	if ( shared != n*threads )
+		fprintf(stderr, "%s: lost updates (%ld of %ld)\n", name, shared, n*threads );
+	Report( name, 0, 0, threads, n, total/threads );
+}
+
+static void BenchDisplay( int depth, int labels )
+{
+	DProfiler::Clear();
+	// a tree with labels children at every level, depth levels deep
+	BenchSites sites( depth, labels );
+	std::vector<int> path( depth, 0 );
+	long sections = 0;
+	while ( true )
+	{
+		for ( int d=0; d<depth; d++ )
+			DProfiler::SectionPush( sites.Get( d, path[d] ) );
+		for ( int d=0; d<depth; d++ )
+			DProfiler::SectionPop();
+		sections++;
+		int d = depth-1;
+		while ( d >= 0 && ++path[d] == labels )
+			path[d--] = 0;
+		if ( d < 0 )
+			break;
+	}
+
+	// Display() prints; send that to /dev/null while timing it
+	fflush( stdout );
+	int saved_stdout = dup( 1 );
+	int devnull = open( "/dev/null", O_WRONLY );
+	dup2( devnull, 1 );
+	const int runs = 5;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for ( int i=0; i<runs; i++ )
+		DProfiler::Display();
+	fflush( stdout );
+	double ns = NanosSince( start ) / runs;
+	dup2( saved_stdout, 1 );
+	close( devnull );
+	close( saved_stdout );
+
+	Report( "display", depth, labels, 1, sections, ns );
+}
+
+int main( int argc, char** argv )
+{
+	int max_threads = argc > 1 ? atoi( argv[1] ) : 8;
+	if ( argc > 2 && strcmp( argv[2], "quick" ) == 0 )
+		iterations /= 10;
+
+	printf( "benchmark,depth,labels,threads,iterations,ns_per_op\n" );
+
+	BenchTime();
+	BenchSemaphore();
+	BenchFunctionProfiler();
+
+	int depths[] = { 1, 4, 16, 64 };
+	for ( int i=0; i<4; i++ )
+		BenchPushPop( "push_pop_site", PUSH_SITE, depths[i], 1, 1 );
+	int labels[] = { 1, 16, 256 };
+	for ( int i=0; i<3; i++ )
+	{
+		BenchPushPop( "push_pop_site", PUSH_SITE, 2, labels[i], 1 );
+		BenchPushPop( "push_pop_dynamic", PUSH_DYNAMIC, 2, labels[i], 1 );
+	}
+	BenchPushPop( "push_pop_sampled", PUSH_SAMPLED, 4, 1, 1 );
+	// hardware counters, where the machine has them
+	if ( DProfiler::EnableCounters( true ) )
+	{
+		BenchPushPop( "push_pop_counters", PUSH_SITE, 4, 1, 1 );
+		DProfiler::EnableCounters( false );
+	}
+	for ( int t=1; t<=max_threads; t*=2 )
+		BenchPushPop( "push_pop_site", PUSH_SITE, 4, 1, t );
+	// what DProfiler::Calibrate() makes of the same push and pop, to compare
+	// with push_pop_site at 1 thread
+	DProfileOverhead overhead = DProfiler::Calibrate();
+	Report( "calibrated_push_pop", 1, 1, 1, 20000, 1e6*DTime::TicksToMillis( 1 )*overhead.GetPairTicks() );
+
+	DSemaphore sem;
+	static DMutex mutex;
+	for ( int t=2; t<=max_threads; t*=2 )
+	{
+		BenchContended( "dsemaphore_contended", sem, t );
+		BenchContended( "dmutex_contended", mutex, t );
+	}
+
+	BenchDisplay( 2, 100 );
+	BenchDisplay( 3, 30 );
+
+	return 0;
+}
+
+#ifdef DPROFILER_UNITY
+#include "DProfilerUnity.cpp"
+#endif
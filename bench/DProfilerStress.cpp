@@ -0,0 +1,820 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** DProfilerStress
+
+ stress test for concurrent push/pop. N threads each run the same nested
+ sections as fast as possible, all popping at the same time, then check that
+ their own totals are consistent:
+
+   - inner section time <= outer section time <= the thread's own wall time
+   - no single call took longer than the thread's wall time (catches pops
+     that used another thread's end timestamp and underflowed)
+   - call counts are exact
+
+ meanwhile the main thread takes snapshots (DProfiler::TakeSnapshot())
+ continuously and checks that each section's counters were copied
+ consistently: its call count, timed count and statistics sample count must
+ all agree.
+
+ then rounds of short-lived threads check that the contexts of exited
+ threads are reused and their results end up in the retired threads tree,
+ that FindSection()/ReadSection() and snapshots taken meanwhile never
+ report a reused context's new tree under the thread that exited,
+ and that trace events recorded by a thread are drained as that thread's
+ even after its context has gone to another. a reader also drains a small
+ TRACE_OVERWRITE_OLDEST ring while it is filled to one past its capacity
+ over and over, and must never see a torn event.
+
+ finally a DThreadPool runs bursts of tasks which submit more tasks from
+ the workers, and every task must run exactly once.
+
+ a binary dump (see DProfileDump.h) must read back as it was written, and
+ corrupted copies of it must be rejected by the reader.
+
+ last, with DProfiler::SetLimits(), threads push more labels and deeper
+ nesting than fit: the overflow must land in "(other)" or be counted as
+ dropped, and every thread's pushes and pops must still balance.
+
+ usage: stress [threads] [iterations]. exits non-zero on inconsistency.
+
+*/
+
+#define PROFILE
+#include "DProfiler.h"
+#include "DThreadPool.h"
+#include "DProfileDump.h"
+
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+struct StressResult
+{
+	uint64_t wall_ticks;
+	uint64_t outer_ticks;
+	uint64_t inner_ticks;
+	uint64_t outer_count;
+	uint64_t inner_count;
+	uint64_t max_call_ticks;
+};
+
+static int iterations = 200000;
+static std::atomic<int> threads_running( 0 );
+
+static void* StressThread( void* arg )
+{
+	StressResult* result = (StressResult*)arg;
+	volatile int work = 0;
+
+	uint64_t start = DTime::GetTicks();
+	for ( int i=0; i<iterations; i++ )
+	{
+		PROFILE_THIS_BLOCK( "outer" );
+		work += i;
+		{
+			PROFILE_THIS_BLOCK( "inner" );
+			work += i*3;
+		}
+	}
+	result->wall_ticks = DTime::GetTicks() - start;
+
+	// only this thread writes its context, so it can read it back directly
+	DProfileContext* context = DProfiler::GetContext();
+	uint32_t outer = context->Section( 0 ).first_child;
+	uint32_t inner = context->Section( outer ).first_child;
+	result->outer_ticks = context->Section( outer ).total_ticks;
+	result->outer_count = context->Section( outer ).call_count;
+	result->inner_ticks = context->Section( inner ).total_ticks;
+	result->inner_count = context->Section( inner ).call_count;
+	result->max_call_ticks = context->Stats( outer )->max_ticks;
+	threads_running--;
+	return 0;
+}
+
+/// take snapshots until every stress thread has finished. returns the number
+/// of torn sections seen, and the number of snapshots taken in snapshot_count.
+static int SnapshotWhileRunning( int& snapshot_count )
+{
+	int torn = 0;
+	snapshot_count = 0;
+	DProfileSnapshot snapshot;
+	while ( threads_running.load() > 0 )
+	{
+		DProfiler::TakeSnapshot( snapshot );
+		snapshot_count++;
+		for ( size_t t=0; t<snapshot.threads.size(); t++ )
+		{
+			const DProfileThreadSnapshot& thread = snapshot.threads[t];
+			for ( size_t i=1; i<thread.sections.size(); i++ )
+			{
+				const DProfileSectionSnapshot& s = thread.sections[i];
+				uint64_t stats_count = i < thread.stats.size() ? thread.stats[i].count : s.timed_count;
+				if ( s.call_count != s.timed_count || stats_count != s.timed_count || s.call_count > (uint64_t)iterations*thread.merged_count )
+					torn++;
+			}
+		}
+	}
+	return torn;
+}
+
+static const int CHURN_ROUNDS = 50;
+static const int CHURN_ITERATIONS = 100;
+
+static void* ChurnThread( void* )
+{
+	for ( int i=0; i<CHURN_ITERATIONS; i++ )
+	{
+		PROFILE_THIS_BLOCK( "churn" );
+	}
+	return 0;
+}
+
+/// returns true if the retired tree adds up and contexts were reused
+static bool CheckChurn( int num_threads )
+{
+	DProfiler::Clear();
+	std::vector<pthread_t> threads( num_threads );
+	for ( int r=0; r<CHURN_ROUNDS; r++ )
+	{
+		for ( int i=0; i<num_threads; i++ )
+			pthread_create( &threads[i], NULL, ChurnThread, NULL );
+		for ( int i=0; i<num_threads; i++ )
+			pthread_join( threads[i], NULL );
+	}
+
+	std::vector<DProfileContext*> live;
+	DProfiler::GetContexts( live );
+	DProfileSnapshot snapshot;
+	DProfiler::TakeSnapshot( snapshot );
+	const DProfileSectionRecord* churn = snapshot.Find( "churn", -1 );
+	uint64_t expected = (uint64_t)CHURN_ROUNDS*num_threads*CHURN_ITERATIONS;
+	uint64_t calls = churn ? churn->call_count : 0;
+	bool ok = calls == expected && live.size() <= (size_t)num_threads+1;
+	printf( "%d short-lived threads: %llu of %llu calls retired, %d live contexts: %s\n",
+		CHURN_ROUNDS*num_threads, (unsigned long long)calls, (unsigned long long)expected,
+		(int)live.size(), ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+static const int REUSE_ROUNDS = 200;
+static const int REUSE_CALLS = 200;
+// thread_index of the most recently started ReuseThread, or -1
+static std::atomic<int> reuse_latest( -1 );
+static std::atomic<int> reuse_running( 0 );
+
+static std::string ReuseName( int thread_index )
+{
+	char name[32];
+	snprintf( name, 32, "reuse %d", thread_index );
+	return name;
+}
+
+static const int REUSE_PARTS = 100;
+static std::vector<std::string> reuse_parts;
+
+static void* ReuseThread( void* )
+{
+	// each thread's only section is named after its thread_index, so a read
+	// of a reused context's new tree can be told from a read of the old one
+	int index = DProfiler::GetContext()->thread_index;
+	std::string name = ReuseName( index );
+	for ( int i=0; i<REUSE_CALLS; i++ )
+	{
+		PROFILE_SECTION_PUSH_DYNAMIC( name );
+		// a wider tree takes longer to retire, which is when readers race the reuse
+		{
+			PROFILE_THIS_BLOCK_DYNAMIC( reuse_parts[i%REUSE_PARTS] );
+		}
+		PROFILE_SECTION_POP();
+		if ( i == 0 )
+			reuse_latest.store( index );
+	}
+	reuse_running--;
+	return 0;
+}
+
+/// run REUSE_ROUNDS rounds of (intptr_t)arg ReuseThreads
+static void* ReuseStarter( void* arg )
+{
+	int num_threads = (int)(intptr_t)arg;
+	std::vector<pthread_t> threads( num_threads );
+	for ( int r=0; r<REUSE_ROUNDS; r++ )
+	{
+		for ( int i=0; i<num_threads; i++ )
+			pthread_create( &threads[i], NULL, ReuseThread, NULL );
+		for ( int i=0; i<num_threads; i++ )
+			pthread_join( threads[i], NULL );
+	}
+	return 0;
+}
+
+/// count the sections of reused contexts that were read under the wrong
+/// thread, or torn, while short-lived threads keep exiting
+static int ReadWhileReusing( int num_threads )
+{
+	int wrong = 0;
+	DProfileSnapshot snapshot;
+	DProfileSectionSnapshot out;
+	// the latest handle found to each recent thread's section, by
+	// thread_index. the last one found before the thread exited is kept and
+	// read again once its context has been reused.
+	std::vector<DProfileSectionHandle> handles( 4*num_threads );
+	std::vector<int> name_ids( handles.size() );
+	for ( int n=0; reuse_running.load() > 0; n++ )
+	{
+		int latest = reuse_latest.load();
+		if ( latest < 0 )
+			continue;
+		// threads of the current round, some of which are exiting
+		int index = latest - n%num_threads;
+		if ( index < 0 )
+			continue;
+		std::string name = ReuseName( index );
+		DProfileSectionHandle handle = DProfiler::FindSection( name, index );
+		if ( handle.context )
+		{
+			handles[index%handles.size()] = handle;
+			name_ids[index%handles.size()] = DProfiler::InternName( name );
+		}
+		// look up often, to catch threads in the middle of exiting, but read
+		// back less often, as reading copies all of a section's children
+		if ( n%16 )
+			continue;
+		for ( size_t i=0; i<handles.size(); i++ )
+		{
+			if ( !DProfiler::ReadSection( handles[i], out ) )
+				continue;
+			if ( out.name_id != name_ids[i] || out.call_count > (uint64_t)REUSE_CALLS || out.timed_count != out.call_count )
+				wrong++;
+		}
+		DProfiler::TakeSnapshot( snapshot );
+		for ( size_t t=0; t<snapshot.threads.size(); t++ )
+		{
+			const DProfileThreadSnapshot& thread = snapshot.threads[t];
+			if ( thread.thread_index < 0 )
+				continue;
+			std::string expected = ReuseName( thread.thread_index );
+			for ( size_t i=1; i<thread.sections.size(); i++ )
+			{
+				std::string found = DProfiler::GetName( thread.sections[i].name_id );
+				if ( found.compare( 0, 6, "reuse " ) == 0 && found != expected )
+					wrong++;
+			}
+		}
+	}
+	return wrong;
+}
+
+/// returns true if no reader saw a reused context's new tree as its old one
+static bool CheckReuseReads( int num_threads )
+{
+	DProfiler::Clear();
+	reuse_latest = -1;
+	for ( int i=(int)reuse_parts.size(); i<REUSE_PARTS; i++ )
+	{
+		char part[32];
+		snprintf( part, 32, "part %d", i );
+		reuse_parts.push_back( part );
+	}
+	reuse_running = REUSE_ROUNDS*num_threads;
+	// start the threads from another thread, so that this one can read meanwhile
+	pthread_t starter;
+	pthread_create( &starter, NULL, ReuseStarter, (void*)(intptr_t)num_threads );
+	int wrong = ReadWhileReusing( num_threads );
+	pthread_join( starter, NULL );
+	bool ok = wrong == 0;
+	printf( "reads of reused contexts: %d threads, %d sections under the wrong thread or torn: %s\n",
+		REUSE_ROUNDS*num_threads, wrong, ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+static const int TRACE_ROUNDS = 10;
+static const int TRACE_ITERATIONS = 50;
+// thread name by thread_index, filled in by each TraceThread
+static std::vector<std::string> trace_thread_names;
+static DMutex trace_names_lock;
+
+static void* TraceThread( void* arg )
+{
+	char name[32];
+	snprintf( name, 32, "trace %d", (int)(intptr_t)arg );
+	DProfiler::RegisterThread( name );
+	trace_names_lock.Lock();
+	int index = DProfiler::GetContext()->thread_index;
+	if ( index >= (int)trace_thread_names.size() )
+		trace_thread_names.resize( index+1 );
+	trace_thread_names[index] = name;
+	trace_names_lock.Unlock();
+	for ( int i=0; i<TRACE_ITERATIONS; i++ )
+	{
+		PROFILE_THIS_BLOCK( "traced" );
+	}
+	return 0;
+}
+
+class TraceCheckSink : public DTraceSink
+{
+public:
+	TraceCheckSink() : begins( 0 ), misattributed( 0 ) {}
+	void OnEvents( const DTraceThread& thread, const DTraceEvent* events, size_t count )
+	{
+		bool right_thread = thread.thread_index < (int)trace_thread_names.size()
+			&& trace_thread_names[thread.thread_index] == thread.name;
+		for ( size_t i=0; i<count; i++ )
+		{
+			if ( events[i].type != DTraceEvent::BEGIN )
+				continue;
+			begins++;
+			if ( !right_thread )
+				misattributed++;
+		}
+	}
+	uint64_t begins;
+	uint64_t misattributed;
+};
+
+/// returns true if every traced push of every exited thread was drained
+/// once, under the thread that made it
+static bool CheckTraceRetire( int num_threads )
+{
+	DProfiler::Clear();
+	TraceCheckSink sink;
+	// whatever is in the rings from before
+	DProfiler::DrainTrace( &sink );
+	sink.begins = 0;
+	DProfiler::EnableTracing( true );
+	std::vector<pthread_t> threads( num_threads );
+	for ( int r=0; r<TRACE_ROUNDS; r++ )
+	{
+		for ( int i=0; i<num_threads; i++ )
+			pthread_create( &threads[i], NULL, TraceThread, (void*)(intptr_t)( r*num_threads+i ) );
+		for ( int i=0; i<num_threads; i++ )
+			pthread_join( threads[i], NULL );
+		// drain only every other round, so some rings wait out a reuse
+		if ( r%2 )
+			DProfiler::DrainTrace( &sink );
+	}
+	DProfiler::DrainTrace( &sink );
+	DProfiler::EnableTracing( false );
+	uint64_t expected = (uint64_t)TRACE_ROUNDS*num_threads*TRACE_ITERATIONS;
+	bool ok = sink.begins == expected && sink.misattributed == 0;
+	printf( "trace of exited threads: %llu of %llu pushes drained, %llu under the wrong thread: %s\n",
+		(unsigned long long)sink.begins, (unsigned long long)expected,
+		(unsigned long long)sink.misattributed, ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+static const uint32_t OVERWRITE_CAPACITY = 64;
+static const int OVERWRITE_ROUNDS = 20000;
+static std::atomic<bool> overwrite_done( false );
+
+// every field of event n is derived from n, so a torn copy shows
+static void* OverwriteThread( void* arg )
+{
+	DTraceBuffer* ring = (DTraceBuffer*)arg;
+	uint64_t n = 1;
+	for ( int r=0; r<OVERWRITE_ROUNDS; r++ )
+	{
+		// exactly one past full, so the oldest slot is the one being overwritten
+		for ( uint32_t i=0; i<OVERWRITE_CAPACITY+1; i++, n++ )
+			ring->Write( (DTraceEvent::TYPE)( n%6 ), (uint32_t)( n*2654435761u ), n );
+		// let the reader in, even on one CPU
+		sched_yield();
+	}
+	overwrite_done = true;
+	return 0;
+}
+
+/// returns true if every event read from an overwriting ring was whole, in
+/// order, and read or counted as overwritten exactly once
+static bool CheckTraceOverwrite()
+{
+	DTraceBuffer ring( OVERWRITE_CAPACITY, TRACE_OVERWRITE_OLDEST );
+	overwrite_done = false;
+	pthread_t producer;
+	pthread_create( &producer, NULL, OverwriteThread, &ring );
+	DTraceEvent batch[OVERWRITE_CAPACITY];
+	uint64_t read = 0, torn = 0, last = 0;
+	bool done = false;
+	while ( !done )
+	{
+		// one last pass after the producer finishes, for what it left
+		done = overwrite_done.load();
+		size_t count;
+		while ( (count = ring.Read( batch, OVERWRITE_CAPACITY )) > 0 )
+		{
+			for ( size_t i=0; i<count; i++ )
+			{
+				const DTraceEvent& e = batch[i];
+				if ( e.ticks <= last || e.type != e.ticks%6 || e.id != (uint32_t)( e.ticks*2654435761u ) )
+					torn++;
+				last = e.ticks;
+			}
+			read += count;
+		}
+		sched_yield();
+	}
+	pthread_join( producer, NULL );
+	uint64_t written = (uint64_t)OVERWRITE_ROUNDS*( OVERWRITE_CAPACITY+1 );
+	bool ok = torn == 0 && read + ring.GetOverwritten() == written;
+	printf( "overwriting trace ring: %llu read, %llu overwritten of %llu, %llu torn: %s\n",
+		(unsigned long long)read, (unsigned long long)ring.GetOverwritten(),
+		(unsigned long long)written, (unsigned long long)torn, ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+static const int POOL_ROUNDS = 20;
+static const int POOL_PARENTS = 500;
+static const int POOL_CHILDREN = 8;
+static std::atomic<int> pool_tasks_run( 0 );
+
+class PoolChildTask : public DThreadPoolTask
+{
+public:
+	void Run()
+	{
+		pool_tasks_run++;
+		delete this;
+	}
+};
+
+class PoolParentTask : public DThreadPoolTask
+{
+public:
+	PoolParentTask( DThreadPool* _pool ) : pool( _pool ) {}
+	void Run()
+	{
+		for ( int i=0; i<POOL_CHILDREN; i++ )
+			pool->Submit( new PoolChildTask() );
+		pool_tasks_run++;
+		delete this;
+	}
+private:
+	DThreadPool* pool;
+};
+
+/// returns true if every task ran once and Wait() waited for all of them
+static bool CheckPool( int num_threads )
+{
+	DThreadPool pool( "stress pool" );
+	pool.Start( num_threads );
+	bool ok = true;
+	for ( int r=0; r<POOL_ROUNDS; r++ )
+	{
+		int before = pool_tasks_run.load();
+		for ( int i=0; i<POOL_PARENTS; i++ )
+			pool.Submit( new PoolParentTask( &pool ) );
+		pool.Wait();
+		ok = ok && pool_tasks_run.load() - before == POOL_PARENTS*( POOL_CHILDREN+1 );
+	}
+	pool.Stop();
+	DThreadPoolStats stats = pool.GetStats();
+	uint64_t expected = (uint64_t)POOL_ROUNDS*POOL_PARENTS*( POOL_CHILDREN+1 );
+	ok = ok && stats.submitted == expected && stats.completed == expected;
+	printf( "thread pool: %llu of %llu tasks completed, %llu stolen, %llu parks: %s\n",
+		(unsigned long long)stats.completed, (unsigned long long)expected,
+		(unsigned long long)stats.stolen, (unsigned long long)stats.parks, ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+static const int ALLOC_ITERATIONS = 10000;
+// so the compiler can't elide the allocations
+static thread_local int* volatile last_alloc;
+
+static void* AllocThread( void* )
+{
+	for ( int i=0; i<ALLOC_ITERATIONS; i++ )
+	{
+		PROFILE_THIS_BLOCK( "alloc" );
+		last_alloc = new int[4];
+		{
+			PROFILE_THIS_BLOCK( "no alloc" );
+			last_alloc[0] = i;
+		}
+		delete [] last_alloc;
+	}
+	return 0;
+}
+
+/// returns true if every allocation was charged to the section that made it
+/// (needs DProfilerAlloc.cpp linked in)
+static bool CheckAllocations( int num_threads )
+{
+	DProfiler::Clear();
+	DProfiler::EnableAllocationTracking( true );
+	std::vector<pthread_t> threads( num_threads );
+	for ( int i=0; i<num_threads; i++ )
+		pthread_create( &threads[i], NULL, AllocThread, NULL );
+	for ( int i=0; i<num_threads; i++ )
+		pthread_join( threads[i], NULL );
+	DProfileSnapshot snapshot;
+	DProfiler::TakeSnapshot( snapshot );
+	DProfiler::EnableAllocationTracking( false );
+
+	DProfileSnapshot merged;
+	snapshot.Merge( merged );
+	const DProfileThreadSnapshot& thread = merged.threads[0];
+	uint64_t expected = (uint64_t)num_threads*ALLOC_ITERATIONS, allocs = 0, bytes = 0, stray = 0;
+	for ( uint32_t i=1; i<thread.sections.size() && i<thread.allocs.size(); i++ )
+	{
+		std::string name = DProfiler::GetName( thread.sections[i].name_id );
+		if ( name == "alloc" )
+		{
+			allocs = thread.allocs[i].count;
+			bytes = thread.allocs[i].bytes;
+		}
+		else if ( name == "no alloc" )
+			stray = thread.allocs[i].count;
+	}
+	bool ok = allocs == expected && bytes == expected*4*sizeof(int) && stray == 0;
+	printf( "allocation tracking: %llu of %llu allocations charged, %llu misplaced: %s\n",
+		(unsigned long long)allocs, (unsigned long long)expected, (unsigned long long)stray, ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+static const int DUMP_ITERATIONS = 1000;
+
+/// write data to path, then return true if a reader rejects it
+static bool RejectsDump( const char* path, const std::string& data )
+{
+	FILE* file = fopen( path, "wb" );
+	if ( !file )
+		return false;
+	fwrite( data.data(), 1, data.size(), file );
+	fclose( file );
+	DProfileDumpReader reader;
+	return !reader.Open( path );
+}
+
+/// returns true if a dump reads back as written, and a reader rejects
+/// corrupted copies of it instead of reading out of bounds or looping
+static bool CheckDumpRoundtrip()
+{
+	DProfiler::Clear();
+	for ( int i=0; i<DUMP_ITERATIONS; i++ )
+	{
+		PROFILE_THIS_BLOCK( "dump" );
+		{
+			PROFILE_THIS_BLOCK( "dump child" );
+		}
+	}
+	char path[64];
+	snprintf( path, 64, "/tmp/dprofstress-%d.dprof", (int)getpid() );
+	DProfileDumpWriter writer;
+	bool ok = writer.Open( path ) && writer.WriteSnapshot();
+	ok = writer.Close() && ok;
+
+	// a full disk must be reported, not produce a truncated "successful" dump
+	if ( access( "/dev/full", W_OK ) == 0 )
+	{
+		DProfileDumpWriter full;
+		if ( full.Open( "/dev/full" ) && full.WriteSnapshot() && full.Close() )
+		{
+			printf("FAIL dump: writing to /dev/full reported success\n" );
+			ok = false;
+		}
+	}
+
+	uint64_t calls = 0, child_calls = 0;
+	DProfileDumpReader reader;
+	ok = ok && reader.Open( path );
+	for ( uint32_t t=0; ok && t<reader.GetThreadCount(); t++ )
+	{
+		const DProfileDumpSection* sections = reader.GetSections( t );
+		for ( uint32_t i=1; i<reader.GetThread( t )->section_count; i++ )
+		{
+			std::string section_path = reader.GetPath( t, i );
+			if ( section_path == "dump" )
+				calls += sections[i].call_count;
+			else if ( section_path == "dump/dump child" )
+				child_calls += sections[i].call_count;
+		}
+	}
+	reader.Close();
+	ok = ok && calls == (uint64_t)DUMP_ITERATIONS && child_calls == (uint64_t)DUMP_ITERATIONS;
+
+	// find the first string table and thread block through the index
+	std::string data;
+	FILE* file = fopen( path, "rb" );
+	if ( file )
+	{
+		char buffer[4096];
+		size_t got;
+		while ( ( got = fread( buffer, 1, sizeof(buffer), file ) ) > 0 )
+			data.append( buffer, got );
+		fclose( file );
+	}
+	int rejected = 0, corruptions = 0;
+	if ( data.size() > sizeof(DProfileDumpFooter) )
+	{
+		DProfileDumpFooter footer;
+		memcpy( &footer, &data[data.size()-sizeof(footer)], sizeof(footer) );
+		uint64_t strings_offset = 0, thread_offset = 0, thread_entry = 0;
+		for ( uint32_t i=0; i<footer.block_count; i++ )
+		{
+			uint64_t entry = footer.index_offset + i*sizeof(DProfileDumpBlockIndex);
+			DProfileDumpBlockIndex block;
+			memcpy( &block, &data[entry], sizeof(block) );
+			if ( block.type == DProfileDumpBlock::BLOCK_STRINGS && !strings_offset )
+				strings_offset = block.offset;
+			else if ( block.type == DProfileDumpBlock::BLOCK_THREAD && !thread_offset )
+			{
+				thread_offset = block.offset;
+				thread_entry = entry;
+			}
+		}
+		uint64_t section1 = thread_offset + sizeof(DProfileDumpThread) + sizeof(DProfileDumpSection);
+		const uint32_t huge = 0xffffffffu;
+		const uint32_t self = 1;
+		const uint64_t past_end = ~0ull - 4;
+		struct Corruption { uint64_t offset; const void* value; size_t size; } corrupt[] = {
+			// more strings than the block holds
+			{ strings_offset, &huge, sizeof(huge) },
+			// more sections than the block holds
+			{ thread_offset + offsetof( DProfileDumpThread, section_count ), &huge, sizeof(huge) },
+			// a section that is its own parent
+			{ section1 + offsetof( DProfileDumpSection, parent ), &self, sizeof(self) },
+			// a block whose offset + size overflows
+			{ thread_entry + offsetof( DProfileDumpBlockIndex, offset ), &past_end, sizeof(past_end) },
+		};
+		corruptions = sizeof(corrupt)/sizeof(corrupt[0]);
+		for ( int i=0; strings_offset && thread_offset && i<corruptions; i++ )
+		{
+			std::string copy = data;
+			memcpy( &copy[corrupt[i].offset], corrupt[i].value, corrupt[i].size );
+			if ( RejectsDump( path, copy ) )
+				rejected++;
+		}
+	}
+	unlink( path );
+	ok = ok && rejected == corruptions;
+	printf( "dump roundtrip: %llu and %llu of %d calls read back, %d of %d corrupted copies rejected: %s\n",
+		(unsigned long long)calls, (unsigned long long)child_calls, DUMP_ITERATIONS, rejected, corruptions, ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+static const uint32_t LIMIT_SECTIONS = 40;
+static const uint32_t LIMIT_CHILDREN = 16;
+static const int LIMIT_LABELS = 100;
+static const int LIMIT_DEPTH = 10;
+static const int LIMIT_ROUNDS = 10;
+static std::atomic<int> unbalanced_threads( 0 );
+
+static void PushDeep( int depth )
+{
+	if ( depth == 0 )
+		return;
+	PROFILE_THIS_BLOCK( "deep" );
+	PushDeep( depth-1 );
+}
+
+static void* LimitThread( void* )
+{
+	char label[32];
+	{
+		PROFILE_THIS_BLOCK( "limits" );
+		for ( int i=0; i<LIMIT_LABELS; i++ )
+		{
+			snprintf( label, 32, "label %d", i );
+			PROFILE_SECTION_PUSH_DYNAMIC( label );
+			{
+				PROFILE_THIS_BLOCK( "inner" );
+			}
+			PROFILE_SECTION_POP();
+		}
+	}
+	for ( int r=0; r<LIMIT_ROUNDS; r++ )
+		PushDeep( LIMIT_DEPTH );
+	int ids[4];
+	if ( DProfiler::GetCurrentPath( ids, 4 ) != 0 )
+		unbalanced_threads++;
+	return 0;
+}
+
+/// returns true if what didn't fit under the limits went to "(other)" or
+/// was counted as dropped, without unbalancing pushes and pops
+static bool CheckLimits( int num_threads )
+{
+	DProfiler::Clear();
+	DProfiler::SetLimits( LIMIT_SECTIONS, LIMIT_CHILDREN, 0 );
+	std::vector<pthread_t> threads( num_threads );
+	for ( int i=0; i<num_threads; i++ )
+		pthread_create( &threads[i], NULL, LimitThread, NULL );
+	for ( int i=0; i<num_threads; i++ )
+		pthread_join( threads[i], NULL );
+	DProfileSnapshot snapshot;
+	DProfiler::TakeSnapshot( snapshot );
+	DProfiler::SetLimits( 0, 0, 0 );
+
+	// per thread: the toplevel, "limits", LIMIT_CHILDREN labels with their
+	// "inner", "(other)" with its "inner", and whatever "deep" fits after that
+	uint32_t deep_fits = LIMIT_SECTIONS - ( 2 + 2*LIMIT_CHILDREN + 2 );
+	uint64_t other_expected = (uint64_t)num_threads*( LIMIT_LABELS-LIMIT_CHILDREN );
+	uint64_t dropped_expected = (uint64_t)num_threads*LIMIT_ROUNDS*( LIMIT_DEPTH-deep_fits );
+	DProfileSnapshot merged;
+	snapshot.Merge( merged );
+	const DProfileSectionRecord* other = merged.Find( "limits/(other)/inner" );
+	uint64_t other_calls = other ? other->call_count : 0;
+	uint64_t dropped = merged.threads[0].dropped_calls;
+	size_t largest = 0;
+	for ( size_t i=0; i<snapshot.threads.size(); i++ )
+		largest = std::max( largest, snapshot.threads[i].sections.size() );
+	bool ok = other_calls == other_expected && dropped == dropped_expected
+		&& largest <= LIMIT_SECTIONS && unbalanced_threads.load() == 0;
+	printf( "section limits: %llu of %llu calls in (other), %llu of %llu dropped, at most %d sections, %d unbalanced: %s\n",
+		(unsigned long long)other_calls, (unsigned long long)other_expected,
+		(unsigned long long)dropped, (unsigned long long)dropped_expected,
+		(int)largest, unbalanced_threads.load(), ok ? "ok" : "FAILED" );
+	return ok;
+}
+
+int main( int argc, char** argv )
+{
+	int num_threads = argc > 1 ? atoi( argv[1] ) : 8;
+	if ( argc > 2 )
+		iterations = atoi( argv[2] );
+
+	DProfiler::EnableStatistics( true );
+
+	std::vector<pthread_t> threads( num_threads );
+	std::vector<StressResult> results( num_threads );
+	threads_running = num_threads;
+	for ( int i=0; i<num_threads; i++ )
+		pthread_create( &threads[i], NULL, StressThread, &results[i] );
+	int snapshot_count;
+	int torn = SnapshotWhileRunning( snapshot_count );
+	for ( int i=0; i<num_threads; i++ )
+		pthread_join( threads[i], NULL );
+
+	int failures = 0;
+	printf( "%6s  %12s  %12s  %12s  %12s  %s\n", "thread", "wall ms", "outer ms", "inner ms", "max call ms", "" );
+	for ( int i=0; i<num_threads; i++ )
+	{
+		const StressResult& r = results[i];
+		bool ok = r.inner_ticks <= r.outer_ticks
+			&& r.outer_ticks <= r.wall_ticks
+			&& r.max_call_ticks <= r.wall_ticks
+			&& r.outer_count == (uint64_t)iterations
+			&& r.inner_count == (uint64_t)iterations;
+		if ( !ok )
+			failures++;
+		printf( "%6d  %12.3f  %12.3f  %12.3f  %12.5f  %s\n", i,
+			DTime::TicksToMillis( r.wall_ticks ), DTime::TicksToMillis( r.outer_ticks ),
+			DTime::TicksToMillis( r.inner_ticks ), DTime::TicksToMillis( r.max_call_ticks ),
+			ok ? "ok" : "INCONSISTENT" );
+	}
+
+	printf( "%d snapshots taken while running, %d torn sections\n", snapshot_count, torn );
+	if ( torn )
+		failures++;
+
+	if ( !CheckChurn( num_threads ) )
+		failures++;
+
+	if ( !CheckReuseReads( num_threads ) )
+		failures++;
+
+	if ( !CheckTraceRetire( num_threads ) )
+		failures++;
+
+	if ( !CheckTraceOverwrite() )
+		failures++;
+
+	if ( !CheckPool( num_threads ) )
+		failures++;
+
+	if ( !CheckAllocations( num_threads ) )
+		failures++;
+
+	if ( !CheckDumpRoundtrip() )
+		failures++;
+
+	if ( !CheckLimits( num_threads ) )
+		failures++;
+
+	printf( "%d threads x %d iterations: %s\n", num_threads, iterations, failures ? "FAILED" : "passed" );
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,650 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** dprofcrit
+
+ find the critical path through each frame of a trace in a DProfileDump
+ file, across threads, and report how much of each section's time lies on
+ it. record the trace with tracing enabled and a DTraceDrainer writing to a
+ DProfileDumpWriter, call DProfiler::FrameBoundary() once per frame, and
+ name the DSemaphores the threads hand work over with.
+
+ usage:
+    dprofcrit trace.dprof [-t top] [-j workers]
+
+ the path is walked backwards from the end of each frame on the thread that
+ calls FrameBoundary(). while that thread is running, its innermost open
+ section is on the path. at a wait that blocked, the path moves to the
+ thread that signalled the semaphore (the latest SIGNAL between the wait's
+ start and end) at the moment it signalled. a blocked wait with no signal
+ in the trace stays on the path as waiting time, and the time from a
+ signal to the end of the wait it ended is reported as wakeup latency.
+ everything else a section
+ did in the frame is slack: work that ran in parallel with the path and
+ could have taken longer without making the frame longer.
+
+ traces without FRAME events are treated as one long frame. the trace
+ doesn't show preemption: a thread that was descheduled counts as running
+ in its innermost section, and a Wait() that found the semaphore already
+ signalled doesn't move the path, so on a machine with fewer cores than
+ busy threads the path is less exact.
+
+ the file is mapped, not read in. a first pass over each thread's events
+ (one thread per worker) notes the frame boundaries and, every
+ CHECKPOINT_EVENTS events, the position and the stack of open sections;
+ the second pass hands out batches of frames to the workers, each of which
+ replays every thread from the nearest checkpoint, so memory use depends
+ on the length of one frame rather than of the trace.
+
+*/
+
+#include "DProfileDump.h"
+#include "DThreadPool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static const uint64_t CHECKPOINT_EVENTS = 4096;
+
+/// where a thread's events stood just before one of its events
+struct Checkpoint
+{
+	uint64_t ticks;
+	uint32_t block;
+	uint64_t offset;
+	/// name ids of the open sections, outermost first
+	std::vector<uint32_t> stack;
+};
+
+/// one thread's events, which may be spread over many blocks of the file
+struct ThreadTrace
+{
+	ThreadTrace() : thread_index( 0 ), event_count( 0 ), first_ticks( 0 ), last_ticks( 0 ) {}
+	uint32_t thread_index;
+	/// indices of the reader's event blocks for this thread, in file order
+	std::vector<uint32_t> blocks;
+	uint64_t event_count;
+	uint64_t first_ticks;
+	uint64_t last_ticks;
+	std::vector<Checkpoint> checkpoints;
+	std::vector<uint64_t> frames;
+};
+
+/// reads one thread's events in order
+class EventCursor
+{
+public:
+	EventCursor( const DProfileDumpReader& _reader, const ThreadTrace& _thread, uint32_t _block = 0, uint64_t _offset = 0 )
+		: reader( _reader ), thread( _thread ), block( _block ), offset( _offset ) {}
+
+	/// the next event, or NULL at the end
+	const DTraceEvent* Next()
+	{
+		while ( block < thread.blocks.size() )
+		{
+			uint32_t b = thread.blocks[block];
+			if ( offset < reader.GetEventCount( b ) )
+				return &reader.GetEvents( b )[offset++];
+			block++;
+			offset = 0;
+		}
+		return NULL;
+	}
+	/// position of the event Next() returns next
+	uint32_t GetBlock() const { return block; }
+	uint64_t GetOffset() const { return offset; }
+
+private:
+	const DProfileDumpReader& reader;
+	const ThreadTrace& thread;
+	uint32_t block;
+	uint64_t offset;
+};
+
+/// first pass: checkpoints and frame boundaries for one thread
+class ScanTask : public DThreadPoolTask
+{
+public:
+	ScanTask( const DProfileDumpReader& _reader, ThreadTrace& _thread ) : reader( _reader ), thread( _thread ) {}
+
+	void Run()
+	{
+		EventCursor cursor( reader, thread );
+		std::vector<uint32_t> stack;
+		uint64_t count = 0;
+		uint32_t block = cursor.GetBlock();
+		uint64_t offset = cursor.GetOffset();
+		while ( const DTraceEvent* e = cursor.Next() )
+		{
+			if ( count % CHECKPOINT_EVENTS == 0 )
+			{
+				thread.checkpoints.push_back( Checkpoint() );
+				Checkpoint& checkpoint = thread.checkpoints.back();
+				checkpoint.ticks = e->ticks;
+				checkpoint.block = block;
+				checkpoint.offset = offset;
+				checkpoint.stack = stack;
+			}
+			if ( count == 0 )
+				thread.first_ticks = e->ticks;
+			thread.last_ticks = e->ticks;
+			count++;
+
+			if ( e->type == DTraceEvent::BEGIN )
+				stack.push_back( e->id );
+			// with TRACE_OVERWRITE_OLDEST the trace can start inside sections
+			else if ( e->type == DTraceEvent::END && !stack.empty() )
+				stack.pop_back();
+			else if ( e->type == DTraceEvent::FRAME )
+				thread.frames.push_back( e->ticks );
+			block = cursor.GetBlock();
+			offset = cursor.GetOffset();
+		}
+		thread.event_count = count;
+	}
+
+private:
+	const DProfileDumpReader& reader;
+	ThreadTrace& thread;
+};
+
+/// totals for one section (a path through the tree of name ids)
+struct SectionTotals
+{
+	SectionTotals() : calls( 0 ), self_ticks( 0 ), wait_ticks( 0 ), path_ticks( 0 ) {}
+	void Add( const SectionTotals& other )
+	{
+		calls += other.calls;
+		self_ticks += other.self_ticks;
+		wait_ticks += other.wait_ticks;
+		path_ticks += other.path_ticks;
+	}
+	uint64_t calls;
+	/// while it was the innermost open section, in frames
+	uint64_t self_ticks;
+	/// of self_ticks, blocked in semaphore waits
+	uint64_t wait_ticks;
+	/// of self_ticks, on the critical path
+	uint64_t path_ticks;
+};
+
+/// section tree for one worker, keyed by (parent, name id)
+class SectionTree
+{
+public:
+	SectionTree() { nodes.push_back( Node() ); }
+
+	uint32_t GetChild( uint32_t parent, uint32_t name )
+	{
+		uint64_t key = ( (uint64_t)parent << 32 ) | name;
+		std::unordered_map<uint64_t, uint32_t>::iterator it = children.find( key );
+		if ( it != children.end() )
+			return it->second;
+		uint32_t index = nodes.size();
+		nodes.push_back( Node() );
+		nodes.back().parent = parent;
+		nodes.back().name = name;
+		children[key] = index;
+		return index;
+	}
+	SectionTotals& Totals( uint32_t node ) { return nodes[node].totals; }
+
+	/// add every section's totals to out, by path
+	void AddTo( const DProfileDumpReader& reader, std::map<std::string, SectionTotals>& out ) const
+	{
+		// parents come before their children
+		std::vector<std::string> paths( nodes.size() );
+		for ( size_t i=1; i<nodes.size(); i++ )
+		{
+			const char* name = reader.GetString( nodes[i].name );
+			std::string label = name ? name : "?";
+			paths[i] = nodes[i].parent ? paths[nodes[i].parent] + "/" + label : label;
+			out[paths[i]].Add( nodes[i].totals );
+		}
+		out["(no section)"].Add( nodes[0].totals );
+	}
+
+private:
+	struct Node
+	{
+		Node() : parent( 0 ), name( 0 ) {}
+		uint32_t parent;
+		uint32_t name;
+		SectionTotals totals;
+	};
+	std::vector<Node> nodes;
+	std::unordered_map<uint64_t, uint32_t> children;
+};
+
+/// second pass: critical paths through a range of frames
+class FrameTask : public DThreadPoolTask
+{
+public:
+	FrameTask( const DProfileDumpReader& _reader, const std::vector<ThreadTrace>& _threads, int _frame_thread,
+			const std::vector<uint64_t>& _frames, size_t _first, size_t _last )
+		: frame_ticks( 0 ), path_ticks( 0 ), wakeup_ticks( 0 ), handoffs( 0 ), thread_path_ticks( _threads.size(), 0 ),
+			reader( _reader ), threads( _threads ), frame_thread( _frame_thread ), frames( _frames ), first( _first ), last( _last ) {}
+
+	void Run()
+	{
+		for ( size_t f=first; f<last; f++ )
+			RunFrame( frames[f], frames[f+1] );
+	}
+
+	SectionTree tree;
+	uint64_t frame_ticks;
+	uint64_t path_ticks;
+	uint64_t wakeup_ticks;
+	uint64_t handoffs;
+	std::vector<uint64_t> thread_path_ticks;
+
+private:
+	/// the innermost section changed at ticks
+	struct Change
+	{
+		uint64_t ticks;
+		uint32_t node;
+	};
+	struct Wait
+	{
+		uint64_t begin;
+		uint64_t end;
+		uint32_t semaphore;
+		uint32_t node;
+	};
+	struct Signal
+	{
+		uint32_t semaphore;
+		uint64_t ticks;
+		uint32_t thread;
+		bool operator<( const Signal& other ) const
+		{
+			return semaphore != other.semaphore ? semaphore < other.semaphore : ticks < other.ticks;
+		}
+	};
+	struct Timeline
+	{
+		std::vector<Change> changes;
+		std::vector<Wait> waits;
+	};
+
+	/// replay thread t over [start, end), filling in its timeline and adding its signals
+	void Replay( uint32_t t, uint64_t start, uint64_t end, Timeline& line )
+	{
+		const ThreadTrace& thread = threads[t];
+		line.changes.clear();
+		line.waits.clear();
+		if ( thread.checkpoints.empty() || thread.first_ticks >= end || thread.last_ticks < start )
+			return;
+
+		// the last checkpoint at or before start
+		size_t c = 0, hi = thread.checkpoints.size();
+		while ( hi - c > 1 )
+		{
+			size_t mid = ( c + hi )/2;
+			if ( thread.checkpoints[mid].ticks <= start )
+				c = mid;
+			else
+				hi = mid;
+		}
+		const Checkpoint& checkpoint = thread.checkpoints[c];
+		stack.clear();
+		for ( size_t i=0; i<checkpoint.stack.size(); i++ )
+			stack.push_back( tree.GetChild( stack.empty() ? 0 : stack.back(), checkpoint.stack[i] ) );
+
+		EventCursor cursor( reader, thread, checkpoint.block, checkpoint.offset );
+		bool started = false;
+		bool waiting = false;
+		uint64_t wait_begin = 0;
+		uint32_t wait_id = 0;
+		while ( const DTraceEvent* e = cursor.Next() )
+		{
+			if ( e->ticks >= end )
+				break;
+			if ( !started && e->ticks >= start )
+			{
+				Change change = { start, stack.empty() ? 0 : stack.back() };
+				line.changes.push_back( change );
+				started = true;
+			}
+			uint32_t current = stack.empty() ? 0 : stack.back();
+			switch ( e->type )
+			{
+				case DTraceEvent::BEGIN:
+					stack.push_back( tree.GetChild( current, e->id ) );
+					if ( started )
+						tree.Totals( stack.back() ).calls++;
+					break;
+				case DTraceEvent::END:
+					if ( !stack.empty() )
+						stack.pop_back();
+					break;
+				case DTraceEvent::WAIT_BEGIN:
+					waiting = true;
+					wait_begin = e->ticks;
+					wait_id = e->id;
+					break;
+				case DTraceEvent::WAIT_END:
+					if ( waiting && started )
+					{
+						Wait wait = { wait_begin, e->ticks, e->id, current };
+						line.waits.push_back( wait );
+					}
+					waiting = false;
+					break;
+				case DTraceEvent::SIGNAL:
+					if ( started )
+					{
+						Signal signal = { e->id, e->ticks, t };
+						signals.push_back( signal );
+					}
+					break;
+			}
+			if ( started && ( stack.empty() ? 0 : stack.back() ) != current )
+			{
+				Change change = { e->ticks, stack.empty() ? 0 : stack.back() };
+				line.changes.push_back( change );
+			}
+		}
+		if ( !started )
+		{
+			Change change = { start, stack.empty() ? 0 : stack.back() };
+			line.changes.push_back( change );
+		}
+		// still blocked at the end of the frame
+		if ( waiting )
+		{
+			Wait wait = { wait_begin, end, wait_id, stack.empty() ? 0 : stack.back() };
+			line.waits.push_back( wait );
+		}
+
+		// self and wait time
+		for ( size_t i=0; i<line.changes.size(); i++ )
+		{
+			uint64_t until = i+1 < line.changes.size() ? line.changes[i+1].ticks : end;
+			tree.Totals( line.changes[i].node ).self_ticks += until - line.changes[i].ticks;
+		}
+		for ( size_t i=0; i<line.waits.size(); i++ )
+			tree.Totals( line.waits[i].node ).wait_ticks += line.waits[i].end - std::max( line.waits[i].begin, start );
+	}
+
+	/// put [from, to) on thread t on the path
+	void AddPath( uint32_t t, uint64_t from, uint64_t to )
+	{
+		if ( to <= from )
+			return;
+		const std::vector<Change>& changes = lines[t].changes;
+		thread_path_ticks[t] += to - from;
+		path_ticks += to - from;
+		// the last change at or before from
+		size_t i = 0, hi = changes.size();
+		while ( hi - i > 1 )
+		{
+			size_t mid = ( i + hi )/2;
+			if ( changes[mid].ticks <= from )
+				i = mid;
+			else
+				hi = mid;
+		}
+		for ( ; i<changes.size() && changes[i].ticks < to; i++ )
+		{
+			uint64_t begin = std::max( changes[i].ticks, from );
+			uint64_t end = i+1 < changes.size() ? std::min( changes[i+1].ticks, to ) : to;
+			if ( end > begin )
+				tree.Totals( changes[i].node ).path_ticks += end - begin;
+		}
+	}
+
+	/// the latest signal of semaphore between begin and end, or NULL
+	const Signal* FindSignal( uint32_t semaphore, uint64_t begin, uint64_t end ) const
+	{
+		Signal key = { semaphore, end, 0 };
+		std::vector<Signal>::const_iterator it = std::upper_bound( signals.begin(), signals.end(), key );
+		if ( it == signals.begin() )
+			return NULL;
+		--it;
+		if ( it->semaphore != semaphore || it->ticks < begin )
+			return NULL;
+		return &*it;
+	}
+
+	void RunFrame( uint64_t start, uint64_t end )
+	{
+		if ( end <= start )
+			return;
+		frame_ticks += end - start;
+		lines.resize( threads.size() );
+		signals.clear();
+		size_t wait_count = 0;
+		for ( uint32_t t=0; t<threads.size(); t++ )
+		{
+			Replay( t, start, end, lines[t] );
+			wait_count += lines[t].waits.size();
+		}
+		std::sort( signals.begin(), signals.end() );
+
+		// walk back from the end of the frame. time never goes forwards, but
+		// it can stand still, so bound the number of steps.
+		uint32_t t = frame_thread;
+		uint64_t now = end;
+		for ( size_t steps=0; now > start && steps <= wait_count; steps++ )
+		{
+			const std::vector<Wait>& waits = lines[t].waits;
+			// the latest wait that blocked before now
+			size_t w = waits.size();
+			while ( w > 0 && ( waits[w-1].end > now || waits[w-1].begin >= now ) )
+				w--;
+			if ( w == 0 || waits[w-1].end <= start )
+			{
+				AddPath( t, start, now );
+				now = start;
+				break;
+			}
+			const Wait& wait = waits[w-1];
+			AddPath( t, wait.end, now );
+			const Signal* signal = wait.semaphore ? FindSignal( wait.semaphore, wait.begin, wait.end ) : NULL;
+			if ( signal )
+			{
+				// the path went through whoever woke us
+				if ( signal->thread != t )
+					handoffs++;
+				t = signal->thread;
+				now = std::max( signal->ticks, start );
+				wakeup_ticks += wait.end - now;
+			}
+			else
+			{
+				// woken from outside the trace: the wait itself is on the path
+				AddPath( t, std::max( wait.begin, start ), wait.end );
+				now = std::max( wait.begin, start );
+			}
+		}
+	}
+
+	const DProfileDumpReader& reader;
+	const std::vector<ThreadTrace>& threads;
+	int frame_thread;
+	const std::vector<uint64_t>& frames;
+	size_t first;
+	size_t last;
+
+	// scratch, reused from frame to frame
+	std::vector<Timeline> lines;
+	std::vector<Signal> signals;
+	std::vector<uint32_t> stack;
+};
+
+static bool ComparePath( const std::pair<std::string, SectionTotals>& a, const std::pair<std::string, SectionTotals>& b )
+{
+	if ( a.second.path_ticks != b.second.path_ticks )
+		return a.second.path_ticks > b.second.path_ticks;
+	return a.second.self_ticks > b.second.self_ticks;
+}
+
+int main( int argc, char** argv )
+{
+	if ( argc < 2 )
+	{
+		fprintf(stderr, "usage: %s trace.dprof [-t top] [-j workers]\n", argv[0] );
+		return 2;
+	}
+	size_t top = 30;
+	int workers = 0;
+	for ( int i=2; i<argc; i++ )
+	{
+		if ( strcmp( argv[i], "-t" ) == 0 && i+1 < argc )
+			top = atoi( argv[++i] );
+		else if ( strcmp( argv[i], "-j" ) == 0 && i+1 < argc )
+			workers = atoi( argv[++i] );
+	}
+
+	DProfileDumpReader reader;
+	if ( !reader.Open( argv[1] ) )
+		return 2;
+	double millis_per_tick = reader.GetMillisPerTick();
+
+	// gather each thread's event blocks
+	std::vector<ThreadTrace> threads;
+	std::map<uint32_t, size_t> thread_lookup;
+	for ( uint32_t b=0; b<reader.GetEventBlockCount(); b++ )
+	{
+		uint32_t index = reader.GetEventBlockThread( b );
+		std::map<uint32_t, size_t>::iterator it = thread_lookup.find( index );
+		if ( it == thread_lookup.end() )
+		{
+			it = thread_lookup.insert( std::make_pair( index, threads.size() ) ).first;
+			threads.push_back( ThreadTrace() );
+			threads.back().thread_index = index;
+		}
+		threads[it->second].blocks.push_back( b );
+	}
+	if ( threads.empty() )
+	{
+		fprintf(stderr, "%s: %s has no trace events\n", argv[0], argv[1] );
+		return 1;
+	}
+
+	DThreadPool pool( "dprofcrit" );
+	pool.Start( workers );
+	std::vector<ScanTask*> scans;
+	for ( size_t i=0; i<threads.size(); i++ )
+	{
+		scans.push_back( new ScanTask( reader, threads[i] ) );
+		pool.Submit( scans.back() );
+	}
+	pool.Wait();
+	for ( size_t i=0; i<scans.size(); i++ )
+		delete scans[i];
+
+	// frames are delimited by the thread that calls FrameBoundary(); without
+	// one, the whole trace is a frame, ending on the thread that ran longest
+	int frame_thread = -1;
+	for ( size_t i=0; i<threads.size(); i++ )
+	{
+		if ( !threads[i].frames.empty() && ( frame_thread < 0 || threads[i].frames.size() > threads[frame_thread].frames.size() ) )
+			frame_thread = i;
+	}
+	std::vector<uint64_t> frames;
+	if ( frame_thread >= 0 )
+		frames = threads[frame_thread].frames;
+	else
+	{
+		uint64_t first = UINT64_MAX;
+		frame_thread = 0;
+		for ( size_t i=0; i<threads.size(); i++ )
+		{
+			if ( threads[i].event_count == 0 )
+				continue;
+			first = std::min( first, threads[i].first_ticks );
+			if ( threads[i].last_ticks > threads[frame_thread].last_ticks )
+				frame_thread = i;
+		}
+		frames.push_back( first );
+		frames.push_back( threads[frame_thread].last_ticks+1 );
+	}
+	size_t frame_count = frames.size() > 0 ? frames.size()-1 : 0;
+	if ( frame_count == 0 )
+	{
+		fprintf(stderr, "%s: %s has only one frame boundary\n", argv[0], argv[1] );
+		return 1;
+	}
+
+	// a few batches per worker, so that they finish together
+	size_t batch = std::max( (size_t)1, frame_count / ( pool.GetWorkerCount()*4 ) );
+	std::vector<FrameTask*> tasks;
+	for ( size_t f=0; f<frame_count; f+=batch )
+	{
+		tasks.push_back( new FrameTask( reader, threads, frame_thread, frames, f, std::min( f+batch, frame_count ) ) );
+		pool.Submit( tasks.back() );
+	}
+	pool.Wait();
+	pool.Stop();
+
+	std::map<std::string, SectionTotals> sections;
+	uint64_t frame_ticks = 0, path_ticks = 0, wakeup_ticks = 0, handoffs = 0;
+	std::vector<uint64_t> thread_path_ticks( threads.size(), 0 );
+	for ( size_t i=0; i<tasks.size(); i++ )
+	{
+		tasks[i]->tree.AddTo( reader, sections );
+		frame_ticks += tasks[i]->frame_ticks;
+		path_ticks += tasks[i]->path_ticks;
+		wakeup_ticks += tasks[i]->wakeup_ticks;
+		handoffs += tasks[i]->handoffs;
+		for ( size_t t=0; t<threads.size(); t++ )
+			thread_path_ticks[t] += tasks[i]->thread_path_ticks[t];
+		delete tasks[i];
+	}
+
+	uint64_t events = 0;
+	for ( size_t i=0; i<threads.size(); i++ )
+		events += threads[i].event_count;
+	printf( "%llu events from %u threads, %u frames averaging %.3f ms\n", (unsigned long long)events, (unsigned)threads.size(),
+		(unsigned)frame_count, frame_ticks*millis_per_tick/frame_count );
+	printf( "critical path averages %.3f ms (%.1f%% of the frame), with %.1f handoffs between threads and %.3f ms of wakeup latency\n",
+		path_ticks*millis_per_tick/frame_count, frame_ticks ? 100.0*path_ticks/frame_ticks : 0.0, (double)handoffs/frame_count,
+		wakeup_ticks*millis_per_tick/frame_count );
+	for ( size_t i=0; i<threads.size(); i++ )
+	{
+		if ( thread_path_ticks[i] )
+			printf( "  thread %u%s: %.1f%% of the path\n", threads[i].thread_index, (int)i == frame_thread ? " (frames)" : "",
+				path_ticks ? 100.0*thread_path_ticks[i]/path_ticks : 0.0 );
+	}
+	printf( "\nper frame:\n" );
+
+	std::vector<std::pair<std::string, SectionTotals> > sorted( sections.begin(), sections.end() );
+	std::sort( sorted.begin(), sorted.end(), ComparePath );
+	printf( "%-50s %10s %12s %12s %12s %12s %7s\n", "section", "calls", "self ms", "waiting ms", "on path ms", "slack ms", "path %" );
+	for ( size_t i=0; i<sorted.size() && i<top; i++ )
+	{
+		const SectionTotals& s = sorted[i].second;
+		if ( s.self_ticks == 0 )
+			continue;
+		double per_frame = millis_per_tick/frame_count;
+		printf( "%-50s %10.1f %12.4f %12.4f %12.4f %12.4f %6.1f%%\n", sorted[i].first.c_str(), (double)s.calls/frame_count,
+			s.self_ticks*per_frame, s.wait_ticks*per_frame, s.path_ticks*per_frame, ( s.self_ticks - s.path_ticks )*per_frame,
+			path_ticks ? 100.0*s.path_ticks/path_ticks : 0.0 );
+	}
+	return 0;
+}
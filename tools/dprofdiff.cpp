@@ -0,0 +1,140 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** dprofdiff
+
+ compare two DProfileDump files section by section. sections are matched by
+ path ("frame/render/shadow") and summed over all threads. runs of different
+ lengths are compared by the average time per call, so a longer or busier
+ run b doesn't look like a regression.
+
+ usage:
+    dprofdiff a.dprof              print the sections in a.dprof
+    dprofdiff a.dprof b.dprof [threshold_percent]
+                                   print totals and per-call averages in a and
+                                   b, and the change per call. with a
+                                   threshold, exit 1 if any section that took
+                                   at least 1% of the total in a got slower per
+                                   call by more than threshold_percent (for CI).
+
+*/
+
+#include "DProfileDump.h"
+
+#include <stdlib.h>
+#include <map>
+#include <string>
+
+struct PathTotals
+{
+	PathTotals() : calls( 0 ), millis( 0 ) {}
+	uint64_t calls;
+	double millis;
+
+	double GetAverageMillis() const { return calls ? millis/(double)calls : 0.0; }
+};
+
+typedef std::map<std::string, PathTotals> PathMap;
+
+static bool Load( const char* path, PathMap& out, double& total_millis )
+{
+	DProfileDumpReader reader;
+	if ( !reader.Open( path ) )
+		return false;
+	total_millis = 0;
+	double millis_per_tick = reader.GetMillisPerTick();
+	for ( uint32_t t=0; t<reader.GetThreadCount(); t++ )
+	{
+		const DProfileDumpSection* sections = reader.GetSections( t );
+		for ( uint32_t i=1; i<reader.GetThread( t )->section_count; i++ )
+		{
+			PathTotals& totals = out[reader.GetPath( t, i )];
+			totals.calls += sections[i].call_count;
+			double millis = sections[i].GetTotalTicks()*millis_per_tick;
+			totals.millis += millis;
+			if ( sections[i].parent == 0 )
+				total_millis += millis;
+		}
+	}
+	return true;
+}
+
+int main( int argc, char** argv )
+{
+	if ( argc < 2 || argc > 4 )
+	{
+		fprintf(stderr, "usage: %s a.dprof [b.dprof [threshold_percent]]\n", argv[0] );
+		return 2;
+	}
+
+	PathMap a, b;
+	double total_a, total_b;
+	if ( !Load( argv[1], a, total_a ) )
+		return 2;
+
+	if ( argc == 2 )
+	{
+		printf("%-60s %12s %14s\n", "section", "calls", "total ms" );
+		for ( PathMap::iterator it = a.begin(); it != a.end(); ++it )
+			printf("%-60s %12llu %14.6f\n", it->first.c_str(), (unsigned long long)it->second.calls, it->second.millis );
+		return 0;
+	}
+
+	if ( !Load( argv[2], b, total_b ) )
+		return 2;
+	bool check = argc == 4;
+	double threshold = check ? atof( argv[3] ) : 0;
+
+	// union of paths
+	for ( PathMap::iterator it = a.begin(); it != a.end(); ++it )
+		b[it->first];
+	for ( PathMap::iterator it = b.begin(); it != b.end(); ++it )
+		a[it->first];
+
+	int regressions = 0;
+	printf("%-60s %14s %14s %12s %12s %9s\n", "section", "a ms", "b ms", "a ms/call", "b ms/call", "change" );
+	for ( PathMap::iterator it = a.begin(); it != a.end(); ++it )
+	{
+		const PathTotals& ta = it->second;
+		const PathTotals& tb = b[it->first];
+		double average_a = ta.GetAverageMillis();
+		double average_b = tb.GetAverageMillis();
+		char change[32];
+		if ( ta.calls && tb.calls && average_a > 0 )
+			snprintf( change, 32, "%+8.1f%%", 100.0*( average_b-average_a )/average_a );
+		else
+			snprintf( change, 32, "%9s", tb.calls && !ta.calls ? "new" : ( ta.calls && !tb.calls ? "gone" : "" ) );
+
+		bool regressed = check && ta.calls && tb.calls && average_a > 0 && ta.millis >= 0.01*total_a
+			&& 100.0*( average_b-average_a )/average_a > threshold;
+		if ( regressed )
+			regressions++;
+		printf("%-60s %14.6f %14.6f %12.6f %12.6f %s%s\n", it->first.c_str(), ta.millis, tb.millis, average_a, average_b,
+			change, regressed ? "  <-- regression" : "" );
+	}
+	printf("%-60s %14.6f %14.6f\n", "total", total_a, total_b );
+
+	if ( regressions )
+	{
+		printf("%i section(s) slower per call by more than %.1f%%\n", regressions, threshold );
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ Copyright 2008, 2009, 2010 Damian Stewart <damian@frey.co.nz>.
+ Distributed under the terms of the GNU General Public License v3.
+
+ This file is part of The Artvertiser.
+
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** dprofwatch
+
+ connect to a DProfileReporter and print each interval's busiest sections.
+ sections are matched by path and summed over all threads.
+
+ usage:
+    dprofwatch <socket path | [host:]port> [-n intervals] [-t top] [command ...]
+
+ each command (eg "categories 0x3", "statistics on"; see DProfileReporter.h)
+ is sent once on connecting, and the reporter's replies are printed.
+
+*/
+
+#include "DProfileDump.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+struct PathInterval
+{
+	PathInterval() : calls( 0 ), ticks( 0 ), p99_ticks( 0 ) {}
+	uint64_t calls;
+	double ticks;
+	/// highest of any thread
+	uint64_t p99_ticks;
+};
+
+static bool ReadFully( int fd, void* data, size_t size )
+{
+	char* p = (char*)data;
+	while ( size > 0 )
+	{
+		ssize_t got = read( fd, p, size );
+		if ( got < 0 && errno == EINTR )
+			continue;
+		if ( got <= 0 )
+			return false;
+		p += got;
+		size -= got;
+	}
+	return true;
+}
+
+static int Connect( const char* where )
+{
+	// a path if it has a '/', otherwise [host:]port
+	if ( strchr( where, '/' ) )
+	{
+		struct sockaddr_un address;
+		memset( &address, 0, sizeof(address) );
+		address.sun_family = AF_UNIX;
+		strncpy( address.sun_path, where, sizeof(address.sun_path)-1 );
+		int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if ( fd >= 0 && connect( fd, (struct sockaddr*)&address, sizeof(address) ) == 0 )
+			return fd;
+		if ( fd >= 0 )
+			close( fd );
+		return -1;
+	}
+	std::string host = "127.0.0.1", port = where;
+	size_t colon = port.rfind( ':' );
+	if ( colon != std::string::npos )
+	{
+		host = port.substr( 0, colon );
+		port = port.substr( colon+1 );
+	}
+	struct addrinfo hints, *result;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo( host.c_str(), port.c_str(), &hints, &result ) != 0 )
+		return -1;
+	int fd = -1;
+	for ( struct addrinfo* a = result; a && fd < 0; a = a->ai_next )
+	{
+		fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+		if ( fd >= 0 && connect( fd, a->ai_addr, a->ai_addrlen ) != 0 )
+		{
+			close( fd );
+			fd = -1;
+		}
+	}
+	freeaddrinfo( result );
+	return fd;
+}
+
+static bool CompareTicks( const std::pair<std::string, PathInterval>& a, const std::pair<std::string, PathInterval>& b )
+{
+	return a.second.ticks > b.second.ticks;
+}
+
+int main( int argc, char** argv )
+{
+	if ( argc < 2 )
+	{
+		fprintf(stderr, "usage: %s <socket path | [host:]port> [-n intervals] [-t top] [command ...]\n", argv[0] );
+		return 2;
+	}
+	int intervals = -1;
+	size_t top = 20;
+	std::string commands;
+	for ( int i=2; i<argc; i++ )
+	{
+		if ( strcmp( argv[i], "-n" ) == 0 && i+1 < argc )
+			intervals = atoi( argv[++i] );
+		else if ( strcmp( argv[i], "-t" ) == 0 && i+1 < argc )
+			top = atoi( argv[++i] );
+		else
+			commands += std::string( argv[i] ) + "\n";
+	}
+
+	int fd = Connect( argv[1] );
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "%s: couldn't connect to %s\n", argv[0], argv[1] );
+		return 2;
+	}
+	if ( !commands.empty() && write( fd, commands.data(), commands.size() ) != (ssize_t)commands.size() )
+		fprintf(stderr, "%s: couldn't send commands\n", argv[0] );
+
+	DProfileDumpHeader header;
+	if ( !ReadFully( fd, &header, sizeof(header) ) || header.magic != DProfileDumpHeader::MAGIC || header.version != DProfileDumpHeader::VERSION )
+	{
+		fprintf(stderr, "%s: %s is not a DProfileReporter\n", argv[0], argv[1] );
+		return 2;
+	}
+	double millis_per_tick = header.millis_per_tick;
+
+	std::vector<std::string> names;
+	DProfileDumpInterval interval;
+	memset( &interval, 0, sizeof(interval) );
+	uint32_t blocks_left = 0;
+	std::map<std::string, PathInterval> paths;
+	std::vector<std::string> thread_paths;
+	std::vector<char> payload;
+	while ( intervals != 0 )
+	{
+		DProfileDumpBlock block;
+		if ( !ReadFully( fd, &block, sizeof(block) ) )
+			break;
+		payload.resize( block.size + ( ( 8 - ( block.size & 7 ) ) & 7 ) );
+		if ( !ReadFully( fd, payload.data(), payload.size() ) )
+			break;
+		const char* data = payload.data();
+
+		if ( block.type == DProfileDumpBlock::BLOCK_STRINGS && block.size >= sizeof(uint32_t) )
+		{
+			uint32_t count = *(const uint32_t*)data;
+			uint64_t offsets_size = sizeof(uint32_t)*( (uint64_t)count+1 );
+			if ( offsets_size > block.size )
+				break;
+			const uint32_t* offsets = (const uint32_t*)data + 1;
+			const char* chars = data + offsets_size;
+			uint64_t chars_size = block.size - offsets_size;
+			names.assign( count, std::string() );
+			for ( uint32_t i=0; i<count; i++ )
+			{
+				if ( offsets[i] < chars_size )
+					names[i] = std::string( chars + offsets[i], strnlen( chars + offsets[i], chars_size - offsets[i] ) );
+			}
+			continue;
+		}
+		if ( block.type == DProfileDumpBlock::BLOCK_MESSAGE )
+		{
+			printf( "%.*s\n", (int)block.size, data );
+			fflush( stdout );
+			continue;
+		}
+		if ( block.type == DProfileDumpBlock::BLOCK_INTERVAL && block.size >= sizeof(interval) )
+		{
+			memcpy( &interval, data, sizeof(interval) );
+			blocks_left = interval.block_count;
+			paths.clear();
+		}
+		else if ( block.type == DProfileDumpBlock::BLOCK_THREAD && block.size >= sizeof(DProfileDumpThread) )
+		{
+			const DProfileDumpThread* thread = (const DProfileDumpThread*)data;
+			const DProfileDumpSection* sections = (const DProfileDumpSection*)( thread+1 );
+			uint32_t count = thread->section_count;
+			if ( block.size < sizeof(DProfileDumpThread) + count*sizeof(DProfileDumpSection) )
+				break;
+			// parents come before their children
+			thread_paths.assign( count, std::string() );
+			for ( uint32_t i=1; i<count; i++ )
+			{
+				uint32_t name = sections[i].name;
+				std::string label = name < names.size() ? names[name] : "?";
+				uint32_t parent = sections[i].parent < i ? sections[i].parent : 0;
+				thread_paths[i] = parent ? thread_paths[parent] + "/" + label : label;
+				PathInterval& p = paths[thread_paths[i]];
+				p.calls += sections[i].call_count;
+				p.ticks += sections[i].GetTotalTicks();
+			}
+			blocks_left--;
+		}
+		else if ( block.type == DProfileDumpBlock::BLOCK_STATS )
+		{
+			const DProfileDumpSectionStats* stats = (const DProfileDumpSectionStats*)data;
+			uint32_t count = block.size / sizeof(DProfileDumpSectionStats);
+			for ( uint32_t i=1; i<count && i<thread_paths.size(); i++ )
+			{
+				PathInterval& p = paths[thread_paths[i]];
+				if ( stats[i].p99_ticks > p.p99_ticks )
+					p.p99_ticks = stats[i].p99_ticks;
+			}
+			blocks_left--;
+		}
+		else
+			continue;
+		if ( blocks_left > 0 )
+			continue;
+
+		// the interval is complete
+		std::vector<std::pair<std::string, PathInterval> > sorted( paths.begin(), paths.end() );
+		std::sort( sorted.begin(), sorted.end(), CompareTicks );
+		double length = ( interval.end_ticks - interval.start_ticks )*millis_per_tick;
+		if ( interval.sequence == 0 )
+			printf( "interval %u: totals so far\n", interval.sequence );
+		else
+			printf( "interval %u: %.1f ms\n", interval.sequence, length );
+		printf( "%-60s %12s %14s %12s\n", "section", "calls", "ms", "p99 ms" );
+		for ( size_t i=0; i<sorted.size() && i<top; i++ )
+		{
+			const PathInterval& p = sorted[i].second;
+			if ( p.calls == 0 )
+				break;
+			printf( "%-60s %12llu %14.3f", sorted[i].first.c_str(), (unsigned long long)p.calls, p.ticks*millis_per_tick );
+			if ( p.p99_ticks )
+				printf( " %12.5f", p.p99_ticks*millis_per_tick );
+			printf( "\n" );
+		}
+		printf( "\n" );
+		fflush( stdout );
+		if ( intervals > 0 )
+			intervals--;
+	}
+	close( fd );
+	return 0;
+}